@@ -0,0 +1,60 @@
+#include <string>
+#include <vector>
+#include <benchmark/benchmark.h>
+#include "../core/smtp/base_64.hpp"
+#include "../core/smtp/md_5.hpp"
+
+using namespace md::smtp;
+
+namespace
+{
+    std::string make_payload(size_t size)
+    {
+        std::string payload(size, '\0');
+        for (size_t idx = 0; idx < size; ++idx) {
+            payload[idx] = static_cast<char>('a' + idx % 26);
+        }
+        return payload;
+    }
+}
+
+// AUTH credentials are a few dozen bytes, attachments go up to megabytes
+static void BM_base64_encode(benchmark::State &state)
+{
+    auto payload = make_payload(static_cast<size_t>(state.range(0)));
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(base64_encode(reinterpret_cast<const unsigned char *>(payload.data())
+                                               , static_cast<unsigned int>(payload.size())));
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * state.range(0));
+}
+BENCHMARK(BM_base64_encode)->Arg(32)->Arg(1024)->Arg(64 * 1024);
+
+static void BM_base64_decode(benchmark::State &state)
+{
+    auto payload = make_payload(static_cast<size_t>(state.range(0)));
+    auto encoded = base64_encode(reinterpret_cast<const unsigned char *>(payload.data())
+                                 , static_cast<unsigned int>(payload.size()));
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(base64_decode(encoded));
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * state.range(0));
+}
+BENCHMARK(BM_base64_decode)->Arg(32)->Arg(1024)->Arg(64 * 1024);
+
+// CRAM-MD5 and DIGEST-MD5 hash short challenges
+static void BM_md5_update_finalize(benchmark::State &state)
+{
+    auto payload = make_payload(static_cast<size_t>(state.range(0)));
+    std::vector<unsigned char> input(payload.begin(), payload.end());
+    for (auto _ : state) {
+        MD5 md5;
+        md5.update(input.data(), static_cast<unsigned int>(input.size()));
+        md5.finalize();
+        auto digest = md5.hex_digest();
+        benchmark::DoNotOptimize(digest);
+        delete[] digest;
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * state.range(0));
+}
+BENCHMARK(BM_md5_update_finalize)->Arg(64)->Arg(1024)->Arg(64 * 1024);
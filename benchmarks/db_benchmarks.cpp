@@ -0,0 +1,47 @@
+#include <string>
+#include <vector>
+#include <benchmark/benchmark.h>
+#include <libpq-fe.h>
+#include "../core/database/db_tools.hpp"
+
+using namespace md::service;
+using namespace md::db;
+
+namespace
+{
+    const int FIELD_COUNT = 11;// the columns of core.emails
+
+    // a PGresult built in memory the way libpq returns a SELECT * FROM core.emails batch
+    PGresult *make_result(int row_count)
+    {
+        auto result = PQmakeEmptyPGresult(nullptr, PGRES_TUPLES_OK);
+        std::vector<std::string> names(FIELD_COUNT);
+        std::vector<PGresAttDesc> attributes(FIELD_COUNT);
+        for (int field = 0; field < FIELD_COUNT; ++field) {
+            names[field] = "column" + std::to_string(field);
+            attributes[field] = PGresAttDesc{const_cast<char *>(names[field].c_str()), 0, 0, 0, 25, -1, 0};
+        }
+        PQsetResultAttrs(result, FIELD_COUNT, attributes.data());
+        std::string body(2048, 'x');
+        for (int row = 0; row < row_count; ++row) {
+            for (int field = 0; field < FIELD_COUNT; ++field) {
+                auto value = field == FIELD_COUNT - 1 ? body : "value" + std::to_string(row * FIELD_COUNT + field);
+                PQsetvalue(result, row, field, const_cast<char *>(value.c_str()), static_cast<int>(value.size()));
+            }
+        }
+        return result;
+    }
+}
+
+static void BM_append_query_result(benchmark::State &state)
+{
+    auto result = make_result(static_cast<int>(state.range(0)));
+    for (auto _ : state) {
+        StringListArray rows;
+        append_query_result(result, rows);
+        benchmark::DoNotOptimize(rows.data());
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()) * state.range(0));
+    PQclear(result);
+}
+BENCHMARK(BM_append_query_result)->Arg(100)->Arg(500)->Arg(5000);
@@ -0,0 +1,88 @@
+#include <string>
+#include <vector>
+#include <benchmark/benchmark.h>
+#include "../core/smtp/smtp_server.hpp"
+
+using namespace md::service;
+using namespace md::smtp;
+
+namespace
+{
+    // a core.emails row as SmtpServer::init expects it
+    StringList make_job()
+    {
+        StringList job;
+        job.push_back("1");
+        job.push_back("sender_login");
+        job.push_back("sender_password");
+        job.push_back("Sender Name");
+        job.push_back("sender@example.com");
+        job.push_back("reply@example.com");
+        job.push_back("Monthly newsletter");
+        job.push_back("recipient@example.org");
+        job.push_back("3");
+        job.push_back("mail_distributions");
+        job.push_back(std::string(2048, 'x'));
+        return job;
+    }
+
+    const char EHLO_REPLY[] = "250-mx.example.org Hello\r\n"
+                              "250-SIZE 52428800\r\n"
+                              "250-8BITMIME\r\n"
+                              "250-PIPELINING\r\n"
+                              "250-AUTH LOGIN PLAIN CRAM-MD5\r\n"
+                              "250-ENHANCEDSTATUSCODES\r\n"
+                              "250-CHUNKING\r\n"
+                              "250 STARTTLS\r\n";
+}
+
+static void BM_format_header(benchmark::State &state)
+{
+    SmtpServer smtp_server;
+    smtp_server.init(make_job(), "localhost", 25);
+    for (int idx = 1; idx < state.range(0); ++idx) {
+        smtp_server.add_recipient(("recipient" + std::to_string(idx) + "@example.org").c_str());
+    }
+    std::vector<char> header(BUFFER_SIZE);
+    for (auto _ : state) {
+        smtp_server.format_header(header.data());
+        benchmark::DoNotOptimize(header.data());
+    }
+}
+BENCHMARK(BM_format_header)->Arg(1)->Arg(50);
+
+static void BM_is_keyword_supported(benchmark::State &state)
+{
+    // the last keyword of the reply is the worst case
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(is_keyword_supported(EHLO_REPLY, "STARTTLS"));
+    }
+}
+BENCHMARK(BM_is_keyword_supported);
+
+static void BM_parse_reply_code(benchmark::State &state)
+{
+    std::string reply = EHLO_REPLY;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(parse_reply_code(reply));
+    }
+}
+BENCHMARK(BM_parse_reply_code);
+
+// receive_response parses the reply again after every chunk read from the socket
+static void BM_parse_reply_code_chunked(benchmark::State &state)
+{
+    std::string reply = EHLO_REPLY;
+    auto chunk_size = static_cast<size_t>(state.range(0));
+    std::string line;
+    for (auto _ : state) {
+        line.clear();
+        int reply_code = -1;
+        for (size_t offset = 0; reply_code < 0 && offset < reply.size(); offset += chunk_size) {
+            line.append(reply, offset, chunk_size);
+            reply_code = parse_reply_code(line);
+        }
+        benchmark::DoNotOptimize(reply_code);
+    }
+}
+BENCHMARK(BM_parse_reply_code_chunked)->Arg(16)->Arg(64);
@@ -0,0 +1,393 @@
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+#include "smtp_sink.hpp"
+
+namespace md
+{
+    namespace benchmarks
+    {
+        namespace
+        {
+            const int POLL_INTERVAL_MS = 100;// how often a waiting connection looks at the stop flag
+
+            std::string upper(std::string text)
+            {
+                std::transform(text.begin(), text.end(), text.begin(), ::toupper);
+                return text;
+            }
+        }
+
+        /**
+         * One accepted socket, plain or TLS after STARTTLS, with a read buffer that keeps pipelined input
+         */
+        class SmtpSink::Connection
+        {
+        public:
+            Connection(int socket, const std::atomic<bool> &is_stopped)
+                    : m_socket(socket)
+                      , m_is_stopped(is_stopped)
+            {
+            }
+
+            ~Connection()
+            {
+                if (m_ssl != nullptr) {
+                    SSL_free(m_ssl);
+                }
+                close(m_socket);
+            }
+
+            // the next line without CRLF; false when the client is gone or the sink stops
+            bool read_line(std::string &line)
+            {
+                while (true) {
+                    auto pos = m_input.find('\n', m_offset);
+                    if (pos != std::string::npos) {
+                        auto end = pos > m_offset && m_input[pos - 1] == '\r' ? pos - 1 : pos;
+                        line.assign(m_input, m_offset, end - m_offset);
+                        m_offset = pos + 1;
+                        return true;
+                    }
+                    if (!read_more()) {
+                        return false;
+                    }
+                }
+            }
+
+            bool read_bytes(size_t size, std::string &bytes)
+            {
+                while (m_input.size() - m_offset < size) {
+                    if (!read_more()) {
+                        return false;
+                    }
+                }
+                bytes.assign(m_input, m_offset, size);
+                m_offset += size;
+                return true;
+            }
+
+            bool write(const std::string &text)
+            {
+                size_t sent = 0;
+                while (sent < text.size()) {
+                    int res = m_ssl != nullptr
+                              ? SSL_write(m_ssl, text.data() + sent, static_cast<int>(text.size() - sent))
+                              : static_cast<int>(send(m_socket, text.data() + sent, text.size() - sent
+                                                      , MSG_NOSIGNAL));
+                    if (res <= 0) {
+                        if (m_ssl == nullptr && res < 0 && errno == EINTR) {
+                            continue;
+                        }
+                        return false;
+                    }
+                    sent += static_cast<size_t>(res);
+                }
+                return true;
+            }
+
+            bool start_tls(SSL_CTX *ctx)
+            {
+                // whatever the client pipelined behind STARTTLS is plain text, RFC 3207 says to drop it
+                m_input.clear();
+                m_offset = 0;
+                m_ssl = SSL_new(ctx);
+                if (m_ssl == nullptr) {
+                    return false;
+                }
+                SSL_set_fd(m_ssl, m_socket);
+                return SSL_accept(m_ssl) == 1;
+            }
+
+        private:
+            bool read_more()
+            {
+                if (m_offset > 0 && m_offset * 2 >= m_input.size()) {
+                    m_input.erase(0, m_offset);
+                    m_offset = 0;
+                }
+                char buffer[16384];
+                while (!m_is_stopped) {
+                    if (m_ssl == nullptr || SSL_pending(m_ssl) == 0) {
+                        pollfd fd = {m_socket, POLLIN, 0};
+                        auto res = poll(&fd, 1, POLL_INTERVAL_MS);
+                        if (res == 0 || (res < 0 && errno == EINTR)) {
+                            continue;
+                        }
+                        if (res < 0) {
+                            return false;
+                        }
+                    }
+                    int res = m_ssl != nullptr ? SSL_read(m_ssl, buffer, sizeof(buffer))
+                                               : static_cast<int>(recv(m_socket, buffer, sizeof(buffer), 0));
+                    if (res > 0) {
+                        m_input.append(buffer, static_cast<size_t>(res));
+                        return true;
+                    }
+                    if (m_ssl != nullptr && SSL_get_error(m_ssl, res) == SSL_ERROR_WANT_READ) {
+                        continue;
+                    }
+                    if (m_ssl == nullptr && res < 0 && errno == EINTR) {
+                        continue;
+                    }
+                    return false;
+                }
+                return false;
+            }
+
+            int m_socket;
+            const std::atomic<bool> &m_is_stopped;
+            SSL *m_ssl = nullptr;
+            std::string m_input;
+            size_t m_offset = 0;
+        };
+
+        SmtpSink::SmtpSink(const SmtpSinkConfig &config, unsigned short port)
+                : m_config(config)
+        {
+            if (m_config.m_is_tls_enabled) {
+                init_tls();
+            }
+
+            m_listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+            if (m_listen_socket < 0) {
+                throw std::runtime_error("sink: can't create socket");
+            }
+            int on = 1;
+            setsockopt(m_listen_socket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+            sockaddr_in address{};
+            address.sin_family = AF_INET;
+            address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            address.sin_port = htons(port);
+            socklen_t length = sizeof(address);
+            if (bind(m_listen_socket, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0
+                || listen(m_listen_socket, 1024) != 0
+                || getsockname(m_listen_socket, reinterpret_cast<sockaddr *>(&address), &length) != 0) {
+                close(m_listen_socket);
+                throw std::runtime_error(std::string("sink: can't listen on loopback: ") + strerror(errno));
+            }
+            m_port = ntohs(address.sin_port);
+
+            for (int idx = 0; idx < std::max(m_config.m_threads, 1); ++idx) {
+                m_threads.emplace_back(&SmtpSink::run, this, static_cast<unsigned>(idx + 1));
+            }
+        }
+
+        SmtpSink::~SmtpSink()
+        {
+            stop();
+            if (m_ctx != nullptr) {
+                SSL_CTX_free(m_ctx);
+            }
+        }
+
+        void SmtpSink::stop()
+        {
+            if (m_is_stopped.exchange(true)) {
+                return;
+            }
+            // wakes the threads blocked in accept()
+            shutdown(m_listen_socket, SHUT_RDWR);
+            for (auto &thread : m_threads) {
+                thread.join();
+            }
+            close(m_listen_socket);
+        }
+
+        void SmtpSink::init_tls()
+        {
+            SSL_library_init();
+            SSL_load_error_strings();
+            m_ctx = SSL_CTX_new(SSLv23_server_method());
+            if (m_ctx == nullptr) {
+                throw std::runtime_error("sink: can't create the TLS context");
+            }
+
+            // a P-256 key is made in a millisecond, RSA would slow down every start
+            EVP_PKEY *key = nullptr;
+            auto key_ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+            bool is_key_made = key_ctx != nullptr && EVP_PKEY_keygen_init(key_ctx) > 0
+                               && EVP_PKEY_CTX_set_ec_paramgen_curve_nid(key_ctx, NID_X9_62_prime256v1) > 0
+                               && EVP_PKEY_keygen(key_ctx, &key) > 0;
+            EVP_PKEY_CTX_free(key_ctx);
+            if (!is_key_made) {
+                throw std::runtime_error("sink: can't generate the TLS key");
+            }
+
+            auto certificate = X509_new();
+            X509_set_version(certificate, 2);
+            ASN1_INTEGER_set(X509_get_serialNumber(certificate), 1);
+            X509_gmtime_adj(X509_get_notBefore(certificate), 0);
+            X509_gmtime_adj(X509_get_notAfter(certificate), 24 * 3600);
+            X509_set_pubkey(certificate, key);
+            auto name = X509_get_subject_name(certificate);
+            X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, reinterpret_cast<const unsigned char *>("localhost")
+                                       , -1, -1, 0);
+            X509_set_issuer_name(certificate, name);
+            bool is_ready = X509_sign(certificate, key, EVP_sha256()) > 0
+                            && SSL_CTX_use_certificate(m_ctx, certificate) == 1
+                            && SSL_CTX_use_PrivateKey(m_ctx, key) == 1;
+            X509_free(certificate);
+            EVP_PKEY_free(key);
+            if (!is_ready) {
+                throw std::runtime_error("sink: can't make the self-signed certificate");
+            }
+        }
+
+        void SmtpSink::run(unsigned seed)
+        {
+            while (!m_is_stopped) {
+                int socket = accept(m_listen_socket, nullptr, nullptr);
+                if (socket < 0) {
+                    continue;
+                }
+                int on = 1;
+                setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+                Connection connection(socket, m_is_stopped);
+                serve(connection, seed);
+                // a different error pattern for the next connection of this thread
+                seed += static_cast<unsigned>(m_threads.size());
+            }
+        }
+
+        void SmtpSink::reply(Connection &connection, const std::string &text, int latency_us)
+        {
+            latency_us += m_config.m_command_latency_us;
+            if (latency_us > 0) {
+                std::this_thread::sleep_for(std::chrono::microseconds(latency_us));
+            }
+            connection.write(text);
+        }
+
+        void SmtpSink::serve(Connection &connection, unsigned seed)
+        {
+            std::minstd_rand random(seed);
+            std::uniform_real_distribution<double> unit(0.0, 1.0);
+            auto is_injected = [&](double rate) {
+                return rate > 0.0 && unit(random) < rate;
+            };
+            const auto error_reply = std::to_string(m_config.m_error_code) + " injected error\r\n";
+            auto reply_message = [&]() {
+                if (is_injected(m_config.m_data_error_rate)) {
+                    m_errors.fetch_add(1, std::memory_order_relaxed);
+                    reply(connection, error_reply, m_config.m_data_latency_us);
+                } else {
+                    m_messages.fetch_add(1, std::memory_order_relaxed);
+                    reply(connection, "250 2.0.0 OK queued\r\n", m_config.m_data_latency_us);
+                }
+            };
+
+            bool is_tls = false;
+            std::string line;
+            std::string data;
+            reply(connection, "220 localhost ESMTP sink\r\n");
+            while (connection.read_line(line)) {
+                auto space = line.find(' ');
+                auto verb = upper(line.substr(0, space));
+                auto argument = space == std::string::npos ? std::string() : line.substr(space + 1);
+
+                if (verb == "EHLO") {
+                    std::string text = "250-localhost\r\n250-PIPELINING\r\n250-CHUNKING\r\n250-8BITMIME\r\n";
+                    if (m_ctx != nullptr && !is_tls) {
+                        text += "250-STARTTLS\r\n";
+                    }
+                    reply(connection, text + "250 AUTH LOGIN PLAIN\r\n");
+                } else if (verb == "HELO") {
+                    reply(connection, "250 localhost\r\n");
+                } else if (verb == "STARTTLS") {
+                    if (m_ctx == nullptr || is_tls) {
+                        reply(connection, "454 4.7.0 TLS not available\r\n");
+                        continue;
+                    }
+                    reply(connection, "220 2.0.0 Ready to start TLS\r\n");
+                    if (!connection.start_tls(m_ctx)) {
+                        ERR_clear_error();
+                        return;
+                    }
+                    is_tls = true;
+                } else if (verb == "AUTH") {
+                    auto mechanism = upper(argument.substr(0, argument.find(' ')));
+                    if (mechanism == "LOGIN") {
+                        reply(connection, "334 VXNlcm5hbWU6\r\n");
+                        if (!connection.read_line(line)) {
+                            return;
+                        }
+                        reply(connection, "334 UGFzc3dvcmQ6\r\n");
+                        if (!connection.read_line(line)) {
+                            return;
+                        }
+                    } else if (mechanism == "PLAIN") {
+                        // the credentials come with the command or after an empty challenge
+                        if (argument.find(' ') == std::string::npos) {
+                            reply(connection, "334 \r\n");
+                            if (!connection.read_line(line)) {
+                                return;
+                            }
+                        }
+                    } else {
+                        reply(connection, "504 5.5.4 mechanism not supported\r\n");
+                        continue;
+                    }
+                    reply(connection, "235 2.7.0 Authentication successful\r\n");
+                } else if (verb == "MAIL") {
+                    reply(connection, "250 2.1.0 OK\r\n");
+                } else if (verb == "RCPT") {
+                    if (is_injected(m_config.m_rcpt_error_rate)) {
+                        m_errors.fetch_add(1, std::memory_order_relaxed);
+                        reply(connection, error_reply);
+                    } else {
+                        reply(connection, "250 2.1.5 OK\r\n");
+                    }
+                } else if (verb == "DATA") {
+                    reply(connection, "354 End data with <CR><LF>.<CR><LF>\r\n");
+                    do {
+                        if (!connection.read_line(line)) {
+                            return;
+                        }
+                    } while (line != ".");
+                    reply_message();
+                } else if (verb == "BDAT") {
+                    // BDAT <size> [LAST]
+                    auto size_end = argument.find(' ');
+                    size_t size = 0;
+                    try {
+                        size = std::stoul(argument.substr(0, size_end));
+                    }
+                    catch (std::exception &) {
+                        reply(connection, "501 5.5.4 bad chunk size\r\n");
+                        continue;
+                    }
+                    if (!connection.read_bytes(size, data)) {
+                        return;
+                    }
+                    if (size_end != std::string::npos && upper(argument.substr(size_end + 1)) == "LAST") {
+                        reply_message();
+                    } else {
+                        reply(connection, "250 2.0.0 chunk received\r\n");
+                    }
+                } else if (verb == "RSET" || verb == "NOOP") {
+                    reply(connection, "250 2.0.0 OK\r\n");
+                } else if (verb == "QUIT") {
+                    reply(connection, "221 2.0.0 Bye\r\n");
+                    return;
+                } else {
+                    reply(connection, "500 5.5.2 command not recognized\r\n");
+                }
+            }
+        }
+
+    }// namespace benchmarks
+}// namespace md
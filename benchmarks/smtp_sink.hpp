@@ -0,0 +1,85 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <openssl/ssl.h>
+
+namespace md
+{
+    namespace benchmarks
+    {
+        struct SmtpSinkConfig
+        {
+            int m_threads = 4;// connections served at the same time
+            int m_command_latency_us = 0;// delay before every reply
+            int m_data_latency_us = 0;// extra delay before the reply to the end of DATA or the last BDAT
+            double m_rcpt_error_rate = 0.0;// share of RCPT TO answered with m_error_code
+            double m_data_error_rate = 0.0;// share of messages answered with m_error_code
+            int m_error_code = 451;
+            bool m_is_tls_enabled = true;
+        };
+
+        /**
+         * A throw-away SMTP server on 127.0.0.1 that accepts everything, for throughput measurements
+         * of the delivery path without a real MTA. It speaks EHLO/HELO, STARTTLS with a self-signed
+         * certificate made at start, AUTH LOGIN and PLAIN with any credentials, PIPELINING (commands
+         * are read from a buffer, so any number may arrive at once), DATA and CHUNKING (BDAT).
+         * Every connection is served by one of m_threads threads; the message is discarded.
+         */
+        class SmtpSink
+        {
+        public:
+            // port 0 binds an ephemeral port, see port()
+            explicit SmtpSink(const SmtpSinkConfig &config, unsigned short port = 0);
+
+            ~SmtpSink();
+
+            SmtpSink(const SmtpSink &) = delete;
+
+            SmtpSink &operator=(const SmtpSink &) = delete;
+
+            unsigned short port() const
+            {
+                return m_port;
+            }
+
+            // messages accepted with 250
+            uint64_t messages() const
+            {
+                return m_messages.load(std::memory_order_relaxed);
+            }
+
+            // replies with the injected error code
+            uint64_t errors() const
+            {
+                return m_errors.load(std::memory_order_relaxed);
+            }
+
+            void stop();
+
+        private:
+            class Connection;
+
+            void run(unsigned seed);
+
+            void serve(Connection &connection, unsigned seed);
+
+            void reply(Connection &connection, const std::string &text, int latency_us = 0);
+
+            void init_tls();
+
+            SmtpSinkConfig m_config;
+            int m_listen_socket = -1;
+            unsigned short m_port = 0;
+            SSL_CTX *m_ctx = nullptr;
+            std::atomic<bool> m_is_stopped{false};
+            std::atomic<uint64_t> m_messages{0};
+            std::atomic<uint64_t> m_errors{0};
+            std::vector<std::thread> m_threads;
+        };
+
+    }// namespace benchmarks
+}// namespace md
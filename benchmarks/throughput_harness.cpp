@@ -0,0 +1,282 @@
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <boost/program_options.hpp>
+#include "smtp_sink.hpp"
+#include "../core/delivery/delivery_worker.hpp"
+#include "../core/smtp/domain_statistic.hpp"
+#include "../tools/logger/logger.hpp"
+
+/**
+ * End-to-end delivery throughput on loopback: DeliveryWorker threads send synthetic jobs through
+ * SmtpServer (STARTTLS and AUTH included) to an SmtpSink running in a forked child, so the CPU time
+ * of both sides is measured apart. Prints msgs/sec, transaction latency percentiles and CPU per message.
+ *
+ *     ./md_throughput --messages 200000 --workers 16 --command-latency-us 200 --rcpt-error-rate 0.01
+ */
+
+using namespace md;
+using namespace md::service;
+namespace po = boost::program_options;
+
+namespace
+{
+    struct SinkReport
+    {
+        uint64_t m_messages = 0;
+        uint64_t m_errors = 0;
+        uint64_t m_cpu_us = 0;
+    };
+
+    uint64_t cpu_us(int who)
+    {
+        rusage usage{};
+        getrusage(who, &usage);
+        return static_cast<uint64_t>(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000
+               + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+    }
+
+    /**
+     * Hands out core.emails-like rows with ids [0, total) to any number of workers
+     */
+    class SyntheticJobSource : public delivery::JobSource
+    {
+    public:
+        SyntheticJobSource(std::atomic<int> &next_id, int total, int batch_size, int domains, const std::string &body)
+                : m_next_id(next_id)
+                  , m_total(total)
+                  , m_batch_size(batch_size)
+                  , m_domains(domains > 0 ? domains : 1)
+                  , m_body(body)
+        {
+        }
+
+        bool next_batch(StringListArray &batch) override
+        {
+            int first_id = m_next_id.fetch_add(m_batch_size);
+            if (first_id >= m_total) {
+                return false;
+            }
+            batch.clear();
+            for (int id = first_id; id < std::min(first_id + m_batch_size, m_total); ++id) {
+                StringList job;
+                job.push_back(std::to_string(id));
+                job.push_back("sink_login");
+                job.push_back("sink_password");
+                job.push_back("Throughput Harness");
+                job.push_back("sender@example.com");
+                job.push_back("reply@example.com");
+                job.push_back("Loopback throughput");
+                job.push_back("user" + std::to_string(id) + "@example" + std::to_string(id % m_domains) + ".org");
+                job.push_back("3");
+                job.push_back("mail_distributions");
+                job.push_back(m_body);
+                batch.push_back(std::move(job));
+            }
+            return true;
+        }
+
+        void complete(int job_id, db::DELIVERY_STATUS status) override
+        {
+            ++m_statuses[static_cast<int>(status)];
+        }
+
+        uint64_t count(db::DELIVERY_STATUS status) const
+        {
+            return m_statuses[static_cast<int>(status)];
+        }
+
+    private:
+        std::atomic<int> &m_next_id;
+        int m_total;
+        int m_batch_size;
+        int m_domains;
+        const std::string &m_body;
+        uint64_t m_statuses[3] = {0, 0, 0};
+    };
+
+    // runs the sink until the parent closes the command pipe, then reports through the result pipe
+    void run_sink(const benchmarks::SmtpSinkConfig &config, int command_fd, int result_fd)
+    {
+        benchmarks::SmtpSink sink(config);
+        auto port = sink.port();
+        if (write(result_fd, &port, sizeof(port)) != sizeof(port)) {
+            return;
+        }
+        char byte;
+        while (read(command_fd, &byte, 1) > 0) {
+        }
+        sink.stop();
+        SinkReport report;
+        report.m_messages = sink.messages();
+        report.m_errors = sink.errors();
+        report.m_cpu_us = cpu_us(RUSAGE_SELF);
+        write(result_fd, &report, sizeof(report));
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int messages;
+    int workers;
+    int batch_size;
+    int max_recipients;
+    int session_messages;
+    int domains;
+    int body_size;
+    benchmarks::SmtpSinkConfig sink_config;
+
+    po::options_description description("md_throughput: delivery throughput against a loopback SMTP sink");
+    description.add_options()
+            ("help", "this text")
+            ("messages", po::value<int>(&messages)->default_value(100000), "jobs to deliver")
+            ("workers", po::value<int>(&workers)->default_value(8), "delivery worker threads")
+            ("batch-size", po::value<int>(&batch_size)->default_value(100), "jobs per batch of the job source")
+            ("max-recipients", po::value<int>(&max_recipients)->default_value(1)
+             , "recipients per transaction when jobs can be merged")
+            ("session-messages", po::value<int>(&session_messages)->default_value(100)
+             , "transactions per connection, 0 for no limit")
+            ("domains", po::value<int>(&domains)->default_value(1), "distinct recipient domains")
+            ("body-size", po::value<int>(&body_size)->default_value(2048), "message body bytes")
+            ("sink-threads", po::value<int>(&sink_config.m_threads)->default_value(0)
+             , "connections the sink serves at once, 0 for one per worker")
+            ("command-latency-us", po::value<int>(&sink_config.m_command_latency_us)->default_value(0)
+             , "sink delay before every reply")
+            ("data-latency-us", po::value<int>(&sink_config.m_data_latency_us)->default_value(0)
+             , "extra sink delay before accepting a message")
+            ("rcpt-error-rate", po::value<double>(&sink_config.m_rcpt_error_rate)->default_value(0.0)
+             , "share of recipients the sink rejects")
+            ("data-error-rate", po::value<double>(&sink_config.m_data_error_rate)->default_value(0.0)
+             , "share of messages the sink rejects")
+            ("error-code", po::value<int>(&sink_config.m_error_code)->default_value(451)
+             , "reply code of injected errors");
+    po::variables_map options;
+    try {
+        po::store(po::parse_command_line(argc, argv, description), options);
+        po::notify(options);
+    }
+    catch (std::exception &e) {
+        std::cerr << e.what() << std::endl << description << std::endl;
+        return 1;
+    }
+    if (options.count("help")) {
+        std::cout << description << std::endl;
+        return 0;
+    }
+    workers = std::max(workers, 1);
+    if (sink_config.m_threads <= 0) {
+        sink_config.m_threads = workers;
+    }
+
+    // a connection dropped by the other side must not end the run
+    signal(SIGPIPE, SIG_IGN);
+
+    // forked before any thread exists, the child only runs the sink
+    int command_pipe[2];
+    int result_pipe[2];
+    if (pipe(command_pipe) != 0 || pipe(result_pipe) != 0) {
+        std::cerr << "can't create pipes" << std::endl;
+        return 1;
+    }
+    auto sink_pid = fork();
+    if (sink_pid < 0) {
+        std::cerr << "can't fork the sink" << std::endl;
+        return 1;
+    }
+    if (sink_pid == 0) {
+        close(command_pipe[1]);
+        close(result_pipe[0]);
+        try {
+            run_sink(sink_config, command_pipe[0], result_pipe[1]);
+        }
+        catch (std::exception &e) {
+            std::cerr << e.what() << std::endl;
+        }
+        _exit(0);
+    }
+    close(command_pipe[0]);
+    close(result_pipe[1]);
+    unsigned short port = 0;
+    if (read(result_pipe[0], &port, sizeof(port)) != sizeof(port)) {
+        std::cerr << "the sink didn't start" << std::endl;
+        waitpid(sink_pid, nullptr, 0);
+        return 1;
+    }
+
+    logger::Logger::instance().start("-", logger::LOG_LEVEL::WARNING);
+
+    const std::string body(static_cast<size_t>(std::max(body_size, 1)), 'x');
+    std::atomic<int> next_id(0);
+    std::vector<std::unique_ptr<SyntheticJobSource>> sources;
+    for (int idx = 0; idx < workers; ++idx) {
+        sources.emplace_back(new SyntheticJobSource(next_id, messages, batch_size, domains, body));
+    }
+
+    auto client_cpu_start = cpu_us(RUSAGE_SELF);
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int idx = 0; idx < workers; ++idx) {
+        threads.emplace_back([&, idx]() {
+            delivery::DeliveryWorker worker("127.0.0.1", port, nullptr, session_messages, max_recipients);
+            worker.run(*sources[idx]);
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    auto elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+    auto client_cpu = cpu_us(RUSAGE_SELF) - client_cpu_start;
+
+    close(command_pipe[1]);
+    SinkReport sink_report;
+    bool has_sink_report = read(result_pipe[0], &sink_report, sizeof(sink_report)) == sizeof(sink_report);
+    waitpid(sink_pid, nullptr, 0);
+    logger::Logger::instance().stop();
+
+    uint64_t sent = 0;
+    uint64_t deferred = 0;
+    uint64_t failed = 0;
+    for (const auto &source : sources) {
+        sent += source->count(db::DELIVERY_STATUS::SENT);
+        deferred += source->count(db::DELIVERY_STATUS::DEFERRED);
+        failed += source->count(db::DELIVERY_STATUS::FAILED);
+    }
+    auto total = sent + deferred + failed;
+
+    // every domain of the run, merged into one transaction histogram
+    smtp::LatencyHistogram latency;
+    for (const auto &domain : smtp::DomainStatistic::instance().snapshot()) {
+        for (size_t bucket = 0; bucket < latency.m_buckets.size(); ++bucket) {
+            latency.m_buckets[bucket] += domain.second.m_latency.m_buckets[bucket];
+        }
+        latency.m_sum_us += domain.second.m_latency.m_sum_us;
+    }
+
+    auto per_message = [total](uint64_t micros) {
+        return total > 0 ? static_cast<double>(micros) / total : 0.0;
+    };
+    printf("messages      %llu (sent %llu, deferred %llu, failed %llu)\n", (unsigned long long) total
+           , (unsigned long long) sent, (unsigned long long) deferred, (unsigned long long) failed);
+    printf("transactions  %llu\n", (unsigned long long) latency.count());
+    printf("elapsed       %.3f s\n", elapsed_us / 1e6);
+    printf("throughput    %.0f msgs/s\n", elapsed_us > 0 ? total * 1e6 / elapsed_us : 0.0);
+    printf("latency       p50 %llu us, p99 %llu us per transaction, connection setup included\n"
+           , (unsigned long long) latency.percentile(0.5), (unsigned long long) latency.percentile(0.99));
+    printf("client cpu    %.1f us/msg\n", per_message(client_cpu));
+    if (has_sink_report) {
+        printf("sink cpu      %.1f us/msg (accepted %llu, injected errors %llu)\n"
+               , per_message(sink_report.m_cpu_us), (unsigned long long) sink_report.m_messages
+               , (unsigned long long) sink_report.m_errors);
+    }
+    return 0;
+}
@@ -0,0 +1,238 @@
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdexcept>
+#include <boost/format.hpp>
+#include "async_query_executor.hpp"
+#include "../../tools/probes/probes.hpp"
+
+namespace md
+{
+    using namespace service;
+    namespace db
+    {
+        namespace
+        {
+            const int POOL_RETRY_MS = 20;// how often queued queries look for a free connection
+            const int IDLE_POLL_MS = 1000;
+        }
+
+        AsyncQueryExecutor::AsyncQueryExecutor(PGBackendPtr pg_backend_ptr, int io_threads)
+                : m_pg_backend_ptr(std::move(pg_backend_ptr))
+                  , m_is_stopped(false)
+                  , m_next_thread(0)
+        {
+            for (int idx = 0; idx < std::max(io_threads, 1); ++idx) {
+                std::unique_ptr<IoThread> io_thread(new IoThread());
+                if (pipe(io_thread->m_wake_pipe) != 0) {
+                    throw std::runtime_error("can't create wake pipe of the async query executor");
+                }
+                fcntl(io_thread->m_wake_pipe[0], F_SETFL, O_NONBLOCK);
+                fcntl(io_thread->m_wake_pipe[1], F_SETFL, O_NONBLOCK);
+                io_thread->m_thread = std::thread(&AsyncQueryExecutor::run, this, std::ref(*io_thread));
+                m_io_threads.push_back(std::move(io_thread));
+            }
+        }
+
+        AsyncQueryExecutor::~AsyncQueryExecutor()
+        {
+            m_is_stopped = true;
+            for (auto &io_thread : m_io_threads) {
+                char byte = 0;
+                write(io_thread->m_wake_pipe[1], &byte, 1);
+            }
+            for (auto &io_thread : m_io_threads) {
+                if (io_thread->m_thread.joinable()) {
+                    io_thread->m_thread.join();
+                }
+                close(io_thread->m_wake_pipe[0]);
+                close(io_thread->m_wake_pipe[1]);
+            }
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (auto &request : m_requests) {
+                request.m_event.set_exception(std::make_exception_ptr(
+                        std::runtime_error("async query executor stopped")));
+            }
+        }
+
+        pplx::task<StringListArray> AsyncQueryExecutor::execute(std::string query, StringList params
+                                                                , bool is_read_only)
+        {
+            Request request;
+            request.m_query = std::move(query);
+            request.m_params = std::move(params);
+            request.m_is_read_only = is_read_only;
+            pplx::task<StringListArray> task(request.m_event);
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_requests.push_back(std::move(request));
+                m_queued_count.store(m_requests.size(), std::memory_order_relaxed);
+            }
+            auto &io_thread = m_io_threads[m_next_thread++ % m_io_threads.size()];
+            char byte = 0;
+            write(io_thread->m_wake_pipe[1], &byte, 1);
+            return task;
+        }
+
+        pplx::task<int> AsyncQueryExecutor::get_row_count(const std::string &table_name)
+        {
+            return execute((boost::format("SELECT count(*) FROM %s;") % table_name).str(), StringList(), true)
+                    .then([](const StringListArray &rows) {
+                        return rows.empty() || rows.front().empty() ? 0 : std::stoi(rows.front().front());
+                    });
+        }
+
+        void AsyncQueryExecutor::run(IoThread &io_thread)
+        {
+            std::vector<std::unique_ptr<Query>> queries;
+            std::vector<pollfd> fds;
+            while (!m_is_stopped || !queries.empty()) {
+                // take queued requests as long as the pool has connections for them
+                bool is_pool_exhausted = false;
+                while (!m_is_stopped) {
+                    std::unique_ptr<Query> query(new Query());
+                    {
+                        std::lock_guard<std::mutex> lock(m_mutex);
+                        if (m_requests.empty()) {
+                            break;
+                        }
+                        query->m_connection = m_requests.front().m_is_read_only
+                                              ? m_pg_backend_ptr->try_read_connection()
+                                              : m_pg_backend_ptr->try_connection();
+                        if (!query->m_connection) {
+                            is_pool_exhausted = true;
+                            break;
+                        }
+                        query->m_request = std::move(m_requests.front());
+                        m_requests.pop_front();
+                        m_queued_count.store(m_requests.size(), std::memory_order_relaxed);
+                    }
+                    if (start(*query)) {
+                        queries.push_back(std::move(query));
+                    }
+                }
+
+                fds.clear();
+                fds.push_back({io_thread.m_wake_pipe[0], POLLIN, 0});
+                for (const auto &query : queries) {
+                    short events = POLLIN;
+                    if (query->m_is_flushing) {
+                        events |= POLLOUT;
+                    }
+                    fds.push_back({PQsocket(query->m_conn), events, 0});
+                }
+                if (poll(fds.data(), fds.size(), is_pool_exhausted ? POOL_RETRY_MS : IDLE_POLL_MS) < 0
+                    && errno != EINTR) {
+                    MD_LOG_ERROR("poll() failed in the async query executor");
+                }
+
+                if (fds[0].revents & POLLIN) {
+                    char buffer[64];
+                    while (read(io_thread.m_wake_pipe[0], buffer, sizeof(buffer)) > 0) {
+                    }
+                }
+
+                size_t kept = 0;
+                for (size_t idx = 0; idx < queries.size(); ++idx) {
+                    auto &query = *queries[idx];
+                    bool is_done = false;
+                    if (fds[idx + 1].fd < 0) {
+                        // poll ignores a closed socket, the query would wait forever
+                        query.m_error = "connection lost";
+                        is_done = true;
+                    } else if (fds[idx + 1].revents != 0) {
+                        is_done = receive(query);
+                    }
+                    if (is_done) {
+                        finish(query);
+                    } else {
+                        queries[kept++] = std::move(queries[idx]);
+                    }
+                }
+                queries.resize(kept);
+            }
+        }
+
+        bool AsyncQueryExecutor::start(Query &query)
+        {
+            query.m_conn = query.m_connection->connection().get();
+            MD_PROBE1(db_query_start, query.m_request.m_query.c_str());
+            std::vector<const char *> values;
+            for (const auto &param : query.m_request.m_params) {
+                values.push_back(param.c_str());
+            }
+            if (PQsetnonblocking(query.m_conn, 1) != 0
+                || !PQsendQueryParams(query.m_conn, query.m_request.m_query.c_str(), static_cast<int>(values.size())
+                                      , nullptr, values.empty() ? nullptr : values.data(), nullptr, nullptr, 0)) {
+                query.m_error = PQerrorMessage(query.m_conn);
+                finish(query);
+                return false;
+            }
+            auto flush_result = PQflush(query.m_conn);
+            if (flush_result < 0) {
+                query.m_error = PQerrorMessage(query.m_conn);
+                finish(query);
+                return false;
+            }
+            query.m_is_flushing = flush_result == 1;
+            return true;
+        }
+
+        bool AsyncQueryExecutor::receive(Query &query)
+        {
+            if (query.m_is_flushing) {
+                auto flush_result = PQflush(query.m_conn);
+                if (flush_result < 0) {
+                    query.m_error = PQerrorMessage(query.m_conn);
+                    return true;
+                }
+                query.m_is_flushing = flush_result == 1;
+            }
+            if (!PQconsumeInput(query.m_conn)) {
+                query.m_error = PQerrorMessage(query.m_conn);
+                return true;
+            }
+            while (!PQisBusy(query.m_conn)) {
+                auto result = PQgetResult(query.m_conn);
+                if (result == nullptr) {
+                    return true;
+                }
+                switch (PQresultStatus(result)) {
+                    case PGRES_TUPLES_OK:
+                        append_query_result(result, query.m_rows);
+                        break;
+                    case PGRES_COMMAND_OK:
+                    case PGRES_EMPTY_QUERY:
+                        break;
+                    default:
+                        if (query.m_error.empty()) {
+                            query.m_error = PQresultErrorMessage(result);
+                        }
+                }
+                PQclear(result);
+            }
+            return false;
+        }
+
+        void AsyncQueryExecutor::finish(Query &query)
+        {
+            MD_PROBE(db_query_end);
+            // the pool hands out blocking connections
+            PQsetnonblocking(query.m_conn, 0);
+            if (PQstatus(query.m_conn) == CONNECTION_BAD) {
+                MD_LOG_ERROR(PQerrorMessage(query.m_conn));
+                PQreset(query.m_conn);
+            }
+            m_pg_backend_ptr->free_connection(query.m_connection);
+
+            if (query.m_error.empty()) {
+                query.m_request.m_event.set(std::move(query.m_rows));
+            } else {
+                MD_LOG_ERROR(query.m_error);
+                query.m_request.m_event.set_exception(std::make_exception_ptr(std::runtime_error(query.m_error)));
+            }
+        }
+
+    }// namespace db
+}// namespace md
@@ -0,0 +1,98 @@
+#pragma once
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <pplx/pplxtasks.h>
+#include "db_tools.hpp"
+
+namespace md
+{
+    using namespace service;
+    namespace db
+    {
+        /**
+         * Non-blocking access to the connection pool for callers that must not wait on the database,
+         * like the REST handlers. A query is queued and answered by a task; io_threads threads send
+         * it on a free pool connection and drive the sockets with poll, PQconsumeInput and PQisBusy.
+         * A query waits in the queue while the pool is exhausted, so delivery workers taking
+         * connections with PGBackend::connection() are never blocked by it, nor block it.
+         * A failed query sets a std::runtime_error on its task.
+         */
+        class AsyncQueryExecutor
+        {
+        public:
+            AsyncQueryExecutor(PGBackendPtr pg_backend_ptr, int io_threads);
+
+            ~AsyncQueryExecutor();
+
+            AsyncQueryExecutor(const AsyncQueryExecutor &) = delete;
+
+            AsyncQueryExecutor &operator=(const AsyncQueryExecutor &) = delete;
+
+            // $1..$n in the query are bound to params; a read-only query may run on a replica
+            pplx::task<StringListArray> execute(std::string query, StringList params = StringList()
+                                                , bool is_read_only = false);
+
+            pplx::task<int> get_row_count(const std::string &table_name);
+
+            // queries waiting for a free connection, read without the queue lock
+            size_t queued() const
+            {
+                return m_queued_count.load(std::memory_order_relaxed);
+            }
+
+            PGBackendPtr backend() const
+            {
+                return m_pg_backend_ptr;
+            }
+
+        private:
+            struct Request
+            {
+                std::string m_query;
+                StringList m_params;
+                bool m_is_read_only = false;
+                pplx::task_completion_event<StringListArray> m_event;
+            };
+
+            struct Query
+            {
+                Request m_request;
+                std::shared_ptr<PGConnection> m_connection;
+                PGconn *m_conn = nullptr;
+                StringListArray m_rows;
+                std::string m_error;
+                bool m_is_flushing = false;
+            };
+
+            struct IoThread
+            {
+                int m_wake_pipe[2] = {-1, -1};
+                std::thread m_thread;
+            };
+
+            void run(IoThread &io_thread);
+
+            bool start(Query &query);
+
+            // false while the query waits for more input
+            bool receive(Query &query);
+
+            void finish(Query &query);
+
+            PGBackendPtr m_pg_backend_ptr;
+            mutable std::mutex m_mutex;
+            std::deque<Request> m_requests;
+            std::atomic<size_t> m_queued_count{0};
+            std::atomic<bool> m_is_stopped;
+            std::vector<std::unique_ptr<IoThread>> m_io_threads;
+            std::atomic<size_t> m_next_thread;
+        };
+
+        using AsyncQueryExecutorPtr = std::shared_ptr<AsyncQueryExecutor>;
+
+    }// namespace db
+}// namespace md
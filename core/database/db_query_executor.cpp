@@ -1,55 +1,110 @@
 
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <sys/select.h>
 #include <boost/format.hpp>
 #include "db_query_executor.hpp"
 #include "../../tools/service/service.hpp"
+#include "../../tools/probes/probes.hpp"
 namespace md
 {
     using namespace service;
     namespace db
     {
+        namespace
+        {
+            const char COMPLETE_CLAIMS_QUERY[] = "UPDATE core.emails SET completed_at = now()\n"
+                                                 " WHERE id = ANY($1::integer[]) AND claimed_by = $2;";
+
+            const char COMPLETE_JOBS_QUERY[] = "UPDATE core.emails SET completed_at = now()\n"
+                                               " WHERE id = ANY($1::integer[]);";
+
+            // integer[] literal
+            std::string id_array(const std::vector<int> &ids)
+            {
+                std::string array = "{";
+                for (size_t i = 0; i < ids.size(); ++i) {
+                    if (i > 0) {
+                        array += ",";
+                    }
+                    array += std::to_string(ids[i]);
+                }
+                return array + "}";
+            }
+        }
 
         DbQueryExecutor::DbQueryExecutor(ConfigPtr &db_config)
         {
             init(db_config);
         }
 
+        DbQueryExecutor::~DbQueryExecutor()
+        {
+            if (m_listen_connection) {
+                PQclear(PQexec(m_listen_connection->connection().get(), "UNLISTEN *;"));
+                m_pg_backend_ptr->free_connection(m_listen_connection);
+            }
+        }
+
         void DbQueryExecutor::init(ConfigPtr &db_config)
         {
             if (!m_pg_backend_ptr) {
                 m_pg_backend_ptr = std::make_shared<PGBackend>(db_config);
             }
             m_pg_backend_ptr->setup_connection(db_config);
+            if (auto db_conf = dynamic_cast<DbConfig *>(db_config.get())) {
+                m_pipeline_depth = db_conf->m_pipeline_depth;
+            }
         }
 
         StringListArray DbQueryExecutor::get_data4send_mail(const DataRange &data_range)
         {
-            if(auto connection = m_pg_backend_ptr->connection()) {
+            if(auto connection = m_pg_backend_ptr->read_connection()) {
                 std::string query = (boost::format("SELECT * FROM core.emails WHERE id BETWEEN %d AND %d ORDER BY\n"
                                                    " id ASC;") % data_range.first % data_range.second).str();
+                MD_PROBE1(db_query_start, query.c_str());
                 PQsendQuery(connection->connection().get(), query.c_str());
 
                 StringListArray query_result;
 
                 while (auto result = PQgetResult(connection->connection().get())) {
-                    if (PQresultStatus(result) == PGRES_TUPLES_OK && PQntuples(result)) {
-                        auto pq_tuples_count = PQntuples(result);
-                        auto pq_fields_count = PQnfields(result);
-                        for (auto i = 0; i < pq_tuples_count; ++i) {
-                            StringList list;
-                            for (auto j = 0; j < pq_fields_count; ++j) {
-                                auto item = PQgetvalue(result, i, j);
-                                list.emplace_back(item);
-                            }
-                            query_result.emplace_back(list);
-                        }
+                    append_query_result(result, query_result);
+
+                    if (PQresultStatus(result) == PGRES_FATAL_ERROR) {
+                        MD_LOG_ERROR(PQresultErrorMessage(result));
                     }
+                    PQclear(result);
+                }
+                MD_PROBE(db_query_end);
+                m_pg_backend_ptr->free_connection(connection);
+                return query_result;
+            }
+            return StringListArray();
+        }
+
+        StringListArray DbQueryExecutor::get_data4send_mail(const DataRange &data_range, const std::string &login)
+        {
+            if(auto connection = m_pg_backend_ptr->read_connection()) {
+                std::string query = (boost::format("SELECT * FROM core.emails WHERE id BETWEEN %d AND %d"
+                                                   " AND login = $1 ORDER BY\n id ASC;")
+                                     % data_range.first % data_range.second).str();
+                const char *params[] = {login.c_str()};
+                MD_PROBE1(db_query_start, query.c_str());
+                PQsendQueryParams(connection->connection().get(), query.c_str(), 1, nullptr, params, nullptr
+                                  , nullptr, 0);
+
+                StringListArray query_result;
+
+                while (auto result = PQgetResult(connection->connection().get())) {
+                    append_query_result(result, query_result);
 
                     if (PQresultStatus(result) == PGRES_FATAL_ERROR) {
-                        write_sys_log(PQresultErrorMessage(result));
-                        std::cout << PQresultErrorMessage(result) << std::endl;
+                        MD_LOG_ERROR(PQresultErrorMessage(result));
                     }
                     PQclear(result);
                 }
+                MD_PROBE(db_query_end);
                 m_pg_backend_ptr->free_connection(connection);
                 return query_result;
             }
@@ -58,10 +113,11 @@ namespace md
 
         int DbQueryExecutor::get_row_count(const std::string &table_name)
         {
-            if(auto connection = m_pg_backend_ptr->connection()) {
+            if(auto connection = m_pg_backend_ptr->read_connection()) {
                 std::string get_row_count = (boost::format("SELECT count(*) FROM %s;") % table_name).str();
                 int row_count = 0;
 
+                MD_PROBE1(db_query_start, get_row_count.c_str());
                 PQsendQuery(connection->connection().get(), get_row_count.c_str());
 
                 while (auto result = PQgetResult(connection->connection().get())) {
@@ -70,11 +126,11 @@ namespace md
                         break;
                     }
                     if (PQresultStatus(result) == PGRES_FATAL_ERROR) {
-                        write_sys_log(PQresultErrorMessage(result));
-                        std::cout << PQresultErrorMessage(result) << std::endl;
+                        MD_LOG_ERROR(PQresultErrorMessage(result));
                     }
                     PQclear(result);
                 }
+                MD_PROBE(db_query_end);
 
                 m_pg_backend_ptr->free_connection(connection);
                 return row_count;
@@ -87,38 +143,469 @@ namespace md
                                                             , const std::string &sender_mail)
         {
 
-            if(auto connection = m_pg_backend_ptr->connection()) {
+            if(auto connection = m_pg_backend_ptr->read_connection()) {
                 std::string query = (boost::format("SELECT * FROM core.emails WHERE id BETWEEN %d AND %d ORDER BY\n"
                                                    " id ASC;") % data_range.first % data_range.second).str();
+                MD_PROBE1(db_query_start, query.c_str());
                 PQsendQuery(connection->connection().get(), query.c_str());
 
                 StringListArray query_result;
 
                 while (auto result = PQgetResult(connection->connection().get())) {
-                    if (PQresultStatus(result) == PGRES_TUPLES_OK && PQntuples(result)) {
-                        auto pq_tuples_count = PQntuples(result);
-                        auto pq_fields_count = PQnfields(result);
-                        for (auto i = 0; i < pq_tuples_count; ++i) {
-                            StringList list;
-                            for (auto j = 0; j < pq_fields_count; ++j) {
-                                auto item = PQgetvalue(result, i, j);
-                                list.emplace_back(item);
-                            }
-                            query_result.emplace_back(list);
-                        }
-                    }
+                    append_query_result(result, query_result);
 
                     if (PQresultStatus(result) == PGRES_FATAL_ERROR) {
-                        write_sys_log(PQresultErrorMessage(result));
-                        std::cout << PQresultErrorMessage(result) << std::endl;
+                        MD_LOG_ERROR(PQresultErrorMessage(result));
                     }
                     PQclear(result);
                 }
+                MD_PROBE(db_query_end);
                 m_pg_backend_ptr->free_connection(connection);
                 return query_result;
             }
 
             return StringListArray();
         }
+
+        PGPipelinePtr DbQueryExecutor::pipeline()
+        {
+            return std::make_shared<PGPipeline>(m_pg_backend_ptr, m_pg_backend_ptr->connection(), m_pipeline_depth);
+        }
+
+        std::vector<StringListArray> DbQueryExecutor::execute_pipelined(const std::vector<std::string> &queries)
+        {
+            std::vector<StringListArray> query_results(queries.size());
+            auto pipeline = this->pipeline();
+            for (size_t i = 0; i < queries.size(); ++i) {
+                auto &query_result = query_results[i];
+                pipeline->push(queries[i], [&query_result](bool is_ok, const StringListArray &rows) {
+                    if (is_ok) {
+                        query_result = rows;
+                    }
+                });
+            }
+            pipeline->sync();
+            return query_results;
+        }
+
+        StringListArray DbQueryExecutor::get_data4send_mail_after(int last_id, int limit)
+        {
+            if (auto connection = m_pg_backend_ptr->read_connection()) {
+                std::string query = (boost::format("SELECT * FROM core.emails WHERE id > %d ORDER BY id ASC LIMIT %d;")
+                                     % last_id % limit).str();
+                MD_PROBE1(db_query_start, query.c_str());
+                PQsendQuery(connection->connection().get(), query.c_str());
+
+                StringListArray query_result;
+
+                while (auto result = PQgetResult(connection->connection().get())) {
+                    append_query_result(result, query_result);
+
+                    if (PQresultStatus(result) == PGRES_FATAL_ERROR) {
+                        MD_LOG_ERROR(PQresultErrorMessage(result));
+                    }
+                    PQclear(result);
+                }
+                MD_PROBE(db_query_end);
+                m_pg_backend_ptr->free_connection(connection);
+                return query_result;
+            }
+            return StringListArray();
+        }
+
+        StringListArray DbQueryExecutor::get_unsent_data4send_mail(int first_id, const std::vector<int> &excluded_ids
+                                                                   , int limit)
+        {
+            const char query[] = "SELECT * FROM core.emails\n"
+                                 " WHERE completed_at IS NULL AND id >= $1::integer AND id <> ALL($2::integer[])\n"
+                                 " ORDER BY id ASC LIMIT $3::integer;";
+            auto first = std::to_string(first_id);
+            auto excluded = id_array(excluded_ids);
+            auto count = std::to_string(limit);
+            const char *params[] = {first.c_str(), excluded.c_str(), count.c_str()};
+            auto connection = m_pg_backend_ptr->connection();
+            MD_PROBE1(db_query_start, query);
+            auto result = PQexecParams(connection->connection().get(), query, 3, nullptr, params, nullptr, nullptr
+                                       , 0);
+            MD_PROBE(db_query_end);
+            StringListArray query_result;
+            append_query_result(result, query_result);
+            if (PQresultStatus(result) == PGRES_FATAL_ERROR) {
+                MD_LOG_ERROR(PQresultErrorMessage(result));
+            }
+            PQclear(result);
+            m_pg_backend_ptr->free_connection(connection);
+            return query_result;
+        }
+
+        int DbQueryExecutor::get_max_id(const std::string &table_name, const std::string &column_name)
+        {
+            if (auto connection = m_pg_backend_ptr->connection()) {
+                std::string query = (boost::format("SELECT coalesce(max(%s), 0) FROM %s;")
+                                     % column_name % table_name).str();
+                int max_id = 0;
+
+                MD_PROBE1(db_query_start, query.c_str());
+                auto result = PQexec(connection->connection().get(), query.c_str());
+                MD_PROBE(db_query_end);
+                if (PQresultStatus(result) == PGRES_TUPLES_OK && PQntuples(result)) {
+                    max_id = std::stoi(PQgetvalue(result, 0, 0));
+                }
+                if (PQresultStatus(result) == PGRES_FATAL_ERROR) {
+                    MD_LOG_ERROR(PQresultErrorMessage(result));
+                }
+                PQclear(result);
+
+                m_pg_backend_ptr->free_connection(connection);
+                return max_id;
+            }
+            return 0;
+        }
+
+        bool DbQueryExecutor::install_notify_trigger(const std::string &channel)
+        {
+            auto connection = m_pg_backend_ptr->connection();
+            auto conn = connection->connection().get();
+            bool is_ok = false;
+
+            if (auto channel_literal = PQescapeLiteral(conn, channel.c_str(), channel.size())) {
+                // one notification per INSERT statement, not per row, so bulk loads don't flood the listener;
+                // the trigger is created only once, dropping it on every start would lock out the writers
+                std::string query = (boost::format(
+                        "CREATE OR REPLACE FUNCTION core.emails_notify_insert() RETURNS trigger AS $md$\n"
+                        "BEGIN PERFORM pg_notify(%s, ''); RETURN NULL; END;\n"
+                        "$md$ LANGUAGE plpgsql;\n"
+                        "DO $md$ BEGIN\n"
+                        " IF NOT EXISTS (SELECT 1 FROM pg_trigger WHERE tgname = 'emails_notify_insert'\n"
+                        "  AND tgrelid = 'core.emails'::regclass) THEN\n"
+                        "  CREATE TRIGGER emails_notify_insert AFTER INSERT ON core.emails\n"
+                        "   FOR EACH STATEMENT EXECUTE PROCEDURE core.emails_notify_insert();\n"
+                        " END IF;\n"
+                        "END $md$;")
+                                     % channel_literal).str();
+                PQfreemem(channel_literal);
+
+                auto result = PQexec(conn, query.c_str());
+                is_ok = PQresultStatus(result) == PGRES_COMMAND_OK;
+                if (!is_ok) {
+                    MD_LOG_ERROR(PQresultErrorMessage(result));
+                }
+                PQclear(result);
+            }
+
+            m_pg_backend_ptr->free_connection(connection);
+            return is_ok;
+        }
+
+        bool DbQueryExecutor::listen(const std::string &channel)
+        {
+            m_listen_channel = channel;
+            if (m_listen_connection) {
+                return true;
+            }
+
+            auto connection = m_pg_backend_ptr->connection();
+            auto conn = connection->connection().get();
+            bool is_ok = false;
+
+            if (auto channel_identifier = PQescapeIdentifier(conn, channel.c_str(), channel.size())) {
+                std::string query = (boost::format("LISTEN %s;") % channel_identifier).str();
+                PQfreemem(channel_identifier);
+
+                auto result = PQexec(conn, query.c_str());
+                is_ok = PQresultStatus(result) == PGRES_COMMAND_OK;
+                if (!is_ok) {
+                    MD_LOG_ERROR(PQresultErrorMessage(result));
+                }
+                PQclear(result);
+            }
+
+            if (is_ok) {
+                m_listen_connection = connection;
+            } else {
+                m_pg_backend_ptr->free_connection(connection);
+            }
+            return is_ok;
+        }
+
+        bool DbQueryExecutor::wait_notification(int timeout_ms)
+        {
+            if (!m_listen_connection && (m_listen_channel.empty() || !listen(m_listen_channel))) {
+                // polling fallback
+                std::this_thread::sleep_for(std::chrono::milliseconds(timeout_ms));
+                return false;
+            }
+
+            auto conn = m_listen_connection->connection().get();
+            auto drain_notifies = [conn]() {
+                bool is_notified = false;
+                while (auto notify = PQnotifies(conn)) {
+                    PQfreemem(notify);
+                    is_notified = true;
+                }
+                return is_notified;
+            };
+
+            if (drain_notifies()) {
+                return true;
+            }
+
+            auto socket = PQsocket(conn);
+            if (socket < 0) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(timeout_ms));
+                return false;
+            }
+            fd_set fdread;
+            FD_ZERO(&fdread);
+            FD_SET(socket, &fdread);
+            timeval time;
+            time.tv_sec = timeout_ms / 1000;
+            time.tv_usec = (timeout_ms % 1000) * 1000;
+
+            auto res = select(socket + 1, &fdread, nullptr, nullptr, &time);
+            if (res <= 0) {
+                return false;
+            }
+
+            if (!PQconsumeInput(conn)) {
+                // the listen connection is broken, reconnect it and LISTEN again on the next wait
+                MD_LOG_ERROR(PQerrorMessage(conn));
+                PQreset(conn);
+                m_pg_backend_ptr->free_connection(m_listen_connection);
+                m_listen_connection.reset();
+                return false;
+            }
+            return drain_notifies();
+        }
+
+        bool DbQueryExecutor::prepare_claim_columns()
+        {
+            auto connection = m_pg_backend_ptr->connection();
+            // separate statements: CREATE INDEX CONCURRENTLY can't run in the implicit transaction of a
+            // multi-statement query, and it doesn't block the inserts into core.emails while it builds
+            const char *queries[] = {
+                    "ALTER TABLE core.emails ADD COLUMN IF NOT EXISTS claimed_by text,\n"
+                    " ADD COLUMN IF NOT EXISTS claimed_at timestamptz,\n"
+                    " ADD COLUMN IF NOT EXISTS completed_at timestamptz;",
+                    "CREATE INDEX CONCURRENTLY IF NOT EXISTS emails_not_completed_idx ON core.emails (id)\n"
+                    " WHERE completed_at IS NULL;"};
+            bool is_ok = true;
+            for (auto query : queries) {
+                auto result = PQexec(connection->connection().get(), query);
+                is_ok = PQresultStatus(result) == PGRES_COMMAND_OK;
+                if (!is_ok) {
+                    MD_LOG_ERROR(PQresultErrorMessage(result));
+                }
+                PQclear(result);
+                if (!is_ok) {
+                    break;
+                }
+            }
+            m_pg_backend_ptr->free_connection(connection);
+            return is_ok;
+        }
+
+        bool DbQueryExecutor::complete_claims(const std::string &worker_id, const std::vector<int> &completed_ids)
+        {
+            if (completed_ids.empty()) {
+                return true;
+            }
+            auto ids = id_array(completed_ids);
+            const char *params[] = {ids.c_str(), worker_id.c_str()};
+            auto connection = m_pg_backend_ptr->connection();
+            MD_PROBE1(db_query_start, COMPLETE_CLAIMS_QUERY);
+            auto result = PQexecParams(connection->connection().get(), COMPLETE_CLAIMS_QUERY, 2, nullptr, params
+                                       , nullptr, nullptr, 0);
+            MD_PROBE(db_query_end);
+            bool is_ok = PQresultStatus(result) == PGRES_COMMAND_OK;
+            if (!is_ok) {
+                MD_LOG_ERROR(PQresultErrorMessage(result));
+            }
+            PQclear(result);
+            m_pg_backend_ptr->free_connection(connection);
+            return is_ok;
+        }
+
+        bool DbQueryExecutor::complete_jobs(const std::vector<int> &completed_ids)
+        {
+            if (completed_ids.empty()) {
+                return true;
+            }
+            auto ids = id_array(completed_ids);
+            const char *params[] = {ids.c_str()};
+            auto connection = m_pg_backend_ptr->connection();
+            MD_PROBE1(db_query_start, COMPLETE_JOBS_QUERY);
+            auto result = PQexecParams(connection->connection().get(), COMPLETE_JOBS_QUERY, 1, nullptr, params
+                                       , nullptr, nullptr, 0);
+            MD_PROBE(db_query_end);
+            bool is_ok = PQresultStatus(result) == PGRES_COMMAND_OK;
+            if (!is_ok) {
+                MD_LOG_ERROR(PQresultErrorMessage(result));
+            }
+            PQclear(result);
+            m_pg_backend_ptr->free_connection(connection);
+            return is_ok;
+        }
+
+        StringListArray DbQueryExecutor::claim_data4send_mail(const std::string &worker_id, int limit
+                                                              , int lease_seconds
+                                                              , const std::vector<int> &completed_ids)
+        {
+            StringListArray query_result;
+            auto pipeline = this->pipeline();
+
+            if (!completed_ids.empty()) {
+                StringList params;
+                params.push_back(id_array(completed_ids));
+                params.push_back(worker_id);
+                pipeline->push(COMPLETE_CLAIMS_QUERY, params);
+            }
+
+            StringList params;
+            params.push_back(worker_id);
+            params.push_back(std::to_string(limit));
+            params.push_back(std::to_string(lease_seconds));
+            pipeline->push("UPDATE core.emails SET claimed_by = $1, claimed_at = now()\n"
+                           " WHERE id IN (SELECT id FROM core.emails\n"
+                           "  WHERE completed_at IS NULL\n"
+                           "   AND (claimed_at IS NULL OR claimed_at < now() - $3::integer * interval '1 second')\n"
+                           "  ORDER BY id ASC LIMIT $2::integer\n"
+                           "  FOR UPDATE SKIP LOCKED)\n"
+                           " RETURNING *, (extract(epoch FROM claimed_at) * 1000)::bigint;", params
+                           , [&query_result](bool is_ok, const StringListArray &rows) {
+                        if (is_ok) {
+                            query_result = rows;
+                        }
+                    });
+            pipeline->sync();
+
+            // RETURNING gives no order guarantee
+            std::sort(query_result.begin(), query_result.end(), [](const StringList &left, const StringList &right) {
+                return std::stoi(left[0]) < std::stoi(right[0]);
+            });
+            return query_result;
+        }
+
+        bool DbQueryExecutor::prepare_checkpoint_table(const std::string &table_name)
+        {
+            auto connection = m_pg_backend_ptr->connection();
+            // the range columns came later, a table without them gets them here
+            std::string query = (boost::format("CREATE TABLE IF NOT EXISTS %1% (\n"
+                                               " worker_key text PRIMARY KEY,\n"
+                                               " high_water_mark integer NOT NULL,\n"
+                                               " completed_ids integer[] NOT NULL DEFAULT '{}',\n"
+                                               " range_first integer,\n"
+                                               " range_last integer,\n"
+                                               " updated_at timestamptz NOT NULL);\n"
+                                               "ALTER TABLE %1% ADD COLUMN IF NOT EXISTS range_first integer,\n"
+                                               " ADD COLUMN IF NOT EXISTS range_last integer;")
+                                 % table_name).str();
+            auto result = PQexec(connection->connection().get(), query.c_str());
+            bool is_ok = PQresultStatus(result) == PGRES_COMMAND_OK;
+            if (!is_ok) {
+                MD_LOG_ERROR(PQresultErrorMessage(result));
+            }
+            PQclear(result);
+            m_pg_backend_ptr->free_connection(connection);
+            return is_ok;
+        }
+
+        bool DbQueryExecutor::load_checkpoint(const std::string &table_name, const std::string &worker_key
+                                              , DataRange &range, int &high_water_mark
+                                              , std::vector<int> &completed_ids)
+        {
+            auto connection = m_pg_backend_ptr->connection();
+            std::string query = (boost::format("SELECT high_water_mark, array_to_string(completed_ids, ','),\n"
+                                               " range_first, range_last FROM %s WHERE worker_key = $1;")
+                                 % table_name).str();
+            const char *params[] = {worker_key.c_str()};
+            MD_PROBE1(db_query_start, query.c_str());
+            auto result = PQexecParams(connection->connection().get(), query.c_str(), 1, nullptr, params, nullptr
+                                       , nullptr, 0);
+            MD_PROBE(db_query_end);
+            bool is_found = PQresultStatus(result) == PGRES_TUPLES_OK && PQntuples(result) > 0;
+            if (PQresultStatus(result) == PGRES_FATAL_ERROR) {
+                MD_LOG_ERROR(PQresultErrorMessage(result));
+            }
+            if (is_found) {
+                high_water_mark = std::stoi(PQgetvalue(result, 0, 0));
+                completed_ids.clear();
+                std::string ids = PQgetvalue(result, 0, 1);
+                for (size_t begin = 0, end; begin < ids.size(); begin = end + 1) {
+                    end = ids.find(',', begin);
+                    if (end == std::string::npos) {
+                        end = ids.size();
+                    }
+                    completed_ids.push_back(std::stoi(ids.substr(begin, end - begin)));
+                }
+                if (!PQgetisnull(result, 0, 2) && !PQgetisnull(result, 0, 3)) {
+                    range = DataRange(std::stoi(PQgetvalue(result, 0, 2)), std::stoi(PQgetvalue(result, 0, 3)));
+                }
+            }
+            PQclear(result);
+            m_pg_backend_ptr->free_connection(connection);
+            return is_found;
+        }
+
+        bool DbQueryExecutor::start_checkpoint(const std::string &table_name, const std::string &worker_key
+                                               , const DataRange &range)
+        {
+            auto high_water_mark_text = std::to_string(range.first - 1);
+            auto first_text = std::to_string(range.first);
+            auto last_text = std::to_string(range.second);
+
+            auto connection = m_pg_backend_ptr->connection();
+            std::string query = (boost::format(
+                    "INSERT INTO %s (worker_key, high_water_mark, range_first, range_last, updated_at)\n"
+                    " VALUES ($1, $2::integer, $3::integer, $4::integer, now())\n"
+                    " ON CONFLICT (worker_key) DO NOTHING;") % table_name).str();
+            const char *params[] = {worker_key.c_str(), high_water_mark_text.c_str(), first_text.c_str()
+                                    , last_text.c_str()};
+            MD_PROBE1(db_query_start, query.c_str());
+            auto result = PQexecParams(connection->connection().get(), query.c_str(), 4, nullptr, params, nullptr
+                                       , nullptr, 0);
+            MD_PROBE(db_query_end);
+            bool is_ok = PQresultStatus(result) == PGRES_COMMAND_OK;
+            if (!is_ok) {
+                MD_LOG_ERROR(PQresultErrorMessage(result));
+            }
+            PQclear(result);
+            m_pg_backend_ptr->free_connection(connection);
+            return is_ok;
+        }
+
+        bool DbQueryExecutor::save_checkpoint(const std::string &table_name, const std::string &worker_key
+                                              , int high_water_mark, const std::vector<int> &completed_ids)
+        {
+            std::string id_array = "{";
+            for (size_t i = 0; i < completed_ids.size(); ++i) {
+                if (i > 0) {
+                    id_array += ",";
+                }
+                id_array += std::to_string(completed_ids[i]);
+            }
+            id_array += "}";
+            auto high_water_mark_text = std::to_string(high_water_mark);
+
+            auto connection = m_pg_backend_ptr->connection();
+            std::string query = (boost::format(
+                    "INSERT INTO %s (worker_key, high_water_mark, completed_ids, updated_at)\n"
+                    " VALUES ($1, $2::integer, $3::integer[], now())\n"
+                    " ON CONFLICT (worker_key) DO UPDATE SET high_water_mark = EXCLUDED.high_water_mark,\n"
+                    "  completed_ids = EXCLUDED.completed_ids, updated_at = EXCLUDED.updated_at;")
+                                 % table_name).str();
+            const char *params[] = {worker_key.c_str(), high_water_mark_text.c_str(), id_array.c_str()};
+            MD_PROBE1(db_query_start, query.c_str());
+            auto result = PQexecParams(connection->connection().get(), query.c_str(), 3, nullptr, params, nullptr
+                                       , nullptr, 0);
+            MD_PROBE(db_query_end);
+            bool is_ok = PQresultStatus(result) == PGRES_COMMAND_OK;
+            if (!is_ok) {
+                MD_LOG_ERROR(PQresultErrorMessage(result));
+            }
+            PQclear(result);
+            m_pg_backend_ptr->free_connection(connection);
+            return is_ok;
+        }
     }
 }
@@ -2,7 +2,9 @@
 #ifndef DB_QUERY_EXECUTOR_HPP
 #define DB_QUERY_EXECUTOR_HPP
 
+#include <vector>
 #include "db_tools.hpp"
+#include "pg_pipeline.hpp"
 
 namespace md
 {
@@ -13,10 +15,17 @@ namespace md
         {
             PGBackendPtr m_pg_backend_ptr;
         public:
+            // the get_data4send_mail* fetches and get_row_count read from a replica when there is one,
+            // everything else, get_max_id used for resuming included, runs on the primary
             explicit DbQueryExecutor(ConfigPtr &db_config);
 
+            ~DbQueryExecutor();
+
             StringListArray get_data4send_mail(const DataRange &data_range);
 
+            // the rows of one sender login in the range, in id order
+            StringListArray get_data4send_mail(const DataRange &data_range, const std::string &login);
+
             StringListArray get_data4send_mail(
                     const DataRange &data_range
                     , const std::string &login
@@ -25,8 +34,81 @@ namespace md
 
             int get_row_count(const std::string &table_name);
 
+            // rows with id above last_id in id order, at most limit of them
+            StringListArray get_data4send_mail_after(int last_id, int limit);
+
+            /**
+             * rows from first_id on that are not completed and not in excluded_ids, in id order, at most
+             * limit of them; read on the primary, which has the completions of the caller already
+             */
+            StringListArray get_unsent_data4send_mail(int first_id, const std::vector<int> &excluded_ids, int limit);
+
+            int get_max_id(const std::string &table_name, const std::string &column_name);
+
+            // statement level AFTER INSERT trigger on core.emails that notifies the channel
+            bool install_notify_trigger(const std::string &channel);
+
+            // keeps a connection of the pool for LISTEN until the executor is destroyed
+            bool listen(const std::string &channel);
+
+            // true if a notification arrived within timeout_ms, sleeps the timeout when not listening
+            bool wait_notification(int timeout_ms);
+
+            PGBackendPtr backend() const
+            {
+                return m_pg_backend_ptr;
+            }
+
+            // claimed_by/claimed_at/completed_at columns on core.emails for claim based distribution and
+            // the notify pickup, once per start before the workers, not by every one of them
+            bool prepare_claim_columns();
+
+            // marks completed_ids of this worker as done without claiming more
+            bool complete_claims(const std::string &worker_id, const std::vector<int> &completed_ids);
+
+            // marks completed_ids as done whoever handed them out
+            bool complete_jobs(const std::vector<int> &completed_ids);
+
+            /**
+             * marks completed_ids of this worker as done and claims up to limit unclaimed rows,
+             * rows whose claim is older than lease_seconds are taken back; both in one round trip.
+             * Every row ends with one more column, the claim time in unix milliseconds
+             */
+            StringListArray claim_data4send_mail(const std::string &worker_id, int limit, int lease_seconds
+                                                 , const std::vector<int> &completed_ids);
+
+            // progress table of the range workers, one row per worker key
+            bool prepare_checkpoint_table(const std::string &table_name);
+
+            /**
+             * every id up to high_water_mark and the completed_ids above it are done for this worker key,
+             * range becomes the one the key was started with; false when the worker has no checkpoint yet
+             */
+            bool load_checkpoint(const std::string &table_name, const std::string &worker_key, DataRange &range
+                                 , int &high_water_mark, std::vector<int> &completed_ids);
+
+            // checkpoint of a new worker key with nothing done yet, keeps the range for the restarts
+            bool start_checkpoint(const std::string &table_name, const std::string &worker_key
+                                  , const DataRange &range);
+
+            // upsert of the worker's checkpoint, one statement however many ids completed since the last one
+            bool save_checkpoint(const std::string &table_name, const std::string &worker_key, int high_water_mark
+                                 , const std::vector<int> &completed_ids);
+
+            // takes a connection out of the pool until the pipeline is destroyed
+            PGPipelinePtr pipeline();
+
+            // all queries share one round trip; result i belongs to query i, failed queries give an empty result
+            std::vector<StringListArray> execute_pipelined(const std::vector<std::string> &queries);
+
         private:
             void init(ConfigPtr &sharedPtr);
+
+            int m_pipeline_depth = 256;
+
+            std::shared_ptr<PGConnection> m_listen_connection;
+
+            std::string m_listen_channel;
         };
 
     }
@@ -1,4 +1,3 @@
-
 #include "db_tools.hpp"
 #include "../../tools/service/service.hpp"
 namespace md
@@ -6,5 +5,22 @@ namespace md
     using namespace service;
     namespace db
     {
+        void append_query_result(const PGresult *result, StringListArray &query_result)
+        {
+            if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+                return;
+            }
+            auto pq_tuples_count = PQntuples(result);
+            auto pq_fields_count = PQnfields(result);
+            query_result.reserve(query_result.size() + pq_tuples_count);
+            for (auto i = 0; i < pq_tuples_count; ++i) {
+                StringList list;
+                list.reserve(pq_fields_count);
+                for (auto j = 0; j < pq_fields_count; ++j) {
+                    list.emplace_back(PQgetvalue(result, i, j), PQgetlength(result, i, j));
+                }
+                query_result.emplace_back(std::move(list));
+            }
+        }
     }
 }
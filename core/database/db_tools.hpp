@@ -11,6 +11,11 @@ namespace md
     namespace db
     {
         using PGBackendPtr = std::shared_ptr<PGBackend>;
+
+        /**
+         * append all tuples of a PGRES_TUPLES_OK result to query_result, one StringList per row
+         */
+        void append_query_result(const PGresult *result, StringListArray &query_result);
     }
 }
 
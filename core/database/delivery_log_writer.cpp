@@ -0,0 +1,210 @@
+#include <algorithm>
+#include <ctime>
+#include <boost/format.hpp>
+#include "delivery_log_writer.hpp"
+#include "../../tools/probes/probes.hpp"
+#include "../../tools/tracer/tracer.hpp"
+
+namespace md
+{
+    using namespace service;
+    namespace db
+    {
+        const char *delivery_status_name(DELIVERY_STATUS status)
+        {
+            switch (status) {
+                case DELIVERY_STATUS::SENT:
+                    return "sent";
+                case DELIVERY_STATUS::FAILED:
+                    return "failed";
+                case DELIVERY_STATUS::DEFERRED:
+                    return "deferred";
+            }
+            return "unknown";
+        }
+
+        DeliveryLogWriter::DeliveryLogWriter(PGBackendPtr pg_backend_ptr, std::string table_name, int batch_size
+                                             , int flush_interval_ms)
+                : m_pg_backend_ptr(std::move(pg_backend_ptr))
+                  , m_table_name(std::move(table_name))
+                  , m_batch_size(batch_size > 0 ? batch_size : 1)
+                  , m_flush_interval(flush_interval_ms > 0 ? flush_interval_ms : 1000)
+                  , m_is_stopped(false)
+        {
+            create_table();
+            m_records.reserve(m_batch_size);
+            m_thread = std::thread(&DeliveryLogWriter::run, this);
+        }
+
+        DeliveryLogWriter::DeliveryLogWriter(PGBackendPtr pg_backend_ptr, const ConfigPtr &db_config)
+                : DeliveryLogWriter(std::move(pg_backend_ptr)
+                                    , dynamic_cast<DbConfig *>(db_config.get())->m_delivery_log_table
+                                    , dynamic_cast<DbConfig *>(db_config.get())->m_delivery_log_batch
+                                    , dynamic_cast<DbConfig *>(db_config.get())->m_delivery_log_interval)
+        {
+        }
+
+        DeliveryLogWriter::~DeliveryLogWriter()
+        {
+            m_is_stopped = true;
+            m_condition.notify_one();
+            if (m_thread.joinable()) {
+                m_thread.join();
+            }
+            flush();
+        }
+
+        void DeliveryLogWriter::push(const DeliveryRecord &record)
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_records.push_back(record);
+            if (m_records.size() >= m_batch_size) {
+                lock.unlock();
+                m_condition.notify_one();
+            }
+        }
+
+        bool DeliveryLogWriter::flush()
+        {
+            std::vector<DeliveryRecord> records;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                records.swap(m_records);
+            }
+            if (records.empty()) {
+                return true;
+            }
+
+            std::lock_guard<std::mutex> copy_lock(m_copy_mutex);
+            bool is_copied;
+            {
+                // a trace of its own, the messages it logs were traced by the worker threads
+                tracer::Span span("delivery_log_copy", true);
+                span.set_arg("records", std::to_string(records.size()));
+                is_copied = copy_records(records);
+            }
+            if (is_copied) {
+                return true;
+            }
+
+            // keep a failed batch for the next flush, but don't grow without limit while the DB is away
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_records.size() + records.size() <= m_batch_size * 4) {
+                m_records.insert(m_records.begin(), records.begin(), records.end());
+            } else {
+                MD_LOG_WARNING((boost::format("delivery log: %d records dropped") % records.size()).str());
+            }
+            return false;
+        }
+
+        void DeliveryLogWriter::run()
+        {
+            // after a failed COPY a full batch must not wake the writer, it waits out a growing delay instead
+            const auto max_retry_delay = std::max(m_flush_interval, std::chrono::milliseconds(60000));
+            auto delay = m_flush_interval;
+            bool is_failing = false;
+            while (!m_is_stopped) {
+                {
+                    std::unique_lock<std::mutex> lock(m_mutex);
+                    m_condition.wait_for(lock, delay, [this, is_failing]() {
+                        return m_is_stopped || (!is_failing && m_records.size() >= m_batch_size);
+                    });
+                }
+                if (flush()) {
+                    delay = m_flush_interval;
+                    is_failing = false;
+                } else {
+                    delay = is_failing ? std::min(delay * 2, max_retry_delay) : m_flush_interval;
+                    is_failing = true;
+                }
+            }
+        }
+
+        void DeliveryLogWriter::create_table()
+        {
+            auto connection = m_pg_backend_ptr->connection();
+            std::string query = (boost::format("CREATE TABLE IF NOT EXISTS %s (\n"
+                                               " email_id integer NOT NULL,\n"
+                                               " status text NOT NULL,\n"
+                                               " reply_code integer,\n"
+                                               " latency_us bigint,\n"
+                                               " created_at timestamptz NOT NULL);") % m_table_name).str();
+            auto result = PQexec(connection->connection().get(), query.c_str());
+            if (PQresultStatus(result) == PGRES_FATAL_ERROR) {
+                MD_LOG_ERROR(PQresultErrorMessage(result));
+            }
+            PQclear(result);
+            m_pg_backend_ptr->free_connection(connection);
+        }
+
+        bool DeliveryLogWriter::copy_records(const std::vector<DeliveryRecord> &records)
+        {
+            auto connection = m_pg_backend_ptr->connection();
+            auto conn = connection->connection().get();
+
+            std::string query = (boost::format("COPY %s (email_id, status, reply_code, latency_us, created_at) "
+                                               "FROM STDIN;") % m_table_name).str();
+            MD_PROBE1(db_query_start, query.c_str());
+            auto result = PQexec(conn, query.c_str());
+            bool is_ok = PQresultStatus(result) == PGRES_COPY_IN;
+            if (!is_ok) {
+                MD_LOG_ERROR(PQresultErrorMessage(result));
+            }
+            PQclear(result);
+
+            if (is_ok) {
+                const size_t chunk_size = 64 * 1024;
+                std::string buffer;
+                buffer.reserve(chunk_size + 128);
+                char line[128];
+                for (const auto &record : records) {
+                    auto since_epoch = record.m_timestamp.time_since_epoch();
+                    auto seconds = std::chrono::duration_cast<std::chrono::seconds>(since_epoch);
+                    auto micros = std::chrono::duration_cast<std::chrono::microseconds>(since_epoch - seconds);
+                    time_t raw_time = seconds.count();
+                    struct tm time_info{};
+                    gmtime_r(&raw_time, &time_info);
+
+                    snprintf(line, sizeof(line), "%d\t%s\t%d\t%lld\t%04d-%02d-%02d %02d:%02d:%02d.%06d+00\n"
+                             , record.m_id, delivery_status_name(record.m_status), record.m_reply_code
+                             , record.m_latency_us, time_info.tm_year + 1900, time_info.tm_mon + 1
+                             , time_info.tm_mday, time_info.tm_hour, time_info.tm_min, time_info.tm_sec
+                             , static_cast<int>(micros.count()));
+                    buffer += line;
+
+                    if (buffer.size() >= chunk_size) {
+                        if (PQputCopyData(conn, buffer.data(), static_cast<int>(buffer.size())) != 1) {
+                            is_ok = false;
+                            break;
+                        }
+                        buffer.clear();
+                    }
+                }
+                if (is_ok && !buffer.empty()) {
+                    is_ok = PQputCopyData(conn, buffer.data(), static_cast<int>(buffer.size())) == 1;
+                }
+                if (PQputCopyEnd(conn, is_ok ? nullptr : "delivery log buffer not sent") != 1) {
+                    is_ok = false;
+                }
+
+                while (auto copy_result = PQgetResult(conn)) {
+                    if (PQresultStatus(copy_result) != PGRES_COMMAND_OK) {
+                        MD_LOG_ERROR(PQresultErrorMessage(copy_result));
+                        is_ok = false;
+                    }
+                    PQclear(copy_result);
+                }
+            }
+            MD_PROBE(db_query_end);
+
+            // a connection lost during the COPY would fail every later flush from the pool
+            if (!is_ok && PQstatus(conn) == CONNECTION_BAD) {
+                MD_LOG_ERROR(PQerrorMessage(conn));
+                PQreset(conn);
+            }
+            m_pg_backend_ptr->free_connection(connection);
+            return is_ok;
+        }
+
+    }// namespace db
+}// namespace md
@@ -0,0 +1,87 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "db_tools.hpp"
+
+namespace md
+{
+    using namespace service;
+    namespace db
+    {
+        enum class DELIVERY_STATUS : int
+        {
+            SENT = 0,
+            FAILED = 1,
+            DEFERRED = 2// transient 4xx reply, worth another attempt later
+        };
+
+        const char *delivery_status_name(DELIVERY_STATUS status);
+
+        struct DeliveryRecord
+        {
+            int m_id = 0;
+            DELIVERY_STATUS m_status = DELIVERY_STATUS::FAILED;
+            int m_reply_code = 0;
+            long long m_latency_us = 0;
+            std::chrono::system_clock::time_point m_timestamp;
+        };
+
+        /**
+         * Buffers per-message delivery outcomes and writes them to the delivery log table
+         * with COPY ... FROM STDIN, one round trip per batch instead of one UPDATE per message.
+         * A batch is flushed by a background thread when it reaches batch_size records
+         * or when flush_interval_ms passed since the last flush. After a failed COPY the next one waits
+         * flush_interval_ms, doubling up to a minute while the database stays away.
+         *
+         * expected table (created when missing):
+         *   email_id integer, status text, reply_code integer, latency_us bigint, created_at timestamptz
+         */
+        class DeliveryLogWriter
+        {
+        public:
+            DeliveryLogWriter(PGBackendPtr pg_backend_ptr, std::string table_name, int batch_size
+                              , int flush_interval_ms);
+
+            explicit DeliveryLogWriter(PGBackendPtr pg_backend_ptr, const ConfigPtr &db_config);
+
+            ~DeliveryLogWriter();
+
+            DeliveryLogWriter(const DeliveryLogWriter &) = delete;
+
+            DeliveryLogWriter &operator=(const DeliveryLogWriter &) = delete;
+
+            void push(const DeliveryRecord &record);
+
+            // write everything buffered so far, blocks until the COPY is done;
+            // false - it failed and the records are kept for the next flush
+            bool flush();
+
+        private:
+            void create_table();
+
+            void run();
+
+            bool copy_records(const std::vector<DeliveryRecord> &records);
+
+            PGBackendPtr m_pg_backend_ptr;
+            std::string m_table_name;
+            size_t m_batch_size;
+            std::chrono::milliseconds m_flush_interval;
+
+            std::mutex m_mutex;
+            std::mutex m_copy_mutex;
+            std::condition_variable m_condition;
+            std::vector<DeliveryRecord> m_records;
+            std::atomic<bool> m_is_stopped;
+            std::thread m_thread;
+        };
+
+        using DeliveryLogWriterPtr = std::shared_ptr<DeliveryLogWriter>;
+
+    }// namespace db
+}// namespace md
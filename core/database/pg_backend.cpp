@@ -1,5 +1,7 @@
 #include "pg_backend.hpp"
 #include <thread>
+#include <boost/format.hpp>
+#include "../../tools/probes/probes.hpp"
 
 namespace md
 {
@@ -15,12 +17,41 @@ namespace md
             std::lock_guard<std::mutex> locker(m_mutex);
             for (auto i = 0; i < POOL_COUNT; ++i) {
                     if(auto connection = std::make_shared<PGConnection>(db_config)) {
-                    std::cout << "connection created,  i = " << i << std::endl;
+                    MD_LOG_DEBUG((boost::format("connection %d created") % i).str());
                     m_pool.push(connection);
+                    ++m_idle_count;
                 } else {
                     throw std::runtime_error("can't create connection");
                 }
             }
+
+            auto db_conf = dynamic_cast<DbConfig *> (db_config.get());
+            if (!db_conf) {
+                return;
+            }
+            m_max_replica_lag = db_conf->m_max_replica_lag;
+            for (const auto &address : db_conf->m_replicas) {
+                Replica replica;
+                auto colon = address.rfind(':');
+                replica.m_host = address.substr(0, colon);
+                replica.m_port = colon == std::string::npos ? db_conf->m_port : std::stoi(address.substr(colon + 1));
+                try {
+                    for (auto i = 0; i < POOL_COUNT; ++i) {
+                        auto connection = std::make_shared<PGConnection>(db_config, replica.m_host, replica.m_port);
+                        connection->set_replica(static_cast<int>(m_replicas.size()));
+                        replica.m_pool.push(connection);
+                    }
+                }
+                catch (std::runtime_error &e) {
+                    // reads go to the other replicas or the primary, the delivery doesn't depend on it
+                    MD_LOG_WARNING("replica " + address + " skipped: " + e.what());
+                    continue;
+                }
+                MD_LOG_INFO((boost::format("replica %s:%d connected") % replica.m_host % replica.m_port).str());
+                m_replica_pool_size += POOL_COUNT;
+                m_replica_idle_count += POOL_COUNT;
+                m_replicas.push_back(std::move(replica));
+            }
         }
 
         std::shared_ptr<PGConnection> PGBackend::connection()
@@ -34,13 +65,153 @@ namespace md
 
             auto front_connection = m_pool.front();
             m_pool.pop();
+            --m_idle_count;
+            MD_PROBE2(pool_acquire, -1, static_cast<int>(m_pool.size()));
+            return front_connection;
+        }
+
+        std::shared_ptr<PGConnection> PGBackend::try_connection()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_pool.empty()) {
+                return nullptr;
+            }
+            auto front_connection = m_pool.front();
+            m_pool.pop();
+            --m_idle_count;
+            MD_PROBE2(pool_acquire, -1, static_cast<int>(m_pool.size()));
             return front_connection;
         }
 
+        std::shared_ptr<PGConnection> PGBackend::read_connection()
+        {
+            while (true) {
+                std::shared_ptr<PGConnection> replica_connection;
+                bool is_lag_check_due = false;
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    auto idx = pick_replica(true);
+                    if (idx < 0) {
+                        break;
+                    }
+                    auto &replica = m_replicas[idx];
+                    replica_connection = replica.m_pool.front();
+                    replica.m_pool.pop();
+                    --m_replica_idle_count;
+                    MD_PROBE2(pool_acquire, idx, static_cast<int>(replica.m_pool.size()));
+                    auto now = std::chrono::steady_clock::now();
+                    if (now - replica.m_lag_checked_at >= std::chrono::milliseconds(LAG_CHECK_INTERVAL_MS)) {
+                        // one reader checks, the others keep the last verdict meanwhile
+                        replica.m_lag_checked_at = now;
+                        is_lag_check_due = true;
+                    }
+                }
+                if (!is_lag_check_due && PQstatus(replica_connection->connection().get()) == CONNECTION_OK) {
+                    return replica_connection;
+                }
+
+                auto is_fresh = check_lag(*replica_connection);
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    m_replicas[replica_connection->replica()].m_is_lagging = !is_fresh;
+                }
+                if (is_fresh) {
+                    return replica_connection;
+                }
+                free_connection(replica_connection);
+            }
+            return connection();
+        }
+
+        std::shared_ptr<PGConnection> PGBackend::try_read_connection()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                auto idx = pick_replica(false);
+                if (idx >= 0) {
+                    auto replica_connection = m_replicas[idx].m_pool.front();
+                    m_replicas[idx].m_pool.pop();
+                    --m_replica_idle_count;
+                    MD_PROBE2(pool_acquire, idx, static_cast<int>(m_replicas[idx].m_pool.size()));
+                    return replica_connection;
+                }
+            }
+            return try_connection();
+        }
+
+        int PGBackend::pick_replica(bool is_lag_check_allowed) const
+        {
+            auto now = std::chrono::steady_clock::now();
+            int picked = -1;
+            for (size_t idx = 0; idx < m_replicas.size(); ++idx) {
+                const auto &replica = m_replicas[idx];
+                if (replica.m_pool.empty()) {
+                    continue;
+                }
+                // a lagging replica is tried again once its last check is old enough
+                if (replica.m_is_lagging
+                    && (!is_lag_check_allowed
+                        || now - replica.m_lag_checked_at < std::chrono::milliseconds(LAG_CHECK_INTERVAL_MS))) {
+                    continue;
+                }
+                // every replica pool has POOL_COUNT connections, the largest free pool has the fewest in use
+                if (picked < 0 || replica.m_pool.size() > m_replicas[picked].m_pool.size()) {
+                    picked = static_cast<int>(idx);
+                }
+            }
+            return picked;
+        }
+
+        bool PGBackend::check_lag(PGConnection &connection)
+        {
+            auto conn = connection.connection().get();
+            if (PQstatus(conn) != CONNECTION_OK) {
+                PQreset(conn);
+                if (PQstatus(conn) != CONNECTION_OK) {
+                    MD_LOG_ERROR(PQerrorMessage(conn));
+                    return false;
+                }
+            }
+            // a replica that replayed all it received is current however old its last transaction is, as long
+            // as it still streams; with the WAL receiver gone it replayed all it got but falls behind unseen
+            auto result = PQexec(conn, "SELECT CASE WHEN NOT pg_is_in_recovery() THEN 0\n"
+                                       " WHEN NOT EXISTS (SELECT 1 FROM pg_stat_wal_receiver"
+                                       " WHERE status = 'streaming') THEN NULL\n"
+                                       " WHEN pg_last_wal_receive_lsn() = pg_last_wal_replay_lsn() THEN 0\n"
+                                       " ELSE extract(epoch FROM now() - pg_last_xact_replay_timestamp()) * 1000 END;");
+            bool is_fresh = false;
+            if (PQresultStatus(result) == PGRES_TUPLES_OK && PQntuples(result)) {
+                if (PQgetisnull(result, 0, 0)) {
+                    MD_LOG_WARNING("replica " + connection.host() + " doesn't stream from the primary, "
+                                   "reading from the others");
+                } else {
+                    auto lag = std::stod(PQgetvalue(result, 0, 0));
+                    is_fresh = lag <= m_max_replica_lag;
+                    if (!is_fresh) {
+                        MD_LOG_WARNING((boost::format("replica %s lags %.0f ms behind, reading from the others")
+                                       % connection.host() % lag).str());
+                    }
+                }
+            }
+            if (PQresultStatus(result) == PGRES_FATAL_ERROR) {
+                MD_LOG_ERROR(PQresultErrorMessage(result));
+            }
+            PQclear(result);
+            return is_fresh;
+        }
+
         void PGBackend::free_connection(const std::shared_ptr<PGConnection>& connection)
         {
+            MD_PROBE1(pool_release, connection->replica());
             std::unique_lock<std::mutex> lock(m_mutex);
+            if (connection->replica() >= 0) {
+                // nobody waits for a replica connection, readers fall back to the primary
+                m_replicas[connection->replica()].m_pool.push(connection);
+                ++m_replica_idle_count;
+                return;
+            }
             m_pool.push(connection);
+            ++m_idle_count;
             lock.unlock();
             m_condition.notify_one();
         }
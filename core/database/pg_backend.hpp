@@ -1,7 +1,10 @@
 
 #pragma once
+#include <atomic>
+#include <chrono>
 #include <memory>
 #include <mutex>
+#include <vector>
 #include <string>
 #include <queue>
 #include <condition_variable>
@@ -21,14 +24,63 @@ namespace md
 
             std::shared_ptr<PGConnection> connection();
 
+            // a free connection of the pool or nullptr, never waits
+            std::shared_ptr<PGConnection> try_connection();
+
+            /**
+             * a connection for a read-only query: the replica with the fewest connections in use among those
+             * replaying within the configured lag, the primary when no replica qualifies or none is configured
+             */
+            std::shared_ptr<PGConnection> read_connection();
+
+            // like read_connection() but nullptr instead of waiting, lagging replicas aren't checked again here
+            std::shared_ptr<PGConnection> try_read_connection();
+
+            // takes back connections of the primary and of the replicas
             void free_connection(const std::shared_ptr<PGConnection>& connection);
 
             void setup_connection(ConfigPtr &ptr);
+
+            // pool gauges for monitoring, read without the pool lock
+            int pool_size() const
+            {
+                return POOL_COUNT;
+            }
+
+            int idle_connections() const
+            {
+                return m_idle_count.load(std::memory_order_relaxed);
+            }
+
+            int replica_pool_size() const
+            {
+                return m_replica_pool_size.load(std::memory_order_relaxed);
+            }
+
+            int replica_idle_connections() const
+            {
+                return m_replica_idle_count.load(std::memory_order_relaxed);
+            }
         private:
             void create_pool(const ConfigPtr& db_config);
 
             void print();
 
+            struct Replica
+            {
+                std::string m_host;
+                int m_port = 5432;
+                std::queue<std::shared_ptr<PGConnection>> m_pool;
+                bool m_is_lagging = false;
+                std::chrono::steady_clock::time_point m_lag_checked_at;
+            };
+
+            // free replica with the fewest connections in use or -1, called with m_mutex held
+            int pick_replica(bool is_lag_check_allowed) const;
+
+            // true if the replica of the connection replays within m_max_replica_lag
+            bool check_lag(PGConnection &connection);
+
             std::mutex m_mutex;
 
             std::condition_variable m_condition;
@@ -36,6 +88,19 @@ namespace md
             std::queue<std::shared_ptr<PGConnection>> m_pool;
 
             const int POOL_COUNT = 10;
+
+            std::vector<Replica> m_replicas;
+
+            int m_max_replica_lag = 5000;
+
+            const int LAG_CHECK_INTERVAL_MS = 1000;
+
+            // sizes of the pools, kept up to date under m_mutex
+            std::atomic<int> m_idle_count{0};
+
+            std::atomic<int> m_replica_pool_size{0};
+
+            std::atomic<int> m_replica_idle_count{0};
         private:
             std::string m_host;
             int m_port = 5432;// default postgrtes port
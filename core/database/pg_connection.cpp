@@ -32,6 +32,27 @@ namespace md
             m_password = db_conf->m_password;
             m_port = db_conf->m_port;
 
+            connect();
+        }
+
+        PGConnection::PGConnection(const ConfigPtr &db_config, const std::string &host, int port)
+        {
+            auto db_conf = dynamic_cast<DbConfig *> (db_config.get());
+            m_host = host;
+            m_database_name = db_conf->m_database_name;
+            m_username = db_conf->m_username;
+            m_password = db_conf->m_password;
+            m_port = port;
+
+            connect();
+            // unlike the primary, which recovers by PQreset later, an unreachable replica is left out of the pool
+            if (PQstatus(m_connection.get()) != CONNECTION_OK) {
+                throw std::runtime_error(PQerrorMessage(m_connection.get()));
+            }
+        }
+
+        void PGConnection::connect()
+        {
             m_connection.reset(PQsetdbLogin(m_host.c_str(), std::to_string(m_port).c_str(), nullptr, nullptr,
                                             m_database_name.c_str(), m_username.c_str(), m_password.c_str()),
                                &PQfinish);
@@ -17,6 +17,9 @@ namespace md
 
             explicit PGConnection(const ConfigPtr &db_config);
 
+            // same database and credentials on another server, a read replica; throws when it can't connect
+            PGConnection(const ConfigPtr &db_config, const std::string &host, int port);
+
             std::shared_ptr<PGconn> connection() const;
 
             const std::string &host() const
@@ -58,13 +61,27 @@ namespace md
                 return true;
             }
 
+            // index of the replica pool the connection belongs to, -1 for the primary
+            int replica() const
+            {
+                return m_replica;
+            }
+
+            void set_replica(int replica)
+            {
+                m_replica = replica;
+            }
+
         private:
+            void connect();
+
             std::string m_host;
             int m_port = 5432;
             std::string m_database_name;
             std::string m_username;
             std::string m_password;
             std::shared_ptr<PGconn> m_connection;
+            int m_replica = -1;
 
         };
 
@@ -0,0 +1,225 @@
+#include <cerrno>
+#include <vector>
+#include <sys/select.h>
+#include "pg_pipeline.hpp"
+#include "../../tools/probes/probes.hpp"
+
+namespace md
+{
+    using namespace service;
+    namespace db
+    {
+        PGPipeline::PGPipeline(PGBackendPtr pg_backend_ptr, std::shared_ptr<PGConnection> connection, int depth)
+                : m_conn(connection->connection().get())
+                  , m_pg_backend_ptr(std::move(pg_backend_ptr))
+                  , m_connection(std::move(connection))
+                  , m_depth(depth > 0 ? depth : 1)
+        {
+#ifdef LIBPQ_HAS_PIPELINING
+            // pipeline mode must be non-blocking, otherwise a full send buffer on both sides deadlocks
+            if (PQsetnonblocking(m_conn, 1) != 0 || PQenterPipelineMode(m_conn) != 1) {
+                std::string error = PQerrorMessage(m_conn);
+                // back to the pool the way it came, the other users of the pool expect blocking mode
+                PQsetnonblocking(m_conn, 0);
+                m_pg_backend_ptr->free_connection(m_connection);
+                throw std::runtime_error(error);
+            }
+#endif
+        }
+
+        PGPipeline::~PGPipeline()
+        {
+            try {
+                sync();
+            }
+            catch (std::exception &e) {
+                MD_LOG_ERROR(e.what());
+            }
+#ifdef LIBPQ_HAS_PIPELINING
+            // exiting fails while results are pending, after a failed sync; a reset drops them
+            if (PQexitPipelineMode(m_conn) != 1) {
+                MD_LOG_ERROR(PQerrorMessage(m_conn));
+                PQreset(m_conn);
+            }
+            PQsetnonblocking(m_conn, 0);
+#endif
+            m_pg_backend_ptr->free_connection(m_connection);
+        }
+
+        void PGPipeline::push(const std::string &query, ResultHandler handler)
+        {
+            push(query, StringList(), std::move(handler));
+        }
+
+        void PGPipeline::push(const std::string &query, const StringList &params, ResultHandler handler)
+        {
+            std::vector<const char *> values;
+            values.reserve(params.size());
+            for (const auto &param : params) {
+                values.push_back(param.c_str());
+            }
+
+            MD_PROBE1(db_query_start, query.c_str());
+            if (!PQsendQueryParams(m_conn, query.c_str(), static_cast<int>(values.size()), nullptr,
+                                   values.empty() ? nullptr : values.data(), nullptr, nullptr, 0)) {
+                throw std::runtime_error(PQerrorMessage(m_conn));
+            }
+
+            Entry entry;
+            entry.m_handler = std::move(handler);
+            m_queue.push_back(std::move(entry));
+
+#ifdef LIBPQ_HAS_PIPELINING
+            auto flush_result = PQflush(m_conn);
+            if (flush_result < 0) {
+                throw std::runtime_error(PQerrorMessage(m_conn));
+            }
+            m_is_flush_pending = flush_result == 1;
+
+            if (++m_unsynced >= m_depth) {
+                flush();
+                poll();
+            }
+#else
+            // no pipeline support in libpq: every statement is a round trip of its own
+            auto &back = m_queue.back();
+            while (auto result = PQgetResult(m_conn)) {
+                collect(back, result);
+            }
+            MD_PROBE(db_query_end);
+            auto completed = std::move(back);
+            m_queue.pop_back();
+            if (completed.m_handler) {
+                completed.m_handler(completed.m_is_ok, completed.m_rows);
+            }
+#endif
+        }
+
+        void PGPipeline::flush()
+        {
+#ifdef LIBPQ_HAS_PIPELINING
+            if (m_unsynced == 0) {
+                return;
+            }
+            if (PQpipelineSync(m_conn) != 1) {
+                throw std::runtime_error(PQerrorMessage(m_conn));
+            }
+            Entry entry;
+            entry.m_is_sync = true;
+            m_queue.push_back(std::move(entry));
+            m_unsynced = 0;
+
+            auto flush_result = PQflush(m_conn);
+            if (flush_result < 0) {
+                throw std::runtime_error(PQerrorMessage(m_conn));
+            }
+            m_is_flush_pending = flush_result == 1;
+#endif
+        }
+
+        int PGPipeline::poll()
+        {
+#ifdef LIBPQ_HAS_PIPELINING
+            if (m_is_flush_pending) {
+                auto flush_result = PQflush(m_conn);
+                if (flush_result < 0) {
+                    throw std::runtime_error(PQerrorMessage(m_conn));
+                }
+                m_is_flush_pending = flush_result == 1;
+            }
+            if (!PQconsumeInput(m_conn)) {
+                throw std::runtime_error(PQerrorMessage(m_conn));
+            }
+            return dispatch();
+#else
+            return 0;
+#endif
+        }
+
+        int PGPipeline::sync()
+        {
+            flush();
+            while (!m_queue.empty()) {
+                poll();
+                if (!m_queue.empty()) {
+                    wait_socket();
+                }
+            }
+            auto failed = m_failed;
+            m_failed = 0;
+            return failed;
+        }
+
+        int PGPipeline::dispatch()
+        {
+            int completed = 0;
+            while (!m_queue.empty() && !PQisBusy(m_conn)) {
+                auto &front = m_queue.front();
+                auto result = PQgetResult(m_conn);
+
+                if (front.m_is_sync) {
+                    // PGRES_PIPELINE_SYNC has no trailing NULL result
+                    PQclear(result);
+                    m_queue.pop_front();
+                    continue;
+                }
+
+                if (result == nullptr) {// all results of the front statement are collected
+                    // the handler may queue new statements, so the entry leaves the queue first
+                    MD_PROBE(db_query_end);
+                    auto entry = std::move(front);
+                    m_queue.pop_front();
+                    ++completed;
+                    if (entry.m_handler) {
+                        entry.m_handler(entry.m_is_ok, entry.m_rows);
+                    }
+                    continue;
+                }
+
+                collect(front, result);
+            }
+            return completed;
+        }
+
+        void PGPipeline::collect(Entry &entry, PGresult *result)
+        {
+            switch (PQresultStatus(result)) {
+                case PGRES_TUPLES_OK:
+                    append_query_result(result, entry.m_rows);
+                    break;
+                case PGRES_COMMAND_OK:
+                    break;
+                case PGRES_FATAL_ERROR:
+                    MD_LOG_ERROR(PQresultErrorMessage(result));
+                    entry.m_is_ok = false;
+                    ++m_failed;
+                    break;
+                default:// PGRES_PIPELINE_ABORTED: an earlier statement of this sync point failed
+                    entry.m_is_ok = false;
+                    ++m_failed;
+                    break;
+            }
+            PQclear(result);
+        }
+
+        void PGPipeline::wait_socket()
+        {
+            auto socket = PQsocket(m_conn);
+            if (socket < 0) {
+                throw std::runtime_error("invalid pipeline connection socket");
+            }
+            fd_set fdread;
+            fd_set fdwrite;
+            FD_ZERO(&fdread);
+            FD_ZERO(&fdwrite);
+            FD_SET(socket, &fdread);
+            if (m_is_flush_pending) {
+                FD_SET(socket, &fdwrite);
+            }
+            if (select(socket + 1, &fdread, &fdwrite, nullptr, nullptr) < 0 && errno != EINTR) {
+                throw std::runtime_error("select() failed on pipeline connection");
+            }
+        }
+
+    }// namespace db
+}// namespace md
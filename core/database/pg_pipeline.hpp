@@ -0,0 +1,79 @@
+#pragma once
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <libpq-fe.h>
+#include "db_tools.hpp"
+
+namespace md
+{
+    using namespace service;
+    namespace db
+    {
+        /**
+         * Queues statements on one pooled connection in libpq pipeline mode (PG14+)
+         * and collects their results as they arrive, so a run of statements costs
+         * one network round trip instead of one per statement.
+         * Without pipeline support in libpq the statements are executed one by one.
+         */
+        class PGPipeline
+        {
+        public:
+            using ResultHandler = std::function<void(bool is_ok, const StringListArray &rows)>;
+
+            PGPipeline(PGBackendPtr pg_backend_ptr, std::shared_ptr<PGConnection> connection, int depth);
+
+            ~PGPipeline();
+
+            PGPipeline(const PGPipeline &) = delete;
+
+            PGPipeline &operator=(const PGPipeline &) = delete;
+
+            void push(const std::string &query, ResultHandler handler = ResultHandler());
+
+            void push(const std::string &query, const StringList &params, ResultHandler handler = ResultHandler());
+
+            // send a sync point for everything queued so far, don't wait for results
+            void flush();
+
+            // dispatch results that are already received, never blocks; returns count of completed statements
+            int poll();
+
+            // flush and wait until every queued statement completed; returns count of failed statements
+            int sync();
+
+            size_t pending() const
+            {
+                return m_queue.size();
+            }
+
+        private:
+            struct Entry
+            {
+                ResultHandler m_handler;
+                StringListArray m_rows;
+                bool m_is_ok = true;
+                bool m_is_sync = false;
+            };
+
+            int dispatch();
+
+            void collect(Entry &entry, PGresult *result);
+
+            void wait_socket();
+
+            PGconn *m_conn;
+            PGBackendPtr m_pg_backend_ptr;
+            std::shared_ptr<PGConnection> m_connection;
+            std::deque<Entry> m_queue;
+            int m_depth;
+            int m_unsynced = 0;
+            int m_failed = 0;
+            bool m_is_flush_pending = false;
+        };
+
+        using PGPipelinePtr = std::shared_ptr<PGPipeline>;
+
+    }// namespace db
+}// namespace md
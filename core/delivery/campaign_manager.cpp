@@ -0,0 +1,344 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <limits>
+#include <thread>
+#include <boost/format.hpp>
+#include "campaign_manager.hpp"
+
+namespace md
+{
+    using namespace service;
+    namespace delivery
+    {
+        namespace
+        {
+            // a finished campaign is reported this long, then forgotten on the next start
+            const std::chrono::hours FINISHED_TTL(24);
+
+            // an unresolved range runs up to max(id), whatever it is by then
+            DataRange id_bounds(const DataRange &range)
+            {
+                return range.second < range.first ? DataRange(range.first, std::numeric_limits<int>::max()) : range;
+            }
+
+            // the two campaigns may send the same rows
+            bool is_overlapping(const CampaignRequest &first, const CampaignRequest &second)
+            {
+                auto first_ids = id_bounds(first.m_range);
+                auto second_ids = id_bounds(second.m_range);
+                if (first_ids.first > second_ids.second || second_ids.first > first_ids.second) {
+                    return false;
+                }
+                return first.m_login.empty() || second.m_login.empty() || first.m_login == second.m_login;
+            }
+        }
+
+        const char *campaign_state_name(CAMPAIGN_STATE state)
+        {
+            switch (state) {
+                case CAMPAIGN_STATE::RUNNING:
+                    return "running";
+                case CAMPAIGN_STATE::DONE:
+                    return "done";
+                case CAMPAIGN_STATE::CANCELLED:
+                    return "cancelled";
+                case CAMPAIGN_STATE::FAILED:
+                    return "failed";
+            }
+            return "unknown";
+        }
+
+        struct CampaignManager::Campaign
+        {
+            int m_id = 0;
+            std::chrono::steady_clock::time_point m_started = std::chrono::steady_clock::now();
+            std::atomic<int> m_state{static_cast<int>(CAMPAIGN_STATE::RUNNING)};
+            std::atomic<bool> m_is_cancelled{false};
+            std::atomic<uint64_t> m_scanned{0};
+            std::atomic<uint64_t> m_fetched{0};
+            std::atomic<uint64_t> m_outcomes[3];// per DELIVERY_STATUS
+            std::atomic<int64_t> m_elapsed_ms{-1};// -1 - still running
+
+            // wakes the retry waits of the workers on cancel
+            mutable std::mutex m_mutex;
+            std::condition_variable m_condition;
+            CampaignRequest m_request;// under m_mutex, the range is resolved by run
+            std::string m_error;// under m_mutex
+
+            std::thread m_thread;
+
+            Campaign()
+            {
+                for (auto &outcome : m_outcomes) {
+                    outcome = 0;
+                }
+            }
+        };
+
+        /**
+         * the slice of a worker: rows of the campaign's login only, counts how far it got and what
+         * the rows came to, ends once the campaign is cancelled
+         */
+        class CampaignManager::CampaignJobSource : public JobSource
+        {
+        public:
+            CampaignJobSource(DbQueryExecutorPtr query_executor, const DataRange &range, int batch_size
+                              , CampaignPtr campaign, std::string login)
+                    : m_source(std::make_shared<RangeJobSource>(std::move(query_executor), range, batch_size
+                                                                , std::move(login)))
+                      , m_campaign(std::move(campaign))
+                      , m_range(range)
+                      , m_scanned_id(range.first - 1)
+            {
+            }
+
+            bool next_batch(StringListArray &batch) override
+            {
+                if (m_campaign->m_is_cancelled) {
+                    return false;
+                }
+                if (!m_source->next_batch(batch)) {
+                    scan_to(m_range.second);
+                    return false;
+                }
+                // the slices without a row of the login were read on the way
+                scan_to(m_source->next_id() - 1);
+                m_campaign->m_fetched += batch.size();
+                return true;
+            }
+
+            void complete(int job_id, db::DELIVERY_STATUS status) override
+            {
+                ++m_campaign->m_outcomes[static_cast<int>(status)];
+                m_source->complete(job_id, status);
+            }
+
+        private:
+            void scan_to(int id)
+            {
+                if (id > m_scanned_id) {
+                    m_campaign->m_scanned += static_cast<uint64_t>(id - m_scanned_id);
+                    m_scanned_id = id;
+                }
+            }
+
+            std::shared_ptr<RangeJobSource> m_source;
+            CampaignPtr m_campaign;
+            DataRange m_range;
+            int m_scanned_id;
+        };
+
+        CampaignManager::CampaignManager(DbQueryExecutorPtr query_executor, int batch_size, int worker_count
+                                         , Schedule schedule, WorkerFactory make_worker)
+                : m_query_executor(std::move(query_executor))
+                  , m_batch_size(batch_size > 0 ? batch_size : 1)
+                  , m_worker_count(worker_count > 0 ? worker_count : 1)
+                  , m_schedule(std::move(schedule))
+                  , m_make_worker(std::move(make_worker))
+        {
+        }
+
+        CampaignManager::~CampaignManager()
+        {
+            std::map<int, CampaignPtr> campaigns;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                campaigns.swap(m_campaigns);
+            }
+            for (auto &campaign : campaigns) {
+                cancel_campaign(*campaign.second);
+            }
+            for (auto &campaign : campaigns) {
+                if (campaign.second->m_thread.joinable()) {
+                    campaign.second->m_thread.join();
+                }
+            }
+        }
+
+        int CampaignManager::start(const CampaignRequest &request)
+        {
+            auto campaign = std::make_shared<Campaign>();
+            campaign->m_request = request;
+            std::lock_guard<std::mutex> lock(m_mutex);
+            expire_finished();
+            for (const auto &running : m_campaigns) {
+                if (static_cast<CAMPAIGN_STATE>(running.second->m_state.load()) != CAMPAIGN_STATE::RUNNING) {
+                    continue;
+                }
+                std::lock_guard<std::mutex> campaign_lock(running.second->m_mutex);
+                if (is_overlapping(request, running.second->m_request)) {
+                    MD_LOG_WARNING((boost::format("campaign ids %d-%d, login '%s' overlap campaign %d, not started")
+                                    % request.m_range.first % request.m_range.second % request.m_login
+                                    % running.first).str());
+                    return 0;
+                }
+            }
+            campaign->m_id = ++m_last_id;
+            m_campaigns[campaign->m_id] = campaign;
+            campaign->m_thread = std::thread(&CampaignManager::run, this, campaign);
+            MD_LOG_INFO((boost::format("campaign %d: ids %d-%d, login '%s'") % campaign->m_id
+                         % request.m_range.first % request.m_range.second % request.m_login).str());
+            return campaign->m_id;
+        }
+
+        bool CampaignManager::status(int campaign_id, CampaignStatus &status) const
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto it = m_campaigns.find(campaign_id);
+            if (it == m_campaigns.end()) {
+                return false;
+            }
+            status = status_of(*it->second);
+            return true;
+        }
+
+        bool CampaignManager::cancel(int campaign_id)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto it = m_campaigns.find(campaign_id);
+            if (it == m_campaigns.end()) {
+                return false;
+            }
+            cancel_campaign(*it->second);
+            return true;
+        }
+
+        std::vector<CampaignStatus> CampaignManager::list() const
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            std::vector<CampaignStatus> campaigns;
+            campaigns.reserve(m_campaigns.size());
+            for (const auto &campaign : m_campaigns) {
+                campaigns.push_back(status_of(*campaign.second));
+            }
+            return campaigns;
+        }
+
+        void CampaignManager::run(const CampaignPtr &campaign)
+        {
+            std::vector<std::thread> workers;
+            try {
+                DataRange range;
+                {
+                    std::lock_guard<std::mutex> lock(campaign->m_mutex);
+                    range = campaign->m_request.m_range;
+                }
+                if (range.second < range.first) {
+                    range.second = m_query_executor->get_max_id("core.emails", "id");
+                    std::lock_guard<std::mutex> lock(campaign->m_mutex);
+                    campaign->m_request.m_range = range;
+                }
+                // contiguous slices, so every worker reads its ids in order like a forked range worker
+                auto id_count = static_cast<int64_t>(range.second) - range.first + 1;
+                auto slice = std::max<int64_t>((id_count + m_worker_count - 1) / m_worker_count, 1);
+                for (int64_t first = range.first; first <= range.second; first += slice) {
+                    auto last = static_cast<int>(std::min<int64_t>(first + slice - 1, range.second));
+                    workers.emplace_back(&CampaignManager::run_worker, this, campaign
+                                         , DataRange(static_cast<int>(first), last));
+                }
+            }
+            catch (std::exception &e) {
+                MD_LOG_ERROR(e.what());
+                std::lock_guard<std::mutex> lock(campaign->m_mutex);
+                campaign->m_error = e.what();
+            }
+            for (auto &worker : workers) {
+                worker.join();
+            }
+
+            auto elapsed = std::chrono::steady_clock::now() - campaign->m_started;
+            campaign->m_elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count();
+            auto state = CAMPAIGN_STATE::DONE;
+            {
+                std::lock_guard<std::mutex> lock(campaign->m_mutex);
+                if (!campaign->m_error.empty()) {
+                    state = CAMPAIGN_STATE::FAILED;
+                } else if (campaign->m_is_cancelled) {
+                    state = CAMPAIGN_STATE::CANCELLED;
+                }
+            }
+            campaign->m_state = static_cast<int>(state);
+            MD_LOG_INFO((boost::format("campaign %d %s: %d sent, %d failed, %d deferred") % campaign->m_id
+                         % campaign_state_name(state) % campaign->m_outcomes[0].load()
+                         % campaign->m_outcomes[1].load() % campaign->m_outcomes[2].load()).str());
+        }
+
+        void CampaignManager::run_worker(const CampaignPtr &campaign, const DataRange &range)
+        {
+            try {
+                std::string login;
+                {
+                    std::lock_guard<std::mutex> lock(campaign->m_mutex);
+                    login = campaign->m_request.m_login;
+                }
+                JobSourcePtr job_source = std::make_shared<CampaignJobSource>(m_query_executor, range, m_batch_size
+                                                                              , campaign, login);
+                // a retry wait gives up on cancel, or the worker would sit out the backoff
+                job_source = m_schedule(job_source, [campaign](int64_t time_ms) {
+                    auto delay_ms = std::max<int64_t>(time_ms - steady_clock_ms(), 0);
+                    std::unique_lock<std::mutex> lock(campaign->m_mutex);
+                    return !campaign->m_condition.wait_for(lock, std::chrono::milliseconds(delay_ms), [&campaign] {
+                        return campaign->m_is_cancelled.load();
+                    });
+                });
+                m_make_worker()->run(*job_source);
+            }
+            catch (std::exception &e) {
+                MD_LOG_ERROR(e.what());
+                std::lock_guard<std::mutex> lock(campaign->m_mutex);
+                campaign->m_error = e.what();
+            }
+        }
+
+        void CampaignManager::expire_finished()
+        {
+            auto now = std::chrono::steady_clock::now();
+            for (auto it = m_campaigns.begin(); it != m_campaigns.end();) {
+                auto &campaign = *it->second;
+                auto elapsed_ms = campaign.m_elapsed_ms.load();
+                auto finished = campaign.m_started + std::chrono::milliseconds(elapsed_ms);
+                if (elapsed_ms < 0 || now - finished < FINISHED_TTL) {
+                    ++it;
+                    continue;
+                }
+                // the thread set the elapsed time on its way out
+                if (campaign.m_thread.joinable()) {
+                    campaign.m_thread.join();
+                }
+                it = m_campaigns.erase(it);
+            }
+        }
+
+        void CampaignManager::cancel_campaign(Campaign &campaign)
+        {
+            std::lock_guard<std::mutex> lock(campaign.m_mutex);
+            campaign.m_is_cancelled = true;
+            campaign.m_condition.notify_all();
+        }
+
+        CampaignStatus CampaignManager::status_of(const Campaign &campaign)
+        {
+            CampaignStatus status;
+            status.m_id = campaign.m_id;
+            status.m_state = static_cast<CAMPAIGN_STATE>(campaign.m_state.load());
+            status.m_scanned = campaign.m_scanned;
+            status.m_fetched = campaign.m_fetched;
+            status.m_sent = campaign.m_outcomes[static_cast<int>(db::DELIVERY_STATUS::SENT)];
+            status.m_failed = campaign.m_outcomes[static_cast<int>(db::DELIVERY_STATUS::FAILED)];
+            status.m_deferred = campaign.m_outcomes[static_cast<int>(db::DELIVERY_STATUS::DEFERRED)];
+            auto elapsed_ms = campaign.m_elapsed_ms.load();
+            if (elapsed_ms < 0) {
+                elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        std::chrono::steady_clock::now() - campaign.m_started).count();
+            }
+            status.m_elapsed_ms = elapsed_ms;
+            std::lock_guard<std::mutex> lock(campaign.m_mutex);
+            status.m_request = campaign.m_request;
+            status.m_error = campaign.m_error;
+            return status;
+        }
+
+    }// namespace delivery
+}// namespace md
@@ -0,0 +1,115 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "delivery_worker.hpp"
+#include "job_source.hpp"
+
+namespace md
+{
+    using namespace service;
+    namespace delivery
+    {
+        enum class CAMPAIGN_STATE : int
+        {
+            RUNNING = 0,
+            DONE = 1,
+            CANCELLED = 2,
+            FAILED = 3// a worker stopped on an exception
+        };
+
+        const char *campaign_state_name(CAMPAIGN_STATE state);
+
+        // the core.emails rows a campaign sends
+        struct CampaignRequest
+        {
+            DataRange m_range = DataRange(1, 0);// ids, both included; a last id below the first - up to max(id)
+            std::string m_login;// only the rows of this sender login, empty - all of them
+        };
+
+        struct CampaignStatus
+        {
+            int m_id = 0;
+            CampaignRequest m_request;// the range resolved once the campaign started
+            CAMPAIGN_STATE m_state = CAMPAIGN_STATE::RUNNING;
+            uint64_t m_scanned = 0;// ids of the range read so far, with or without a row
+            uint64_t m_fetched = 0;// rows handed to the workers
+            uint64_t m_sent = 0;
+            uint64_t m_failed = 0;
+            uint64_t m_deferred = 0;// out of retries, or deferred without them
+            int64_t m_elapsed_ms = 0;// since the start, up to the end once it is over
+            std::string m_error;
+        };
+
+        /**
+         * Sends the campaigns started over REST from inside the serving process. Every campaign has a thread
+         * which resolves its range and splits it over worker_count threads, each a DeliveryWorker over the
+         * job chain schedule builds. start, status and cancel only touch the campaign table, so a REST
+         * handler never waits on delivery. A cancelled campaign ends its sources, retries included;
+         * the workers still send the batches they hold. A finished campaign is reported for a day.
+         */
+        class CampaignManager
+        {
+        public:
+            // the chain of a worker over its slice, wait_until is the one to give a RetryJobSource
+            using Schedule = std::function<JobSourcePtr(JobSourcePtr, RetryJobSource::WaitUntil)>;
+
+            using WorkerFactory = std::function<std::unique_ptr<DeliveryWorker>()>;
+
+            CampaignManager(DbQueryExecutorPtr query_executor, int batch_size, int worker_count, Schedule schedule
+                            , WorkerFactory make_worker);
+
+            // cancels what is still running and waits for it
+            ~CampaignManager();
+
+            CampaignManager(const CampaignManager &) = delete;
+
+            CampaignManager &operator=(const CampaignManager &) = delete;
+
+            // id of the new campaign, it is sent in the background; 0 - its rows overlap a running campaign's
+            int start(const CampaignRequest &request);
+
+            // false - no such campaign
+            bool status(int campaign_id, CampaignStatus &status) const;
+
+            // false - no such campaign, a finished one is left as it is
+            bool cancel(int campaign_id);
+
+            std::vector<CampaignStatus> list() const;
+
+        private:
+            struct Campaign;
+            class CampaignJobSource;
+
+            using CampaignPtr = std::shared_ptr<Campaign>;
+
+            void run(const CampaignPtr &campaign);
+
+            void run_worker(const CampaignPtr &campaign, const DataRange &range);
+
+            // forgets the campaigns finished longer than FINISHED_TTL ago, under m_mutex
+            void expire_finished();
+
+            static void cancel_campaign(Campaign &campaign);
+
+            static CampaignStatus status_of(const Campaign &campaign);
+
+            DbQueryExecutorPtr m_query_executor;
+            int m_batch_size;
+            int m_worker_count;
+            Schedule m_schedule;
+            WorkerFactory m_make_worker;
+
+            mutable std::mutex m_mutex;
+            std::map<int, CampaignPtr> m_campaigns;
+            int m_last_id = 0;
+        };
+
+        using CampaignManagerPtr = std::shared_ptr<CampaignManager>;
+
+    }// namespace delivery
+}// namespace md
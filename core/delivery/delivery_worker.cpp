@@ -0,0 +1,241 @@
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <unordered_map>
+#include <boost/format.hpp>
+#include "delivery_worker.hpp"
+#include "../../tools/probes/probes.hpp"
+
+namespace md
+{
+    using namespace service;
+    using namespace smtp;
+    namespace delivery
+    {
+        namespace
+        {
+            const size_t RECIPIENT_FIELD = 7;// core.emails column with the recipient address
+
+            std::string recipient_domain(const StringList &job)
+            {
+                const auto &recipient = job[RECIPIENT_FIELD];
+                auto pos = recipient.find_last_of('@');
+                std::string domain = pos == std::string::npos ? std::string() : recipient.substr(pos + 1);
+                std::transform(domain.begin(), domain.end(), domain.begin(), ::tolower);
+                return domain;
+            }
+
+            // hash of everything that ends up in the DATA of the message, plus the recipient domain
+            size_t content_hash(const StringList &job)
+            {
+                std::hash<std::string> hasher;
+                size_t hash = hasher(recipient_domain(job));
+                for (size_t idx = 1; idx < job.size(); ++idx) {
+                    if (idx != RECIPIENT_FIELD) {
+                        hash ^= hasher(job[idx]) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+                    }
+                }
+                return hash;
+            }
+
+            bool is_same_content(const StringList &lhs, const StringList &rhs)
+            {
+                if (lhs.size() != rhs.size()) {
+                    return false;
+                }
+                for (size_t idx = 1; idx < lhs.size(); ++idx) {
+                    if (idx != RECIPIENT_FIELD && lhs[idx] != rhs[idx]) {
+                        return false;
+                    }
+                }
+                return recipient_domain(lhs) == recipient_domain(rhs);
+            }
+        }
+
+        db::DELIVERY_STATUS delivery_status(bool is_sent, int transaction_reply_code, int recipient_reply_code)
+        {
+            bool is_rejected = recipient_reply_code != 0 && recipient_reply_code / 100 != 2;
+            if (is_sent && !is_rejected) {
+                return db::DELIVERY_STATUS::SENT;
+            }
+            auto reply_code = is_rejected ? recipient_reply_code : transaction_reply_code;
+            // only a 5xx is final; a 4xx, no reply at all or a network error after a positive reply is transient
+            return reply_code / 100 == 5 ? db::DELIVERY_STATUS::FAILED : db::DELIVERY_STATUS::DEFERRED;
+        }
+
+        DeliveryWorker::DeliveryWorker(std::string smtp_host, unsigned smtp_port
+                                       , db::DeliveryLogWriterPtr delivery_log, int session_max_messages
+                                       , int max_recipients)
+                : m_smtp_host(std::move(smtp_host))
+                  , m_smtp_port(smtp_port)
+                  , m_delivery_log(std::move(delivery_log))
+                  , m_session_max_messages(session_max_messages)
+                  , m_max_recipients(max_recipients > 1 ? max_recipients : 1)
+        {
+        }
+
+        DeliveryWorker::~DeliveryWorker()
+        {
+            close_session();
+        }
+
+        void DeliveryWorker::run(JobSource &job_source)
+        {
+            StringListArray mail_data;
+            while (job_source.next_batch(mail_data)) {
+                MD_LOG_DEBUG((boost::format("%d jobs fetched") % mail_data.size()).str());
+                for (const auto &jobs : merge_identical(mail_data)) {
+                    // the SMTP phases recorded by the session are its children
+                    tracer::Span span("message", true);
+                    span.set_arg("id", (*jobs.front())[0]);
+                    span.set_arg("recipients", std::to_string(jobs.size()));
+                    auto statuses = send(jobs);
+                    // the outcomes go to the job source, the delivery log COPY is traced by its writer
+                    tracer::Span complete("complete_jobs");
+                    for (size_t idx = 0; idx < jobs.size(); ++idx) {
+                        job_source.complete(std::stoi((*jobs[idx])[0]), statuses[idx]);
+                    }
+                }
+            }
+            // the last outcomes may wait for a fetch that never comes
+            job_source.flush();
+            close_session();
+
+            // where the time of this process went, per protocol phase
+            for (int phase = 0; phase < static_cast<int>(SMTP_PHASE::COUNT); ++phase) {
+                auto latency = SmtpStatistic::instance().latency(static_cast<SMTP_PHASE>(phase));
+                if (auto count = latency.count()) {
+                    MD_LOG_INFO((boost::format("%-14s n=%d avg=%dus p50=%dus p99=%dus")
+                                 % SmtpStatistic::name(static_cast<SMTP_PHASE>(phase)) % count
+                                 % (latency.m_sum_us / count) % latency.percentile(0.5)
+                                 % latency.percentile(0.99)).str());
+                }
+            }
+        }
+
+        std::vector<std::vector<const StringList *>> DeliveryWorker::merge_identical(
+                const StringListArray &batch) const
+        {
+            std::vector<std::vector<const StringList *>> transactions;
+            transactions.reserve(batch.size());
+            // content hash -> transactions which still take recipients
+            std::unordered_map<size_t, std::vector<size_t>> open_transactions;
+            for (const auto &job : batch) {
+                if (m_max_recipients <= 1 || job.size() <= RECIPIENT_FIELD) {
+                    transactions.emplace_back(1, &job);
+                    continue;
+                }
+                auto &candidates = open_transactions[content_hash(job)];
+                auto it = std::find_if(candidates.begin(), candidates.end(), [&](size_t idx) {
+                    return is_same_content(*transactions[idx].front(), job);
+                });
+                if (it == candidates.end()) {
+                    candidates.push_back(transactions.size());
+                    transactions.emplace_back(1, &job);
+                    continue;
+                }
+                auto &transaction = transactions[*it];
+                transaction.push_back(&job);
+                if (transaction.size() >= m_max_recipients) {
+                    candidates.erase(it);
+                }
+            }
+            return transactions;
+        }
+
+        db::DELIVERY_STATUS DeliveryWorker::send(const StringList &mail_data)
+        {
+            return send(std::vector<const StringList *>(1, &mail_data)).front();
+        }
+
+        std::vector<db::DELIVERY_STATUS> DeliveryWorker::send(const std::vector<const StringList *> &jobs)
+        {
+            auto start = std::chrono::steady_clock::now();
+            const auto &first_job = *jobs.front();
+            MD_PROBE2(message_start, std::stoi(first_job[0]), static_cast<int>(jobs.size()));
+            auto &smtp_server = session(first_job[1]);
+            bool is_sent = false;
+            bool is_broken = false;
+            try {
+                smtp_server.clear_message();
+                smtp_server.set_bulk_mode(jobs.size() > 1);
+                smtp_server.init(first_job, m_smtp_host, m_smtp_port);
+                for (size_t idx = 1; idx < jobs.size(); ++idx) {
+                    smtp_server.add_recipient((*jobs[idx])[RECIPIENT_FIELD].c_str());
+                }
+                if (smtp_server.send_mail()) {
+                    is_sent = true;
+                    ++m_session_messages;
+                }
+            }
+            catch (SmtpException &e) {
+                MD_LOG_ERROR(e.get_error_message());
+                is_broken = true;
+            }
+            catch (...) {
+                MD_LOG_ERROR("unknown error");
+                is_broken = true;
+            }
+
+            MD_PROBE2(message_end, std::stoi(first_job[0]), is_sent ? 1 : 0);
+
+            std::vector<db::DELIVERY_STATUS> statuses;
+            statuses.reserve(jobs.size());
+            auto transaction_reply_code = smtp_server.last_reply_code();
+            const auto &recipient_reply_codes = smtp_server.recipient_reply_codes();
+            db::DeliveryRecord record;
+            record.m_latency_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - start).count();
+            record.m_timestamp = std::chrono::system_clock::now();
+            for (size_t idx = 0; idx < jobs.size(); ++idx) {
+                record.m_id = std::stoi((*jobs[idx])[0]);
+                auto recipient_reply_code = idx < recipient_reply_codes.size() ? recipient_reply_codes[idx] : 0;
+                bool is_rejected = recipient_reply_code != 0 && recipient_reply_code / 100 != 2;
+                record.m_reply_code = is_rejected ? recipient_reply_code : transaction_reply_code;
+                record.m_status = delivery_status(is_sent, transaction_reply_code, recipient_reply_code);
+                statuses.push_back(record.m_status);
+                count(record.m_status == db::DELIVERY_STATUS::SENT ? SMTP_COUNTER::SENT
+                                                                   : record.m_status == db::DELIVERY_STATUS::DEFERRED
+                                                                     ? SMTP_COUNTER::DEFERRED : SMTP_COUNTER::FAILED);
+                if (m_delivery_log) {
+                    m_delivery_log->push(record);
+                }
+            }
+
+            // a failed transaction already dropped the connection, start over with a fresh session
+            if (is_broken || (m_session_max_messages > 0 && m_session_messages >= m_session_max_messages)) {
+                close_session();
+            }
+            return statuses;
+        }
+
+        SmtpServer &DeliveryWorker::session(const std::string &login)
+        {
+            if (m_session && login != m_session_login) {
+                close_session();
+            }
+            if (!m_session) {
+                m_session.reset(new SmtpServer());
+                m_session->set_security_type(USE_TLS);
+                m_session_login = login;
+            }
+            return *m_session;
+        }
+
+        void DeliveryWorker::close_session()
+        {
+            if (!m_session) {
+                return;
+            }
+            try {
+                m_session->disconnect_remote_server();
+            }
+            catch (SmtpException &e) {
+                MD_LOG_ERROR(e.get_error_message());
+            }
+            m_session.reset();
+            m_session_messages = 0;
+        }
+
+    }// namespace delivery
+}// namespace md
@@ -0,0 +1,68 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <vector>
+#include "job_source.hpp"
+#include "../smtp/smtp_server.hpp"
+
+namespace md
+{
+    using namespace service;
+    namespace delivery
+    {
+        /**
+         * outcome of one recipient of a transaction: sent, failed on a 5xx, otherwise deferred - a 4xx,
+         * a timeout or a broken connection; recipient_reply_code is the reply to its RCPT TO, 0 when there was none
+         */
+        db::DELIVERY_STATUS delivery_status(bool is_sent, int transaction_reply_code, int recipient_reply_code);
+
+        /**
+         * Sends the jobs of a source and reports every outcome to the source and the delivery log.
+         * The authenticated SMTP session stays open while consecutive jobs belong to the same login,
+         * so a run of messages of one account pays for connect, STARTTLS and AUTH once.
+         * The session is reopened when the login changes, after an error
+         * and after session_max_messages messages (0 - no limit).
+         * Jobs of a batch with byte-identical content (everything except the recipient) to one domain
+         * share a transaction of up to max_recipients RCPT TO, the outcome is still kept per job.
+         */
+        class DeliveryWorker
+        {
+        public:
+            DeliveryWorker(std::string smtp_host, unsigned smtp_port, db::DeliveryLogWriterPtr delivery_log
+                           , int session_max_messages, int max_recipients);
+
+            ~DeliveryWorker();
+
+            DeliveryWorker(const DeliveryWorker &) = delete;
+
+            DeliveryWorker &operator=(const DeliveryWorker &) = delete;
+
+            void run(JobSource &job_source);
+
+            db::DELIVERY_STATUS send(const StringList &mail_data);
+
+            // one transaction for jobs of identical content, the status of every job in the same order
+            std::vector<db::DELIVERY_STATUS> send(const std::vector<const StringList *> &jobs);
+
+            // the transactions of a batch in send order, jobs of identical content to one domain share one
+            std::vector<std::vector<const StringList *>> merge_identical(const StringListArray &batch) const;
+
+        private:
+
+            smtp::SmtpServer &session(const std::string &login);
+
+            void close_session();
+
+            std::string m_smtp_host;
+            unsigned m_smtp_port;
+            db::DeliveryLogWriterPtr m_delivery_log;
+            int m_session_max_messages;
+            size_t m_max_recipients;
+
+            std::unique_ptr<smtp::SmtpServer> m_session;
+            std::string m_session_login;
+            int m_session_messages = 0;
+        };
+
+    }// namespace delivery
+}// namespace md
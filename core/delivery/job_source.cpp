@@ -0,0 +1,600 @@
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <unistd.h>
+#include <boost/format.hpp>
+#include "job_source.hpp"
+
+namespace md
+{
+    using namespace service;
+    namespace delivery
+    {
+        namespace
+        {
+            // a row in one allocation: uint32 length and bytes of every column
+            void pack_row(const StringList &row, std::string &packed)
+            {
+                size_t size = 0;
+                for (const auto &column : row) {
+                    size += sizeof(uint32_t) + column.size();
+                }
+                packed.clear();
+                packed.reserve(size);
+                for (const auto &column : row) {
+                    auto length = static_cast<uint32_t>(column.size());
+                    packed.append(reinterpret_cast<const char *>(&length), sizeof(length));
+                    packed += column;
+                }
+            }
+
+            StringList unpack_row(const std::string &packed)
+            {
+                StringList row;
+                size_t offset = 0;
+                while (offset + sizeof(uint32_t) <= packed.size()) {
+                    uint32_t length;
+                    memcpy(&length, packed.data() + offset, sizeof(length));
+                    offset += sizeof(length);
+                    row.emplace_back(packed, offset, length);
+                    offset += length;
+                }
+                return row;
+            }
+        }
+
+        RangeJobSource::RangeJobSource(DbQueryExecutorPtr query_executor, const DataRange &data_range
+                                       , int batch_size, std::string login)
+                : m_query_executor(std::move(query_executor))
+                  , m_data_range(data_range)
+                  , m_batch_size(batch_size > 0 ? batch_size : 1)
+                  , m_login(std::move(login))
+                  , m_next_id(data_range.first)
+        {
+        }
+
+        bool RangeJobSource::next_batch(StringListArray &batch)
+        {
+            while (m_next_id <= m_data_range.second) {
+                auto last_id = std::min(m_next_id + m_batch_size - 1, m_data_range.second);
+                batch = m_login.empty() ? m_query_executor->get_data4send_mail(std::make_pair(m_next_id, last_id))
+                                        : m_query_executor->get_data4send_mail(std::make_pair(m_next_id, last_id)
+                                                                               , m_login);
+                m_next_id = last_id + 1;
+                if (!batch.empty()) {// ids may have gaps, skip empty slices
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        NotifyJobSource::NotifyJobSource(DbQueryExecutorPtr query_executor, const std::string &channel
+                                         , int first_id, int batch_size, int poll_interval_ms)
+                : m_query_executor(std::move(query_executor))
+                  , m_first_id(first_id > 0 ? first_id : 1)
+                  , m_batch_size(batch_size > 0 ? batch_size : 1)
+                  , m_poll_interval_ms(poll_interval_ms > 0 ? poll_interval_ms : 1000)
+                  , m_is_stopped(false)
+        {
+            // the trigger may already be installed by someone with more privileges, so LISTEN anyway
+            m_query_executor->install_notify_trigger(channel);
+            if (!m_query_executor->listen(channel)) {
+                MD_LOG_WARNING("LISTEN is not available, polling core.emails instead");
+            }
+        }
+
+        bool NotifyJobSource::next_batch(StringListArray &batch)
+        {
+            while (!m_is_stopped) {
+                // completed rows drop out of the reads once stored, until then they are left out by id
+                flush();
+                batch = m_query_executor->get_unsent_data4send_mail(
+                        m_first_id, std::vector<int>(m_handed_out.begin(), m_handed_out.end()), m_batch_size);
+                if (!batch.empty()) {
+                    for (const auto &row : batch) {
+                        m_handed_out.insert(std::stoi(row[0]));
+                    }
+                    return true;
+                }
+                // woken by the insert trigger, or by the poll timeout when LISTEN is unavailable
+                m_query_executor->wait_notification(m_poll_interval_ms);
+            }
+            return false;
+        }
+
+        void NotifyJobSource::complete(int job_id, db::DELIVERY_STATUS status)
+        {
+            // as in the range run, a deferred job that gets no further attempt counts as done
+            m_completed_ids.push_back(job_id);
+        }
+
+        void NotifyJobSource::flush()
+        {
+            // kept for the next fetch or flush when the update failed
+            if (m_query_executor->complete_jobs(m_completed_ids)) {
+                for (auto id : m_completed_ids) {
+                    m_handed_out.erase(id);
+                }
+                m_completed_ids.clear();
+            }
+        }
+
+        ClaimJobSource::ClaimJobSource(DbQueryExecutorPtr query_executor, std::string worker_id, int batch_size
+                                       , int lease_seconds)
+                : m_query_executor(std::move(query_executor))
+                  , m_worker_id(std::move(worker_id))
+                  , m_batch_size(batch_size > 0 ? batch_size : 1)
+                  , m_lease_seconds(lease_seconds > 0 ? lease_seconds : 600)
+        {
+        }
+
+        bool ClaimJobSource::next_batch(StringListArray &batch)
+        {
+            // completion of the previous batch travels in the same round trip as the next claim
+            batch = m_query_executor->claim_data4send_mail(m_worker_id, m_batch_size, m_lease_seconds
+                                                           , m_completed_ids);
+            m_completed_ids.clear();
+            return !batch.empty();
+        }
+
+        ClaimJobSource::~ClaimJobSource()
+        {
+            try {
+                flush();
+            }
+            catch (std::exception &e) {
+                MD_LOG_ERROR(e.what());
+            }
+        }
+
+        void ClaimJobSource::complete(int job_id, db::DELIVERY_STATUS status)
+        {
+            if (status != db::DELIVERY_STATUS::DEFERRED) {
+                m_completed_ids.push_back(job_id);
+            }
+        }
+
+        void ClaimJobSource::flush()
+        {
+            // kept for the next claim or flush when the update failed
+            if (m_query_executor->complete_claims(m_worker_id, m_completed_ids)) {
+                m_completed_ids.clear();
+            }
+        }
+
+        PrefetchJobSource::PrefetchJobSource(JobSourcePtr source, int depth)
+                : m_source(std::move(source))
+                  , m_queue(depth > 0 ? depth : 1)
+                  , m_is_stopped(false)
+        {
+            m_thread = std::thread(&PrefetchJobSource::run, this);
+        }
+
+        PrefetchJobSource::~PrefetchJobSource()
+        {
+            m_is_stopped = true;
+            m_queue.close();
+            m_condition.notify_all();
+            if (m_thread.joinable()) {
+                m_thread.join();
+            }
+            std::lock_guard<std::mutex> source_lock(m_source_mutex);
+            forward_completed();
+        }
+
+        bool PrefetchJobSource::next_batch(StringListArray &batch)
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_is_consumer_waiting = true;
+            }
+            m_condition.notify_all();
+            auto is_popped = m_queue.pop(batch);
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_is_consumer_waiting = false;
+            }
+            return is_popped;
+        }
+
+        void PrefetchJobSource::complete(int job_id, db::DELIVERY_STATUS status)
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_completed.emplace_back(job_id, status);
+            }
+            pass_completed();
+        }
+
+        void PrefetchJobSource::flush()
+        {
+            std::lock_guard<std::mutex> source_lock(m_source_mutex);
+            forward_completed();
+            m_source->flush();
+        }
+
+        void PrefetchJobSource::forward_completed()
+        {
+            std::vector<std::pair<int, db::DELIVERY_STATUS>> completed;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                completed.swap(m_completed);
+            }
+            for (const auto &item : completed) {
+                m_source->complete(item.first, item.second);
+            }
+        }
+
+        void PrefetchJobSource::pass_completed()
+        {
+            while (true) {
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    if (m_completed.empty()) {
+                        return;
+                    }
+                }
+                // the holder checks again once it is out, a completion is never left behind
+                std::unique_lock<std::mutex> source_lock(m_source_mutex, std::try_to_lock);
+                if (!source_lock.owns_lock()) {
+                    return;
+                }
+                forward_completed();
+            }
+        }
+
+        void PrefetchJobSource::run()
+        {
+            try {
+                bool is_drained = false;
+                while (!m_is_stopped) {
+                    StringListArray batch;
+                    bool is_fetched;
+                    {
+                        std::lock_guard<std::mutex> source_lock(m_source_mutex);
+                        forward_completed();
+                        is_fetched = m_source->next_batch(batch);
+                    }
+                    pass_completed();
+                    if (is_fetched) {
+                        is_drained = false;
+                        if (!m_queue.push(std::move(batch))) {
+                            break;
+                        }
+                        continue;
+                    }
+                    if (is_drained) {
+                        break;
+                    }
+                    // the source is exhausted: once the sender finished every batch, ask once more,
+                    // so the last completions reach the source and late rows are not missed
+                    std::unique_lock<std::mutex> lock(m_mutex);
+                    m_condition.wait(lock, [this]() {
+                        return m_is_stopped || (m_is_consumer_waiting && m_queue.size() == 0);
+                    });
+                    is_drained = true;
+                }
+            }
+            catch (std::exception &e) {
+                MD_LOG_ERROR(e.what());
+            }
+            m_queue.close();
+        }
+
+        SnapshotJobSource::SnapshotJobSource(const std::string &path, int batch_size, int repeat)
+                : m_reader(path)
+                  , m_batch_size(batch_size > 0 ? batch_size : 1)
+                  , m_repeat(repeat)
+        {
+        }
+
+        bool SnapshotJobSource::next_batch(StringListArray &batch)
+        {
+            while (m_group_offset >= m_group.size()) {
+                m_group_offset = 0;
+                if (m_reader.next_group(m_group)) {
+                    continue;
+                }
+                m_group.clear();
+                if ((m_repeat > 0 && m_round >= m_repeat) || m_reader.row_count() == 0) {
+                    return false;
+                }
+                ++m_round;
+                m_reader.rewind();
+            }
+            auto last = std::min(m_group_offset + m_batch_size, m_group.size());
+            batch.assign(std::make_move_iterator(m_group.begin() + m_group_offset)
+                         , std::make_move_iterator(m_group.begin() + last));
+            m_group_offset = last;
+            m_rows_replayed += batch.size();
+            return true;
+        }
+
+        uint64_t export_snapshot(const DbQueryExecutorPtr &query_executor, const std::string &path, int batch_size)
+        {
+            SnapshotWriter writer(path);
+            int last_id = 0;
+            StringListArray batch;
+            // keyset pagination, every slice is an index range scan no matter how far the export got
+            while (!(batch = query_executor->get_data4send_mail_after(last_id, batch_size > 0 ? batch_size : 500))
+                    .empty()) {
+                writer.append(batch);
+                last_id = std::stoi(batch.back()[0]);
+            }
+            writer.close();
+            return writer.row_count();
+        }
+
+        CheckpointJobSource::CheckpointJobSource(JobSourcePtr source, DbQueryExecutorPtr query_executor
+                                                 , std::string table_name, std::string worker_key
+                                                 , int high_water_mark, const std::vector<int> &completed_ids
+                                                 , int flush_interval_ms)
+                : m_source(std::move(source))
+                  , m_query_executor(std::move(query_executor))
+                  , m_table_name(std::move(table_name))
+                  , m_worker_key(std::move(worker_key))
+                  , m_flush_interval(flush_interval_ms > 0 ? flush_interval_ms : 5000)
+                  , m_last_flush(std::chrono::steady_clock::now())
+                  , m_high_water_mark(high_water_mark)
+                  , m_last_handed_id(high_water_mark)
+                  , m_completed(completed_ids.begin(), completed_ids.end())
+        {
+        }
+
+        CheckpointJobSource::~CheckpointJobSource()
+        {
+            try {
+                flush(true);
+            }
+            catch (std::exception &e) {
+                MD_LOG_ERROR(e.what());
+            }
+        }
+
+        bool CheckpointJobSource::next_batch(StringListArray &batch)
+        {
+            flush(false);
+            do {
+                if (!m_source->next_batch(batch)) {
+                    return false;
+                }
+                batch.erase(std::remove_if(batch.begin(), batch.end(), [this](const StringList &job) {
+                    auto job_id = std::stoi(job[0]);
+                    m_last_handed_id = std::max(m_last_handed_id, job_id);
+                    if (job_id <= m_high_water_mark || m_completed.count(job_id)) {
+                        return true;// done by an earlier run
+                    }
+                    m_outstanding.insert(job_id);
+                    return false;
+                }), batch.end());
+            } while (batch.empty());
+            return true;
+        }
+
+        void CheckpointJobSource::complete(int job_id, db::DELIVERY_STATUS status)
+        {
+            if (m_outstanding.erase(job_id)) {
+                m_completed.insert(job_id);
+                m_is_dirty = true;
+            }
+            m_source->complete(job_id, status);
+        }
+
+        void CheckpointJobSource::flush()
+        {
+            flush(true);
+            m_source->flush();
+        }
+
+        void CheckpointJobSource::flush(bool is_forced)
+        {
+            auto now = std::chrono::steady_clock::now();
+            if (!m_is_dirty || (!is_forced && now - m_last_flush < m_flush_interval)) {
+                return;
+            }
+
+            // everything below the oldest outstanding job is done, ids that don't exist included
+            m_high_water_mark = m_outstanding.empty() ? m_last_handed_id : *m_outstanding.begin() - 1;
+            m_completed.erase(m_completed.begin(), m_completed.upper_bound(m_high_water_mark));
+
+            if (m_query_executor->save_checkpoint(m_table_name, m_worker_key, m_high_water_mark
+                                                  , std::vector<int>(m_completed.begin(), m_completed.end()))) {
+                m_is_dirty = false;
+            }
+            m_last_flush = now;
+        }
+
+        SpoolJobSource::SpoolJobSource(JobSourcePtr source, JobSpoolPtr spool, int batch_size)
+                : m_source(std::move(source))
+                  , m_spool(std::move(spool))
+                  , m_batch_size(batch_size > 0 ? batch_size : 1)
+                  , m_replay(m_spool->take_pending())
+        {
+            if (!m_replay.empty()) {
+                MD_LOG_INFO((boost::format("spool: resuming %d unfinished jobs") % m_replay.size()).str());
+            }
+        }
+
+        bool SpoolJobSource::next_batch(StringListArray &batch)
+        {
+            // completion marks of the previous batch are made durable before more work is taken
+            m_spool->sync();
+            if (m_replay_offset < m_replay.size()) {
+                auto last = std::min(m_replay_offset + m_batch_size, m_replay.size());
+                batch.assign(std::make_move_iterator(m_replay.begin() + m_replay_offset)
+                             , std::make_move_iterator(m_replay.begin() + last));
+                m_replay_offset = last;
+                if (m_replay_offset == m_replay.size()) {
+                    StringListArray().swap(m_replay);
+                    m_replay_offset = 0;
+                }
+                return true;
+            }
+            do {
+                if (!m_source->next_batch(batch)) {
+                    return false;
+                }
+                // a claim that expired while we were down comes back, the replay already covers it
+                batch.erase(std::remove_if(batch.begin(), batch.end(), [this](const StringList &job) {
+                    return m_spool->is_pending(std::stoi(job[0]));
+                }), batch.end());
+            } while (batch.empty());
+            m_spool->append(batch);
+            m_spool->sync();
+            return true;
+        }
+
+        void SpoolJobSource::complete(int job_id, db::DELIVERY_STATUS status)
+        {
+            if (status != db::DELIVERY_STATUS::DEFERRED) {
+                m_spool->mark_done(job_id);
+            }
+            m_source->complete(job_id, status);
+        }
+
+        void SpoolJobSource::flush()
+        {
+            m_spool->sync();
+            m_source->flush();
+        }
+
+        unsigned AccountInterner::intern(const std::string &smtp_host, const std::string &login)
+        {
+            std::string key;
+            key.reserve(smtp_host.size() + login.size() + 1);
+            key.append(smtp_host).append(1, '\n').append(login);
+            return m_accounts.emplace(std::move(key), static_cast<unsigned>(m_accounts.size())).first->second;
+        }
+
+        GroupingJobSource::GroupingJobSource(JobSourcePtr source, std::string smtp_host)
+                : m_source(std::move(source))
+                  , m_smtp_host(std::move(smtp_host))
+                  , m_last_account(0)
+        {
+        }
+
+        bool GroupingJobSource::next_batch(StringListArray &batch)
+        {
+            if (!m_source->next_batch(batch)) {
+                return false;
+            }
+
+            // sort keys: 0 continues the account of the previous batch, the others follow by first appearance
+            std::vector<std::pair<unsigned, size_t>> order;
+            order.reserve(batch.size());
+            for (size_t idx = 0; idx < batch.size(); ++idx) {
+                auto account = m_interner.intern(m_smtp_host, batch[idx][1]);
+                order.emplace_back(m_has_last_account && account == m_last_account ? 0 : account + 1, idx);
+            }
+            std::stable_sort(order.begin(), order.end()
+                             , [](const std::pair<unsigned, size_t> &lhs, const std::pair<unsigned, size_t> &rhs) {
+                                 return lhs.first < rhs.first;
+                             });
+
+            StringListArray grouped;
+            grouped.reserve(batch.size());
+            for (const auto &item : order) {
+                grouped.push_back(std::move(batch[item.second]));
+            }
+            batch.swap(grouped);
+
+            if (!batch.empty()) {
+                m_last_account = m_interner.intern(m_smtp_host, batch.back()[1]);
+                m_has_last_account = true;
+            }
+            return true;
+        }
+
+        RetryJobSource::RetryJobSource(JobSourcePtr source, const RetryPolicy &policy, Clock clock
+                                       , WaitUntil wait_until, WindowStart window_start)
+                : m_source(std::move(source))
+                  , m_policy(policy)
+                  , m_clock(std::move(clock))
+                  , m_wait_until(std::move(wait_until))
+                  , m_window_start(std::move(window_start))
+        {
+        }
+
+        bool RetryJobSource::next_batch(StringListArray &batch)
+        {
+            while (true) {
+                batch.clear();
+                auto now = m_clock();
+                while (!m_retries.empty() && m_retries.top().m_due_ms <= now) {
+                    batch.push_back(unpack_row(m_jobs[m_retries.top().m_job_id].m_row));
+                    m_retries.pop();
+                }
+                if (!batch.empty()) {
+                    return true;
+                }
+
+                if (!m_is_exhausted) {
+                    if (m_source->next_batch(batch)) {
+                        for (const auto &row : batch) {
+                            auto &job = m_jobs[std::stoi(row[0])];
+                            pack_row(row, job.m_row);
+                            job.m_attempts = 0;
+                            job.m_window_start_ms = m_window_start ? m_window_start(row, now) : now;
+                        }
+                        return true;
+                    }
+                    m_is_exhausted = true;
+                }
+
+                if (m_retries.empty()) {
+                    return false;
+                }
+                // an exhausted source is not asked again, what it keeps for its next fetch goes now
+                m_source->flush();
+                if (!m_wait_until) {
+                    return true;
+                }
+                if (!m_wait_until(m_retries.top().m_due_ms)) {
+                    return false;
+                }
+            }
+        }
+
+        void RetryJobSource::complete(int job_id, db::DELIVERY_STATUS status)
+        {
+            auto it = m_jobs.find(job_id);
+            if (it != m_jobs.end()) {
+                if (status == db::DELIVERY_STATUS::DEFERRED) {
+                    auto delay = m_policy.delay(++it->second.m_attempts);
+                    auto due_ms = m_clock() + delay * 1000;
+                    if (delay >= 0 && m_policy.m_max_window > 0
+                        && due_ms - it->second.m_window_start_ms > m_policy.m_max_window * 1000LL) {
+                        // past the window the wrapped source takes the job back deferred
+                        m_jobs.erase(it);
+                        m_source->complete(job_id, status);
+                        return;
+                    }
+                    if (delay >= 0) {
+                        m_retries.push(Retry{due_ms, job_id});
+                        return;
+                    }
+                    status = db::DELIVERY_STATUS::FAILED;
+                }
+                m_jobs.erase(it);
+            }
+            m_source->complete(job_id, status);
+        }
+
+        bool RetryJobSource::sleep_until(int64_t time_ms)
+        {
+            auto delay_ms = time_ms - steady_clock_ms();
+            if (delay_ms > 0) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
+            }
+            return true;
+        }
+
+        std::string make_worker_id()
+        {
+            char hostname[255] = {0};
+            gethostname(hostname, sizeof(hostname) - 1);
+            return std::string(hostname) + ":" + std::to_string(getpid());
+        }
+
+    }// namespace delivery
+}// namespace md
@@ -0,0 +1,434 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <set>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "../database/db_query_executor.hpp"
+#include "../database/delivery_log_writer.hpp"
+#include "job_spool.hpp"
+#include "retry_policy.hpp"
+#include "snapshot.hpp"
+#include "../../tools/service/bounded_queue.hpp"
+
+namespace md
+{
+    using namespace service;
+    namespace delivery
+    {
+        using DbQueryExecutorPtr = std::shared_ptr<db::DbQueryExecutor>;
+
+        /**
+         * Where a worker takes its mail from. Every row is a core.emails row as returned by SELECT *
+         */
+        class JobSource
+        {
+        public:
+            virtual ~JobSource() = default;
+
+            // replaces batch with the next jobs; false when the source is exhausted
+            virtual bool next_batch(StringListArray &batch) = 0;
+
+            // outcome of a job handed out by next_batch, job_id is the core.emails id
+            virtual void complete(int job_id, db::DELIVERY_STATUS status)
+            {
+            }
+
+            // stores the outcomes a source keeps for its next fetch now, decorators pass it on
+            virtual void flush()
+            {
+            }
+
+            // batches fetched ahead of the sender, for monitoring
+            virtual size_t queue_depth() const
+            {
+                return 0;
+            }
+        };
+
+        using JobSourcePtr = std::shared_ptr<JobSource>;
+
+        /**
+         * one static id range of core.emails, read in slices of batch_size ids;
+         * with a login only the rows of that sender, filtered by the query
+         */
+        class RangeJobSource : public JobSource
+        {
+        public:
+            RangeJobSource(DbQueryExecutorPtr query_executor, const DataRange &data_range, int batch_size
+                           , std::string login = std::string());
+
+            bool next_batch(StringListArray &batch) override;
+
+            // the ids below it are read
+            int next_id() const
+            {
+                return m_next_id;
+            }
+
+        private:
+            DbQueryExecutorPtr m_query_executor;
+            DataRange m_data_range;
+            int m_batch_size;
+            std::string m_login;
+            int m_next_id;
+        };
+
+        /**
+         * continuous pickup of rows inserted into core.emails: reads the rows that are not completed from
+         * first_id on, then sleeps until the insert trigger notifies the channel or the poll interval elapsed.
+         * A row committed after higher ids were read is still picked up. Completions are stored in
+         * core.emails.completed_at with the next fetch or flush(), the jobs handed out and not stored yet
+         * are left out of the reads. The claim columns have to exist, see DbQueryExecutor::prepare_claim_columns.
+         */
+        class NotifyJobSource : public JobSource
+        {
+        public:
+            NotifyJobSource(DbQueryExecutorPtr query_executor, const std::string &channel, int first_id
+                            , int batch_size, int poll_interval_ms);
+
+            bool next_batch(StringListArray &batch) override;
+
+            void complete(int job_id, db::DELIVERY_STATUS status) override;
+
+            void flush() override;
+
+            void stop()
+            {
+                m_is_stopped = true;
+            }
+
+        private:
+            DbQueryExecutorPtr m_query_executor;
+            int m_first_id;
+            int m_batch_size;
+            int m_poll_interval_ms;
+            std::atomic<bool> m_is_stopped;
+            std::set<int> m_handed_out;// not stored as completed yet
+            std::vector<int> m_completed_ids;
+        };
+
+        /**
+         * pulls work from the shared core.emails table with FOR UPDATE SKIP LOCKED, so any number of
+         * nodes and workers balance themselves. A claim older than the lease goes back to the pool,
+         * which also retries deferred messages: they are not marked completed. Completions travel with the
+         * next claim, flush() and the destructor store them without one. The claim columns have to
+         * exist, see DbQueryExecutor::prepare_claim_columns.
+         */
+        class ClaimJobSource : public JobSource
+        {
+        public:
+            ClaimJobSource(DbQueryExecutorPtr query_executor, std::string worker_id, int batch_size
+                           , int lease_seconds);
+
+            // completions not sent yet are stored on the way out, or their rows would go out again after the lease
+            ~ClaimJobSource() override;
+
+            bool next_batch(StringListArray &batch) override;
+
+            void complete(int job_id, db::DELIVERY_STATUS status) override;
+
+            // marks the completed jobs without claiming more
+            void flush() override;
+
+            const std::string &worker_id() const
+            {
+                return m_worker_id;
+            }
+
+        private:
+            DbQueryExecutorPtr m_query_executor;
+            std::string m_worker_id;
+            int m_batch_size;
+            int m_lease_seconds;
+            std::vector<int> m_completed_ids;
+        };
+
+        /**
+         * Runs another source in a fetch thread that stays up to depth batches ahead of the sender,
+         * so the query for the next batch overlaps the SMTP traffic of the current one.
+         * Memory stays bounded by depth batches. One thread at a time is inside the wrapped source:
+         * a completion is passed on at once, a SpoolJobSource below marks it before the call returns,
+         * unless the fetch thread is inside, which passes it on once it is out, so the sender
+         * never waits for a fetch. Meant for one consumer thread.
+         */
+        class PrefetchJobSource : public JobSource
+        {
+        public:
+            PrefetchJobSource(JobSourcePtr source, int depth);
+
+            ~PrefetchJobSource() override;
+
+            bool next_batch(StringListArray &batch) override;
+
+            void complete(int job_id, db::DELIVERY_STATUS status) override;
+
+            void flush() override;
+
+            size_t queue_depth() const override
+            {
+                return m_queue.size();
+            }
+
+        private:
+            void run();
+
+            // under m_source_mutex
+            void forward_completed();
+
+            // forwards what completed while another thread was in the wrapped source
+            void pass_completed();
+
+            JobSourcePtr m_source;
+            std::mutex m_source_mutex;// held inside m_source
+            BoundedQueue<StringListArray> m_queue;
+
+            std::mutex m_mutex;
+            std::condition_variable m_condition;
+            std::vector<std::pair<int, db::DELIVERY_STATUS>> m_completed;
+            bool m_is_consumer_waiting = false;
+            std::atomic<bool> m_is_stopped;
+            std::thread m_thread;
+        };
+
+        /**
+         * replays the rows of a snapshot file in batches of batch_size, repeat times over (0 - endlessly);
+         * no database involved, for benchmarks and reproducible runs of the send pipeline
+         */
+        class SnapshotJobSource : public JobSource
+        {
+        public:
+            SnapshotJobSource(const std::string &path, int batch_size, int repeat = 1);
+
+            bool next_batch(StringListArray &batch) override;
+
+            uint64_t rows_replayed() const
+            {
+                return m_rows_replayed;
+            }
+
+        private:
+            SnapshotReader m_reader;
+            size_t m_batch_size;
+            int m_repeat;
+            int m_round = 1;
+            StringListArray m_group;
+            size_t m_group_offset = 0;
+            std::atomic<uint64_t> m_rows_replayed{0};
+        };
+
+        // streams core.emails in id order into a snapshot file, returns the number of rows written
+        uint64_t export_snapshot(const DbQueryExecutorPtr &query_executor, const std::string &path, int batch_size);
+
+        /**
+         * Keeps the progress of a worker in the checkpoint table: a high-water mark below which every
+         * handed out job is done, plus the ids completed above it out of order. Jobs done by an earlier
+         * run are dropped from the batches, the wrapped source should begin at high_water_mark + 1.
+         * The checkpoint is written at most every flush_interval_ms and when the source is destroyed.
+         * As in the plain range run, a deferred job counts as done.
+         */
+        class CheckpointJobSource : public JobSource
+        {
+        public:
+            CheckpointJobSource(JobSourcePtr source, DbQueryExecutorPtr query_executor, std::string table_name
+                                , std::string worker_key, int high_water_mark, const std::vector<int> &completed_ids
+                                , int flush_interval_ms);
+
+            ~CheckpointJobSource() override;
+
+            bool next_batch(StringListArray &batch) override;
+
+            void complete(int job_id, db::DELIVERY_STATUS status) override;
+
+            void flush() override;
+
+            int high_water_mark() const
+            {
+                return m_high_water_mark;
+            }
+
+        private:
+            void flush(bool is_forced);
+
+            JobSourcePtr m_source;
+            DbQueryExecutorPtr m_query_executor;
+            std::string m_table_name;
+            std::string m_worker_key;
+            std::chrono::milliseconds m_flush_interval;
+            std::chrono::steady_clock::time_point m_last_flush;
+
+            int m_high_water_mark;
+            int m_last_handed_id;
+            std::set<int> m_outstanding;// handed out, not completed yet
+            std::set<int> m_completed;// completed above the high-water mark
+            bool m_is_dirty = false;
+        };
+
+        /**
+         * Writes every batch of another source to a local JobSpool before handing it out and marks
+         * sent or failed jobs there. On start the unfinished jobs of the previous run go first,
+         * the wrapped source should begin above spool->last_job_id() so nothing is fetched twice.
+         * Deferred jobs stay pending and are replayed by the next run.
+         */
+        class SpoolJobSource : public JobSource
+        {
+        public:
+            SpoolJobSource(JobSourcePtr source, JobSpoolPtr spool, int batch_size);
+
+            bool next_batch(StringListArray &batch) override;
+
+            void complete(int job_id, db::DELIVERY_STATUS status) override;
+
+            void flush() override;
+
+        private:
+            JobSourcePtr m_source;
+            JobSpoolPtr m_spool;
+            size_t m_batch_size;
+            StringListArray m_replay;
+            size_t m_replay_offset = 0;
+        };
+
+        /**
+         * compact ids for (smtp host, login) pairs, every distinct pair is stored once. The grouping only
+         * needs the id; the rows keep their own credential strings, a StringList owns its fields and
+         * the spool, the retries and SmtpServer::init all read them from the row
+         */
+        class AccountInterner
+        {
+        public:
+            unsigned intern(const std::string &smtp_host, const std::string &login);
+
+            size_t size() const
+            {
+                return m_accounts.size();
+            }
+
+        private:
+            std::unordered_map<std::string, unsigned> m_accounts;
+        };
+
+        /**
+         * Reorders every batch of another source so that jobs of one sender account are adjacent,
+         * the relative order inside an account is kept. The account of the previous batch's last job
+         * goes first, so a worker can keep its authenticated session across batches.
+         * The batch is the grouping window, batch_size trades memory for longer runs.
+         */
+        class GroupingJobSource : public JobSource
+        {
+        public:
+            GroupingJobSource(JobSourcePtr source, std::string smtp_host);
+
+            bool next_batch(StringListArray &batch) override;
+
+            void complete(int job_id, db::DELIVERY_STATUS status) override
+            {
+                m_source->complete(job_id, status);
+            }
+
+            void flush() override
+            {
+                m_source->flush();
+            }
+
+        private:
+            JobSourcePtr m_source;
+            std::string m_smtp_host;
+            AccountInterner m_interner;
+            unsigned m_last_account;
+            bool m_has_last_account = false;
+        };
+
+        /**
+         * Gives the deferred jobs of another source further attempts, spaced by the retry policy.
+         * Due retries go first, a job out of attempts is completed as failed, other outcomes pass through.
+         * Once the wrapped source is exhausted next_batch waits for the next retry with wait_until, and ends
+         * the source if the wait was given up; without wait_until it hands out an empty batch instead
+         * and next_retry_ms() tells when to come back.
+         * Deferred jobs are kept in memory; a retry beyond the policy's max_window is completed as deferred
+         * instead, which a ClaimJobSource leaves to its lease, so the window has to stay below the lease.
+         * The window starts at window_start of the row, by default when the wrapped source handed it out.
+         * Before a wait the wrapped source is flushed, its outcomes must not wait for the retries.
+         */
+        class RetryJobSource : public JobSource
+        {
+        public:
+            // returns at the given time of the clock, false - the wait was given up
+            using WaitUntil = std::function<bool(int64_t)>;
+
+            // clock time the retry window of a row starts at, given the current clock time
+            using WindowStart = std::function<int64_t(const StringList &, int64_t)>;
+
+            RetryJobSource(JobSourcePtr source, const RetryPolicy &policy, Clock clock = steady_clock_ms
+                           , WaitUntil wait_until = sleep_until, WindowStart window_start = nullptr);
+
+            bool next_batch(StringListArray &batch) override;
+
+            void complete(int job_id, db::DELIVERY_STATUS status) override;
+
+            void flush() override
+            {
+                m_source->flush();
+            }
+
+            size_t queue_depth() const override
+            {
+                return m_source->queue_depth();
+            }
+
+            // deferred jobs waiting for their next attempt
+            size_t retry_count() const
+            {
+                return m_retries.size();
+            }
+
+            // clock time of the earliest retry, -1 - none
+            int64_t next_retry_ms() const
+            {
+                return m_retries.empty() ? -1 : m_retries.top().m_due_ms;
+            }
+
+            // WaitUntil of the steady clock
+            static bool sleep_until(int64_t time_ms);
+
+        private:
+            struct Job
+            {
+                std::string m_row;// packed, most jobs are never retried
+                int m_attempts = 0;
+                int64_t m_window_start_ms = 0;// clock time the retry window starts at
+            };
+
+            struct Retry
+            {
+                int64_t m_due_ms;
+                int m_job_id;
+
+                bool operator>(const Retry &other) const
+                {
+                    return m_due_ms > other.m_due_ms;
+                }
+            };
+
+            JobSourcePtr m_source;
+            RetryPolicy m_policy;
+            Clock m_clock;
+            WaitUntil m_wait_until;
+            WindowStart m_window_start;
+            bool m_is_exhausted = false;
+            std::unordered_map<int, Job> m_jobs;// handed out or waiting for a retry
+            std::priority_queue<Retry, std::vector<Retry>, std::greater<Retry>> m_retries;
+        };
+
+        // hostname:pid, unique for every worker process of the fleet
+        std::string make_worker_id();
+
+    }// namespace delivery
+}// namespace md
@@ -0,0 +1,397 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <boost/crc.hpp>
+#include <boost/format.hpp>
+#include "job_spool.hpp"
+
+namespace md
+{
+    using namespace service;
+    namespace delivery
+    {
+        namespace
+        {
+            const uint32_t SPOOL_MAGIC = 0x5053444d;// "MDSP"
+            const uint32_t SPOOL_VERSION = 1;
+            const size_t HEADER_SIZE = 64;
+            const size_t RECORD_HEADER_SIZE = 8;
+            const size_t MIN_RECORD_SIZE = 64;// sizes the bitmap: segment_size / MIN_RECORD_SIZE records
+
+            struct SegmentHeader
+            {
+                uint32_t m_magic;
+                uint32_t m_version;
+                uint64_t m_sequence;
+                int32_t m_last_job_id;
+                uint32_t m_capacity;
+            };
+
+            static_assert(sizeof(SegmentHeader) <= HEADER_SIZE, "segment header doesn't fit");
+
+            size_t align8(size_t size)
+            {
+                return (size + 7) & ~static_cast<size_t>(7);
+            }
+
+            size_t data_offset(uint32_t capacity)
+            {
+                return HEADER_SIZE + align8((capacity + 7) / 8);
+            }
+
+            uint32_t checksum(const char *data, size_t size)
+            {
+                boost::crc_32_type crc;
+                crc.process_bytes(data, size);
+                return crc.checksum();
+            }
+
+            void put_uint32(std::string &buffer, uint32_t value)
+            {
+                buffer.append(reinterpret_cast<const char *>(&value), sizeof(value));
+            }
+
+            bool get_uint32(const char *&data, const char *end, uint32_t &value)
+            {
+                if (end - data < static_cast<ptrdiff_t>(sizeof(value))) {
+                    return false;
+                }
+                memcpy(&value, data, sizeof(value));
+                data += sizeof(value);
+                return true;
+            }
+
+            void encode(const StringList &job, std::string &payload)
+            {
+                payload.clear();
+                put_uint32(payload, static_cast<uint32_t>(job.size()));
+                for (const auto &field : job) {
+                    put_uint32(payload, static_cast<uint32_t>(field.size()));
+                    payload += field;
+                }
+            }
+
+            bool decode(const char *data, size_t size, StringList &job)
+            {
+                const char *end = data + size;
+                uint32_t field_count = 0;
+                if (!get_uint32(data, end, field_count)) {
+                    return false;
+                }
+                job.clear();
+                for (uint32_t idx = 0; idx < field_count; ++idx) {
+                    uint32_t length = 0;
+                    if (!get_uint32(data, end, length) || end - data < static_cast<ptrdiff_t>(length)) {
+                        return false;
+                    }
+                    job.emplace_back(data, length);
+                    data += length;
+                }
+                return !job.empty();
+            }
+
+            SegmentHeader *header_of(char *data)
+            {
+                return reinterpret_cast<SegmentHeader *>(data);
+            }
+
+            bool is_done(const char *data, uint32_t record)
+            {
+                return (data[HEADER_SIZE + record / 8] & (1 << (record % 8))) != 0;
+            }
+        }
+
+        JobSpool::JobSpool(std::string directory, size_t segment_size)
+                : m_directory(std::move(directory))
+                  , m_segment_size(std::max(segment_size, static_cast<size_t>(64 * 1024)))
+        {
+            fs::create_directories(m_directory);
+            recover();
+            create_segment(0);
+            reclaim();
+        }
+
+        JobSpool::~JobSpool()
+        {
+            sync();
+            for (auto &item : m_segments) {
+                close_segment(item.second, false);
+            }
+        }
+
+        StringListArray JobSpool::take_pending()
+        {
+            StringListArray pending;
+            pending.swap(m_pending);
+            return pending;
+        }
+
+        void JobSpool::append(const StringListArray &batch)
+        {
+            std::string payload;
+            for (const auto &job : batch) {
+                encode(job, payload);
+                auto record_size = RECORD_HEADER_SIZE + align8(payload.size());
+
+                auto *segment = &m_segments.rbegin()->second;
+                if (segment->m_record_count >= segment->m_capacity
+                    || segment->m_write_offset + record_size > segment->m_size) {
+                    create_segment(record_size);
+                    reclaim();
+                    segment = &m_segments.rbegin()->second;
+                }
+
+                auto record = segment->m_data + segment->m_write_offset;
+                auto payload_size = static_cast<uint32_t>(payload.size());
+                auto crc = checksum(payload.data(), payload.size());
+                memcpy(record + RECORD_HEADER_SIZE, payload.data(), payload.size());
+                memcpy(record + 4, &crc, sizeof(crc));
+                memcpy(record, &payload_size, sizeof(payload_size));
+                segment->m_write_offset += record_size;
+
+                auto job_id = std::stoi(job[0]);
+                m_locations[job_id] = std::make_pair(segment->m_sequence, segment->m_record_count);
+                ++segment->m_record_count;
+                ++segment->m_pending_count;
+                if (job_id > m_last_job_id) {
+                    m_last_job_id = job_id;
+                    header_of(segment->m_data)->m_last_job_id = m_last_job_id;
+                }
+            }
+        }
+
+        void JobSpool::mark_done(int job_id)
+        {
+            auto it_location = m_locations.find(job_id);
+            if (it_location == m_locations.end()) {
+                return;
+            }
+            auto it_segment = m_segments.find(it_location->second.first);
+            auto record = it_location->second.second;
+            m_locations.erase(it_location);
+            if (it_segment == m_segments.end()) {
+                return;
+            }
+
+            auto &segment = it_segment->second;
+            if (!is_done(segment.m_data, record)) {
+                segment.m_data[HEADER_SIZE + record / 8] |= static_cast<char>(1 << (record % 8));
+                segment.m_is_bitmap_dirty = true;
+                --segment.m_pending_count;
+            }
+            if (segment.m_pending_count == 0 && it_segment->first != m_segments.rbegin()->first) {
+                close_segment(segment, true);
+                m_segments.erase(it_segment);
+            }
+        }
+
+        void JobSpool::sync()
+        {
+            for (auto &item : m_segments) {
+                sync_segment(item.second);
+            }
+        }
+
+        std::string JobSpool::load_worker_id(const std::string &make_id)
+        {
+            auto path = (fs::path(m_directory) / "worker_id").string();
+            std::string worker_id;
+            std::ifstream input(path);
+            if (input && std::getline(input, worker_id) && !worker_id.empty()) {
+                return worker_id;
+            }
+            std::ofstream output(path, std::ios::trunc);
+            output << make_id << std::endl;
+            if (!output) {
+                throw std::runtime_error("can't write " + path);
+            }
+            return make_id;
+        }
+
+        DataRange JobSpool::load_range(const DataRange &make_range)
+        {
+            auto path = (fs::path(m_directory) / "range").string();
+            DataRange range;
+            std::ifstream input(path);
+            if (input >> range.first >> range.second) {
+                return range;
+            }
+            std::ofstream output(path, std::ios::trunc);
+            output << make_range.first << ' ' << make_range.second << std::endl;
+            if (!output) {
+                throw std::runtime_error("can't write " + path);
+            }
+            return make_range;
+        }
+
+        void JobSpool::recover()
+        {
+            std::vector<uint64_t> sequences;
+            for (fs::directory_iterator it(m_directory), end; it != end; ++it) {
+                if (it->path().extension() == ".spool") {
+                    try {
+                        sequences.push_back(std::stoull(it->path().stem().string()));
+                    }
+                    catch (std::exception &) {
+                        MD_LOG_WARNING("spool: unexpected file " + it->path().string());
+                    }
+                }
+            }
+            std::sort(sequences.begin(), sequences.end());
+
+            for (auto sequence : sequences) {
+                auto path = segment_path(sequence);
+                Segment segment;
+                segment.m_sequence = sequence;
+                segment.m_fd = open(path.c_str(), O_RDWR);
+                struct stat file_stat{};
+                if (segment.m_fd < 0 || fstat(segment.m_fd, &file_stat) != 0
+                    || static_cast<size_t>(file_stat.st_size) < HEADER_SIZE) {
+                    MD_LOG_WARNING("spool: dropping unreadable segment " + path);
+                    close_segment(segment, true);
+                    continue;
+                }
+                segment.m_size = static_cast<size_t>(file_stat.st_size);
+                auto data = mmap(nullptr, segment.m_size, PROT_READ | PROT_WRITE, MAP_SHARED, segment.m_fd, 0);
+                if (data == MAP_FAILED) {
+                    close_segment(segment, false);
+                    throw std::runtime_error("can't map spool segment " + path);
+                }
+                segment.m_data = static_cast<char *>(data);
+
+                auto header = header_of(segment.m_data);
+                if (header->m_magic != SPOOL_MAGIC || header->m_version != SPOOL_VERSION
+                    || data_offset(header->m_capacity) > segment.m_size) {
+                    MD_LOG_WARNING("spool: dropping segment with a bad header " + path);
+                    close_segment(segment, true);
+                    continue;
+                }
+                segment.m_capacity = header->m_capacity;
+                m_last_job_id = std::max(m_last_job_id, static_cast<int>(header->m_last_job_id));
+
+                // records up to the first empty, torn or corrupted one
+                auto offset = data_offset(segment.m_capacity);
+                StringList job;
+                while (segment.m_record_count < segment.m_capacity
+                       && offset + RECORD_HEADER_SIZE <= segment.m_size) {
+                    uint32_t payload_size = 0;
+                    uint32_t crc = 0;
+                    memcpy(&payload_size, segment.m_data + offset, sizeof(payload_size));
+                    memcpy(&crc, segment.m_data + offset + 4, sizeof(crc));
+                    auto payload = segment.m_data + offset + RECORD_HEADER_SIZE;
+                    if (payload_size == 0 || offset + RECORD_HEADER_SIZE + payload_size > segment.m_size
+                        || checksum(payload, payload_size) != crc || !decode(payload, payload_size, job)) {
+                        break;
+                    }
+
+                    auto record = segment.m_record_count++;
+                    offset += RECORD_HEADER_SIZE + align8(payload_size);
+                    auto job_id = std::stoi(job[0]);
+                    m_last_job_id = std::max(m_last_job_id, job_id);
+                    if (is_done(segment.m_data, record)) {
+                        continue;
+                    }
+                    m_locations[job_id] = std::make_pair(sequence, record);
+                    ++segment.m_pending_count;
+                    m_pending.push_back(job);
+                }
+                segment.m_write_offset = offset;
+                segment.m_synced_offset = offset;
+                m_segments[sequence] = segment;
+            }
+        }
+
+        void JobSpool::create_segment(size_t record_size)
+        {
+            if (!m_segments.empty()) {
+                sync_segment(m_segments.rbegin()->second);
+            }
+
+            Segment segment;
+            segment.m_sequence = m_segments.empty() ? 1 : m_segments.rbegin()->first + 1;
+            segment.m_capacity = static_cast<uint32_t>(m_segment_size / MIN_RECORD_SIZE);
+            segment.m_size = std::max(m_segment_size, data_offset(segment.m_capacity) + record_size);
+
+            auto path = segment_path(segment.m_sequence);
+            segment.m_fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if (segment.m_fd < 0 || ftruncate(segment.m_fd, static_cast<off_t>(segment.m_size)) != 0) {
+                close_segment(segment, segment.m_fd >= 0);
+                throw std::runtime_error("can't create spool segment " + path);
+            }
+            auto data = mmap(nullptr, segment.m_size, PROT_READ | PROT_WRITE, MAP_SHARED, segment.m_fd, 0);
+            if (data == MAP_FAILED) {
+                close_segment(segment, true);
+                throw std::runtime_error("can't map spool segment " + path);
+            }
+            segment.m_data = static_cast<char *>(data);
+
+            auto header = header_of(segment.m_data);
+            header->m_magic = SPOOL_MAGIC;
+            header->m_version = SPOOL_VERSION;
+            header->m_sequence = segment.m_sequence;
+            header->m_last_job_id = m_last_job_id;
+            header->m_capacity = segment.m_capacity;
+            segment.m_write_offset = data_offset(segment.m_capacity);
+            segment.m_synced_offset = segment.m_write_offset;
+            segment.m_is_bitmap_dirty = true;
+            sync_segment(segment);
+
+            m_segments[segment.m_sequence] = segment;
+        }
+
+        void JobSpool::sync_segment(Segment &segment)
+        {
+            // records go first: the header must not announce a high-water mark that isn't on disk yet
+            bool is_appended = segment.m_write_offset > segment.m_synced_offset;
+            if (is_appended) {
+                auto page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+                auto begin = segment.m_synced_offset / page_size * page_size;
+                msync(segment.m_data + begin, segment.m_write_offset - begin, MS_SYNC);
+                segment.m_synced_offset = segment.m_write_offset;
+            }
+            if (segment.m_is_bitmap_dirty || is_appended) {
+                msync(segment.m_data, data_offset(segment.m_capacity), MS_SYNC);
+                segment.m_is_bitmap_dirty = false;
+            }
+        }
+
+        void JobSpool::close_segment(Segment &segment, bool is_remove)
+        {
+            if (segment.m_data != nullptr) {
+                munmap(segment.m_data, segment.m_size);
+                segment.m_data = nullptr;
+            }
+            if (segment.m_fd >= 0) {
+                close(segment.m_fd);
+                segment.m_fd = -1;
+            }
+            if (is_remove) {
+                unlink(segment_path(segment.m_sequence).c_str());
+            }
+        }
+
+        void JobSpool::reclaim()
+        {
+            auto active = m_segments.rbegin()->first;
+            for (auto it = m_segments.begin(); it != m_segments.end();) {
+                if (it->first != active && it->second.m_pending_count == 0) {
+                    close_segment(it->second, true);
+                    it = m_segments.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+
+        std::string JobSpool::segment_path(uint64_t sequence) const
+        {
+            return (fs::path(m_directory) / (boost::format("%020d.spool") % sequence).str()).string();
+        }
+
+    }// namespace delivery
+}// namespace md
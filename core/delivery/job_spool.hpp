@@ -0,0 +1,111 @@
+#pragma once
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include "../../tools/service/service.hpp"
+
+namespace md
+{
+    using namespace service;
+    namespace delivery
+    {
+        /**
+         * Local append-only log of the jobs a worker fetched, so a restarted worker resumes
+         * from disk instead of fetching and sending everything again.
+         *
+         * The log is a sequence of memory-mapped segment files <directory>/<sequence>.spool:
+         *   header | completion bitmap, one bit per record | records
+         * record: uint32 payload size, uint32 crc32 of the payload, payload padded to 8 bytes;
+         * payload: uint32 field count, then uint32 length and bytes of every field.
+         * A torn or corrupted record ends the segment on recovery. A segment is deleted
+         * once every record in it is final; the newest one is kept, it carries the high-water mark.
+         * Not thread safe.
+         */
+        class JobSpool
+        {
+        public:
+            JobSpool(std::string directory, size_t segment_size);
+
+            ~JobSpool();
+
+            JobSpool(const JobSpool &) = delete;
+
+            JobSpool &operator=(const JobSpool &) = delete;
+
+            // jobs of earlier runs that are not final yet, in the order they were spooled
+            StringListArray take_pending();
+
+            void append(const StringListArray &batch);
+
+            // the job will not be handed out again, ids that aren't spooled are ignored
+            void mark_done(int job_id);
+
+            // spooled and not final yet
+            bool is_pending(int job_id) const
+            {
+                return m_locations.count(job_id) != 0;
+            }
+
+            // flush appended records and completion marks to disk
+            void sync();
+
+            // highest job id ever spooled in this directory, 0 for an empty spool
+            int last_job_id() const
+            {
+                return m_last_job_id;
+            }
+
+            size_t segment_count() const
+            {
+                return m_segments.size();
+            }
+
+            // worker id stored in the spool directory, created from make_id on first use
+            std::string load_worker_id(const std::string &make_id);
+
+            // id range stored in the spool directory the same way, a restart keeps the slice it started with
+            DataRange load_range(const DataRange &make_range);
+
+        private:
+            struct Segment
+            {
+                uint64_t m_sequence = 0;
+                int m_fd = -1;
+                char *m_data = nullptr;
+                size_t m_size = 0;
+                size_t m_write_offset = 0;
+                size_t m_synced_offset = 0;
+                uint32_t m_capacity = 0;// records, fixed when the segment is created
+                uint32_t m_record_count = 0;
+                uint32_t m_pending_count = 0;
+                bool m_is_bitmap_dirty = false;
+            };
+
+            void recover();
+
+            void create_segment(size_t record_size);
+
+            void close_segment(Segment &segment, bool is_remove);
+
+            void reclaim();
+
+            void sync_segment(Segment &segment);
+
+            std::string segment_path(uint64_t sequence) const;
+
+            std::string m_directory;
+            size_t m_segment_size;
+            int m_last_job_id = 0;
+
+            std::map<uint64_t, Segment> m_segments;// by sequence, the last one takes appends
+            std::unordered_map<int, std::pair<uint64_t, uint32_t>> m_locations;// job id -> segment, record
+            StringListArray m_pending;
+        };
+
+        using JobSpoolPtr = std::shared_ptr<JobSpool>;
+
+    }// namespace delivery
+}// namespace md
@@ -0,0 +1,26 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include "retry_policy.hpp"
+
+namespace md
+{
+    namespace delivery
+    {
+        int64_t RetryPolicy::delay(int attempts) const
+        {
+            if (attempts >= m_max_attempts) {
+                return -1;
+            }
+            auto seconds = m_initial_delay * std::pow(std::max(m_backoff, 1.0), std::max(attempts - 1, 0));
+            return static_cast<int64_t>(std::min(seconds, static_cast<double>(std::max(m_max_delay, 0))));
+        }
+
+        int64_t steady_clock_ms()
+        {
+            return std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+    }// namespace delivery
+}// namespace md
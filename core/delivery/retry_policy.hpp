@@ -0,0 +1,33 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+
+namespace md
+{
+    namespace delivery
+    {
+        /**
+         * When a deferred (4xx) job gets its next attempt: initial_delay seconds after the first
+         * attempt, growing by backoff with every further one up to max_delay.
+         * max_attempts counts all attempts, the first one included; 0 disables retries.
+         * A retry due more than max_window seconds after the first attempt is not kept (0 - no limit).
+         */
+        struct RetryPolicy
+        {
+            int m_max_attempts = 0;
+            int m_initial_delay = 300;// seconds
+            double m_backoff = 2.0;
+            int m_max_delay = 4 * 3600;// seconds
+            int m_max_window = 0;// seconds
+
+            // seconds from attempt number attempts (1 - the first) to the next one, -1 - give up
+            int64_t delay(int attempts) const;
+        };
+
+        // milliseconds of some monotonic clock, the simulator replaces the steady clock with a virtual one
+        using Clock = std::function<int64_t()>;
+
+        int64_t steady_clock_ms();
+
+    }// namespace delivery
+}// namespace md
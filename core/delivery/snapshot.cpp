@@ -0,0 +1,314 @@
+#include <cstring>
+#include <stdexcept>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "snapshot.hpp"
+
+namespace md
+{
+    using namespace service;
+    namespace delivery
+    {
+        namespace
+        {
+            const char SNAPSHOT_MAGIC[8] = {'M', 'D', 'S', 'N', 'A', 'P', '0', '1'};
+            const uint32_t SNAPSHOT_VERSION = 1;
+            const size_t FILE_HEADER_SIZE = 32;
+
+            enum COLUMN_ENCODING : uint32_t
+            {
+                PLAIN = 0,
+                DICTIONARY = 1
+            };
+
+            size_t align8(size_t size)
+            {
+                return (size + 7) & ~static_cast<size_t>(7);
+            }
+
+            template<typename T>
+            void put(std::string &buffer, T value)
+            {
+                buffer.append(reinterpret_cast<const char *>(&value), sizeof(value));
+            }
+
+            template<typename T>
+            T get(const char *data)
+            {
+                T value;
+                memcpy(&value, data, sizeof(value));
+                return value;
+            }
+
+            // lengths of all values, then their bytes
+            void put_values(std::string &block, const std::vector<const std::string *> &values)
+            {
+                for (auto value : values) {
+                    put(block, static_cast<uint32_t>(value->size()));
+                }
+                for (auto value : values) {
+                    block += *value;
+                }
+            }
+
+            // values of a put_values block, returns the offset right behind it
+            size_t get_values(const char *block, size_t offset, size_t end, uint32_t count
+                              , std::vector<std::string> &values)
+            {
+                if (offset + 4 * static_cast<size_t>(count) > end) {
+                    throw std::runtime_error("snapshot: truncated column");
+                }
+                auto lengths = block + offset;
+                offset += 4 * static_cast<size_t>(count);
+                values.resize(count);
+                for (uint32_t idx = 0; idx < count; ++idx) {
+                    auto length = get<uint32_t>(lengths + 4 * idx);
+                    if (offset + length > end) {
+                        throw std::runtime_error("snapshot: truncated column");
+                    }
+                    values[idx].assign(block + offset, length);
+                    offset += length;
+                }
+                return offset;
+            }
+        }
+
+        SnapshotWriter::SnapshotWriter(const std::string &path, size_t group_rows)
+                : m_file(path, std::ios::binary | std::ios::trunc)
+                  , m_group_rows(group_rows > 0 ? group_rows : 65536)
+        {
+            if (!m_file) {
+                throw std::runtime_error("can't create snapshot " + path);
+            }
+            // the totals are filled in by close()
+            m_file.write(std::string(FILE_HEADER_SIZE, '\0').data(), FILE_HEADER_SIZE);
+        }
+
+        SnapshotWriter::~SnapshotWriter()
+        {
+            try {
+                close();
+            }
+            catch (std::exception &e) {
+                MD_LOG_ERROR(e.what());
+            }
+        }
+
+        void SnapshotWriter::append(const StringListArray &rows)
+        {
+            for (const auto &row : rows) {
+                if (m_column_count == 0) {
+                    m_column_count = static_cast<uint32_t>(row.size());
+                }
+                if (row.size() != m_column_count) {
+                    throw std::runtime_error("snapshot: rows differ in column count");
+                }
+                m_group.push_back(row);
+                if (m_group.size() >= m_group_rows) {
+                    write_group();
+                }
+            }
+        }
+
+        void SnapshotWriter::close()
+        {
+            if (m_is_closed) {
+                return;
+            }
+            m_is_closed = true;
+            write_group();
+
+            std::string header(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+            put(header, SNAPSHOT_VERSION);
+            put(header, m_column_count);
+            put(header, m_row_count);
+            put(header, m_group_count);
+            m_file.seekp(0);
+            m_file.write(header.data(), header.size());
+            m_file.close();
+            if (m_file.fail()) {
+                throw std::runtime_error("snapshot: write failed");
+            }
+        }
+
+        void SnapshotWriter::write_group()
+        {
+            if (m_group.empty()) {
+                return;
+            }
+            auto row_count = static_cast<uint32_t>(m_group.size());
+
+            std::vector<std::string> blocks(m_column_count);
+            std::vector<uint32_t> encodings(m_column_count, PLAIN);
+            std::vector<const std::string *> values;
+            values.reserve(row_count);
+            for (uint32_t column = 0; column < m_column_count; ++column) {
+                std::unordered_map<std::string, uint32_t> dictionary;
+                std::vector<const std::string *> entries;
+                std::vector<uint32_t> codes;
+                codes.reserve(row_count);
+                for (const auto &row : m_group) {
+                    auto it = dictionary.emplace(row[column], static_cast<uint32_t>(entries.size())).first;
+                    if (it->second == entries.size()) {
+                        entries.push_back(&it->first);
+                    }
+                    codes.push_back(it->second);
+                    if (entries.size() > row_count / 2) {
+                        break;
+                    }
+                }
+
+                auto &block = blocks[column];
+                if (entries.size() <= row_count / 2) {
+                    encodings[column] = DICTIONARY;
+                    put(block, static_cast<uint32_t>(entries.size()));
+                    put_values(block, entries);
+                    block.resize(align8(block.size()), '\0');
+                    for (auto code : codes) {
+                        put(block, code);
+                    }
+                } else {
+                    values.clear();
+                    for (const auto &row : m_group) {
+                        values.push_back(&row[column]);
+                    }
+                    put_values(block, values);
+                }
+            }
+
+            std::string header;
+            put(header, row_count);
+            put(header, m_column_count);
+            for (uint32_t column = 0; column < m_column_count; ++column) {
+                put(header, encodings[column]);
+                put(header, static_cast<uint64_t>(align8(blocks[column].size())));
+            }
+            write_padded(header);
+            for (const auto &block : blocks) {
+                write_padded(block);
+            }
+
+            m_row_count += row_count;
+            ++m_group_count;
+            m_group.clear();
+        }
+
+        void SnapshotWriter::write_padded(const std::string &block)
+        {
+            static const char padding[8] = {0};
+            m_file.write(block.data(), block.size());
+            m_file.write(padding, align8(block.size()) - block.size());
+        }
+
+        SnapshotReader::SnapshotReader(const std::string &path)
+        {
+            int fd = open(path.c_str(), O_RDONLY);
+            struct stat file_stat{};
+            if (fd < 0 || fstat(fd, &file_stat) != 0) {
+                if (fd >= 0) {
+                    ::close(fd);
+                }
+                throw std::runtime_error("can't open snapshot " + path);
+            }
+            m_size = static_cast<size_t>(file_stat.st_size);
+            if (m_size < FILE_HEADER_SIZE) {
+                ::close(fd);
+                throw std::runtime_error("not a snapshot: " + path);
+            }
+            auto data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            ::close(fd);
+            if (data == MAP_FAILED) {
+                throw std::runtime_error("can't map snapshot " + path);
+            }
+            m_data = static_cast<const char *>(data);
+            madvise(data, m_size, MADV_SEQUENTIAL);
+
+            if (memcmp(m_data, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0
+                || get<uint32_t>(m_data + 8) != SNAPSHOT_VERSION) {
+                munmap(data, m_size);
+                throw std::runtime_error("not a snapshot: " + path);
+            }
+            m_column_count = get<uint32_t>(m_data + 12);
+            m_row_count = get<uint64_t>(m_data + 16);
+            m_group_count = get<uint64_t>(m_data + 24);
+            m_offset = FILE_HEADER_SIZE;
+        }
+
+        SnapshotReader::~SnapshotReader()
+        {
+            munmap(const_cast<char *>(m_data), m_size);
+        }
+
+        bool SnapshotReader::next_group(StringListArray &rows)
+        {
+            if (m_group_idx >= m_group_count) {
+                return false;
+            }
+            if (m_offset + 8 > m_size) {
+                throw std::runtime_error("snapshot: truncated file");
+            }
+            auto row_count = get<uint32_t>(m_data + m_offset);
+            auto column_count = get<uint32_t>(m_data + m_offset + 4);
+            auto header_size = align8(8 + 12 * static_cast<size_t>(column_count));
+            if (column_count != m_column_count || row_count > m_row_count || m_offset + header_size > m_size) {
+                throw std::runtime_error("snapshot: corrupted row group");
+            }
+
+            rows.assign(row_count, StringList());
+            for (auto &row : rows) {
+                row.resize(column_count);
+            }
+
+            auto block_offset = m_offset + header_size;
+            std::vector<std::string> values;
+            for (uint32_t column = 0; column < column_count; ++column) {
+                auto column_header = m_data + m_offset + 8 + 12 * column;
+                auto encoding = get<uint32_t>(column_header);
+                auto block_size = get<uint64_t>(column_header + 4);
+                // block_offset is within the file, a corrupted size must not wrap the sum around
+                if (block_size > m_size - block_offset) {
+                    throw std::runtime_error("snapshot: truncated file");
+                }
+                auto block_end = block_offset + block_size;
+
+                if (encoding == DICTIONARY) {
+                    if (block_offset + 4 > block_end) {
+                        throw std::runtime_error("snapshot: truncated column");
+                    }
+                    auto entry_count = get<uint32_t>(m_data + block_offset);
+                    auto codes_offset = align8(get_values(m_data, block_offset + 4, block_end, entry_count, values));
+                    if (codes_offset + 4 * static_cast<size_t>(row_count) > block_end) {
+                        throw std::runtime_error("snapshot: truncated column");
+                    }
+                    for (uint32_t idx = 0; idx < row_count; ++idx) {
+                        auto code = get<uint32_t>(m_data + codes_offset + 4 * idx);
+                        if (code >= entry_count) {
+                            throw std::runtime_error("snapshot: corrupted dictionary index");
+                        }
+                        rows[idx][column] = values[code];
+                    }
+                } else {
+                    get_values(m_data, block_offset, block_end, row_count, values);
+                    for (uint32_t idx = 0; idx < row_count; ++idx) {
+                        rows[idx][column].swap(values[idx]);
+                    }
+                }
+                block_offset = block_end;
+            }
+
+            m_offset = block_offset;
+            ++m_group_idx;
+            return true;
+        }
+
+        void SnapshotReader::rewind()
+        {
+            m_offset = FILE_HEADER_SIZE;
+            m_group_idx = 0;
+        }
+
+    }// namespace delivery
+}// namespace md
@@ -0,0 +1,97 @@
+#pragma once
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "../../tools/service/service.hpp"
+
+namespace md
+{
+    using namespace service;
+    namespace delivery
+    {
+        /**
+         * Campaign snapshot: core.emails rows in a columnar binary file for DB-free replay.
+         *
+         * file:      "MDSNAP01", uint32 version, uint32 column count, uint64 row count, uint64 group count
+         * row group: uint32 row count, uint32 column count, per column uint32 encoding + uint64 block size,
+         *            then the column blocks
+         * plain column block:      uint32 length per row, the bytes of all values
+         * dictionary column block: uint32 dictionary size, uint32 length per entry, the entry bytes,
+         *                          uint32 dictionary index per row
+         * Everything is little-endian, headers and blocks start on 8 byte boundaries so a mapped file
+         * can be read in place. A column is dictionary encoded when at most half of its values in the
+         * group are distinct (login, sender, subject and body of a campaign usually are).
+         */
+        class SnapshotWriter
+        {
+        public:
+            explicit SnapshotWriter(const std::string &path, size_t group_rows = 65536);
+
+            ~SnapshotWriter();
+
+            SnapshotWriter(const SnapshotWriter &) = delete;
+
+            SnapshotWriter &operator=(const SnapshotWriter &) = delete;
+
+            void append(const StringListArray &rows);
+
+            // writes the last group and the totals, the file is complete after that
+            void close();
+
+            uint64_t row_count() const
+            {
+                return m_row_count;
+            }
+
+        private:
+            void write_group();
+
+            void write_padded(const std::string &block);
+
+            std::ofstream m_file;
+            size_t m_group_rows;
+            uint32_t m_column_count = 0;
+            uint64_t m_row_count = 0;
+            uint64_t m_group_count = 0;
+            StringListArray m_group;
+            bool m_is_closed = false;
+        };
+
+        /**
+         * Maps a snapshot file and decodes it one row group at a time
+         */
+        class SnapshotReader
+        {
+        public:
+            explicit SnapshotReader(const std::string &path);
+
+            ~SnapshotReader();
+
+            SnapshotReader(const SnapshotReader &) = delete;
+
+            SnapshotReader &operator=(const SnapshotReader &) = delete;
+
+            // replaces rows with the next row group; false at the end of the file
+            bool next_group(StringListArray &rows);
+
+            // back to the first row group
+            void rewind();
+
+            uint64_t row_count() const
+            {
+                return m_row_count;
+            }
+
+        private:
+            const char *m_data = nullptr;
+            size_t m_size = 0;
+            size_t m_offset = 0;
+            uint32_t m_column_count = 0;
+            uint64_t m_row_count = 0;
+            uint64_t m_group_count = 0;
+            uint64_t m_group_idx = 0;
+        };
+
+    }// namespace delivery
+}// namespace md
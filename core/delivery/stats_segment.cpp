@@ -0,0 +1,349 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <new>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "stats_segment.hpp"
+
+namespace md
+{
+    using namespace service;
+    namespace delivery
+    {
+        using smtp::SMTP_COUNTER;
+
+        namespace
+        {
+            int64_t steady_ms()
+            {
+                return std::chrono::duration_cast<std::chrono::milliseconds>(
+                        std::chrono::steady_clock::now().time_since_epoch()).count();
+            }
+
+            uint64_t processed(const smtp::SmtpCounters &counters)
+            {
+                return counters[static_cast<size_t>(SMTP_COUNTER::SENT)]
+                       + counters[static_cast<size_t>(SMTP_COUNTER::FAILED)]
+                       + counters[static_cast<size_t>(SMTP_COUNTER::DEFERRED)];
+            }
+
+            // room kept for the OTHER_DOMAIN entry of the domains beyond the area
+            const size_t OTHER_DOMAIN_RESERVE = 16 * 1024;
+
+            template<typename T>
+            void put(std::string &data, T value)
+            {
+                data.append(reinterpret_cast<const char *>(&value), sizeof(value));
+            }
+
+            template<typename T>
+            bool get(const char *&pos, const char *end, T &value)
+            {
+                if (static_cast<size_t>(end - pos) < sizeof(value)) {
+                    return false;
+                }
+                memcpy(&value, pos, sizeof(value));
+                pos += sizeof(value);
+                return true;
+            }
+
+            // name, counters, reply codes and the latency buckets in use; same process layout on both sides
+            void put_domain(std::string &data, const std::string &name, const smtp::DomainStats &stats)
+            {
+                put<uint32_t>(data, name.size());
+                data += name;
+                put(data, stats.m_attempts);
+                put(data, stats.m_successes);
+                put(data, stats.m_bytes);
+                put(data, stats.m_latency.m_sum_us);
+                put<uint32_t>(data, stats.m_reply_codes.size());
+                for (const auto &reply_code : stats.m_reply_codes) {
+                    put<int32_t>(data, reply_code.first);
+                    put(data, reply_code.second);
+                }
+                auto bucket_count_pos = data.size();
+                put<uint32_t>(data, 0);
+                uint32_t bucket_count = 0;
+                for (size_t idx = 0; idx < stats.m_latency.m_buckets.size(); ++idx) {
+                    if (stats.m_latency.m_buckets[idx] != 0) {
+                        put<uint32_t>(data, idx);
+                        put(data, stats.m_latency.m_buckets[idx]);
+                        ++bucket_count;
+                    }
+                }
+                memcpy(&data[bucket_count_pos], &bucket_count, sizeof(bucket_count));
+            }
+
+            bool get_domain(const char *&pos, const char *end, std::string &name, smtp::DomainStats &stats)
+            {
+                uint32_t size = 0;
+                if (!get(pos, end, size) || static_cast<size_t>(end - pos) < size) {
+                    return false;
+                }
+                name.assign(pos, size);
+                pos += size;
+                uint32_t count = 0;
+                if (!get(pos, end, stats.m_attempts) || !get(pos, end, stats.m_successes)
+                    || !get(pos, end, stats.m_bytes) || !get(pos, end, stats.m_latency.m_sum_us)
+                    || !get(pos, end, count)) {
+                    return false;
+                }
+                for (uint32_t idx = 0; idx < count; ++idx) {
+                    int32_t reply_code = 0;
+                    uint64_t value = 0;
+                    if (!get(pos, end, reply_code) || !get(pos, end, value)) {
+                        return false;
+                    }
+                    stats.m_reply_codes[reply_code] = value;
+                }
+                if (!get(pos, end, count)) {
+                    return false;
+                }
+                for (uint32_t idx = 0; idx < count; ++idx) {
+                    uint32_t bucket = 0;
+                    uint64_t value = 0;
+                    if (!get(pos, end, bucket) || !get(pos, end, value)
+                        || bucket >= stats.m_latency.m_buckets.size()) {
+                        return false;
+                    }
+                    stats.m_latency.m_buckets[bucket] = value;
+                }
+                return true;
+            }
+        }
+
+        StatsSegment::StatsSegment(int worker_count)
+                : m_worker_count(std::max(worker_count, 1))
+        {
+            auto name = "/md_stats_" + std::to_string(getpid());
+            int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+            if (fd < 0) {
+                throw std::runtime_error("can't create statistics segment " + name);
+            }
+            m_size = (sizeof(Slot) + sizeof(DomainArea) + DOMAIN_AREA_SIZE) * m_worker_count;
+            void *data = MAP_FAILED;
+            if (ftruncate(fd, m_size) == 0) {
+                data = mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            }
+            close(fd);
+            shm_unlink(name.c_str());
+            if (data == MAP_FAILED) {
+                throw std::runtime_error("can't map statistics segment " + name);
+            }
+
+            m_slots = static_cast<Slot *>(data);
+            for (int idx = 0; idx < m_worker_count; ++idx) {
+                auto slot = new(m_slots + idx) Slot();
+                for (auto &value : slot->m_values) {
+                    value.store(0, std::memory_order_relaxed);
+                }
+                slot->m_messages_per_second.store(0, std::memory_order_relaxed);
+                slot->m_heartbeat_ms.store(0, std::memory_order_relaxed);
+                slot->m_queue_depth.store(0, std::memory_order_relaxed);
+                slot->m_pid.store(0, std::memory_order_relaxed);
+
+                auto area = new(&domain_area(idx + 1)) DomainArea();
+                area->m_sequence.store(0, std::memory_order_relaxed);
+                area->m_size.store(0, std::memory_order_relaxed);
+            }
+        }
+
+        StatsSegment::~StatsSegment()
+        {
+            munmap(m_slots, m_size);
+        }
+
+        StatsSegment::Slot &StatsSegment::slot(int worker_idx) const
+        {
+            if (worker_idx < 1 || worker_idx > m_worker_count) {
+                throw std::out_of_range("no statistics slot for worker " + std::to_string(worker_idx));
+            }
+            return m_slots[worker_idx - 1];
+        }
+
+        StatsSegment::DomainArea &StatsSegment::domain_area(int worker_idx) const
+        {
+            slot(worker_idx);
+            auto areas = reinterpret_cast<char *>(m_slots + m_worker_count);
+            return *reinterpret_cast<DomainArea *>(areas + (sizeof(DomainArea) + DOMAIN_AREA_SIZE) * (worker_idx - 1));
+        }
+
+        void StatsSegment::publish(int worker_idx, uint64_t queue_depth)
+        {
+            auto &worker_slot = slot(worker_idx);
+            auto counters = smtp::SmtpStatistic::instance().snapshot();
+            auto now = steady_ms();
+
+            // only the owning worker writes its slot, plain loads and stores are enough
+            auto last_heartbeat = worker_slot.m_heartbeat_ms.load(std::memory_order_relaxed);
+            if (last_heartbeat > 0 && now > last_heartbeat) {
+                smtp::SmtpCounters last{};
+                for (size_t idx = 0; idx < last.size(); ++idx) {
+                    last[idx] = worker_slot.m_values[idx].load(std::memory_order_relaxed);
+                }
+                auto delta = processed(counters) - processed(last);
+                worker_slot.m_messages_per_second.store(delta * 1000 / (now - last_heartbeat)
+                                                        , std::memory_order_relaxed);
+            }
+            for (size_t idx = 0; idx < counters.size(); ++idx) {
+                worker_slot.m_values[idx].store(counters[idx], std::memory_order_relaxed);
+            }
+            worker_slot.m_queue_depth.store(queue_depth, std::memory_order_relaxed);
+            worker_slot.m_pid.store(getpid(), std::memory_order_relaxed);
+            worker_slot.m_heartbeat_ms.store(now, std::memory_order_release);
+            publish_domains(worker_idx);
+        }
+
+        void StatsSegment::publish_domains(int worker_idx)
+        {
+            std::string data;
+            smtp::DomainStats other;
+            bool has_other = false;
+            for (const auto &domain : smtp::DomainStatistic::instance().snapshot()) {
+                auto size = data.size();
+                put_domain(data, domain.first, domain.second);
+                if (data.size() > DOMAIN_AREA_SIZE - OTHER_DOMAIN_RESERVE) {
+                    data.resize(size);
+                    other.merge(domain.second);
+                    has_other = true;
+                }
+            }
+            if (has_other) {
+                auto size = data.size();
+                put_domain(data, smtp::DomainStatistic::OTHER_DOMAIN, other);
+                if (data.size() > DOMAIN_AREA_SIZE) {
+                    data.resize(size);
+                }
+            }
+
+            // only the owning worker writes its area, readers retry when the sequence moved or is odd
+            auto &area = domain_area(worker_idx);
+            auto sequence = area.m_sequence.load(std::memory_order_relaxed);
+            area.m_sequence.store(sequence + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            memcpy(reinterpret_cast<char *>(&area + 1), data.data(), data.size());
+            area.m_size.store(data.size(), std::memory_order_relaxed);
+            area.m_sequence.store(sequence + 2, std::memory_order_release);
+        }
+
+        bool StatsSegment::read_domains(int worker_idx, std::string &data) const
+        {
+            const auto &area = domain_area(worker_idx);
+            for (int attempt = 0; attempt < 10; ++attempt) {
+                auto sequence = area.m_sequence.load(std::memory_order_acquire);
+                if (sequence % 2 != 0) {
+                    std::this_thread::yield();
+                    continue;
+                }
+                auto size = area.m_size.load(std::memory_order_relaxed);
+                if (size > DOMAIN_AREA_SIZE) {
+                    continue;
+                }
+                data.assign(reinterpret_cast<const char *>(&area + 1), size);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (area.m_sequence.load(std::memory_order_relaxed) == sequence) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        StatsSegment::WorkerStats StatsSegment::worker(int worker_idx) const
+        {
+            const auto &worker_slot = slot(worker_idx);
+            WorkerStats stats;
+            auto heartbeat = worker_slot.m_heartbeat_ms.load(std::memory_order_acquire);
+            if (heartbeat > 0) {
+                stats.m_heartbeat_age_ms = steady_ms() - heartbeat;
+            }
+            for (size_t idx = 0; idx < stats.m_counters.size(); ++idx) {
+                stats.m_counters[idx] = worker_slot.m_values[idx].load(std::memory_order_relaxed);
+            }
+            stats.m_messages_per_second = worker_slot.m_messages_per_second.load(std::memory_order_relaxed);
+            stats.m_queue_depth = worker_slot.m_queue_depth.load(std::memory_order_relaxed);
+            stats.m_pid = worker_slot.m_pid.load(std::memory_order_relaxed);
+            return stats;
+        }
+
+        smtp::SmtpCounters StatsSegment::totals() const
+        {
+            smtp::SmtpCounters totals{};
+            for (int worker_idx = 1; worker_idx <= m_worker_count; ++worker_idx) {
+                const auto &worker_slot = slot(worker_idx);
+                for (size_t idx = 0; idx < totals.size(); ++idx) {
+                    totals[idx] += worker_slot.m_values[idx].load(std::memory_order_relaxed);
+                }
+            }
+            return totals;
+        }
+
+        std::vector<std::pair<std::string, smtp::DomainStats>> StatsSegment::domains() const
+        {
+            std::map<std::string, smtp::DomainStats> merged;
+            std::string data;
+            std::string name;
+            for (int worker_idx = 1; worker_idx <= m_worker_count; ++worker_idx) {
+                if (!read_domains(worker_idx, data)) {
+                    continue;
+                }
+                const char *pos = data.data();
+                const char *end = pos + data.size();
+                while (pos < end) {
+                    smtp::DomainStats stats;
+                    if (!get_domain(pos, end, name, stats)) {
+                        break;
+                    }
+                    merged[name].merge(stats);
+                }
+            }
+            return std::vector<std::pair<std::string, smtp::DomainStats>>(merged.begin(), merged.end());
+        }
+
+        StatsPublisher::StatsPublisher(StatsSegmentPtr segment, int worker_idx
+                                       , std::function<size_t()> queue_depth, int interval_ms)
+                : m_segment(std::move(segment))
+                  , m_worker_idx(worker_idx)
+                  , m_queue_depth(std::move(queue_depth))
+                  , m_interval_ms(interval_ms > 0 ? interval_ms : 1000)
+        {
+            if (m_segment) {
+                publish();
+                m_thread = std::thread(&StatsPublisher::run, this);
+            }
+        }
+
+        StatsPublisher::~StatsPublisher()
+        {
+            if (!m_segment) {
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_is_stopped = true;
+            }
+            m_condition.notify_one();
+            m_thread.join();
+            // the final totals of the worker
+            publish();
+        }
+
+        void StatsPublisher::publish()
+        {
+            m_segment->publish(m_worker_idx, m_queue_depth ? m_queue_depth() : 0);
+        }
+
+        void StatsPublisher::run()
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            while (!m_condition.wait_for(lock, std::chrono::milliseconds(m_interval_ms)
+                                         , [this] { return m_is_stopped; })) {
+                publish();
+            }
+        }
+
+    }// namespace delivery
+}// namespace md
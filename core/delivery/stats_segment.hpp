@@ -0,0 +1,133 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "../smtp/domain_statistic.hpp"
+#include "../smtp/smtp_statistic.hpp"
+#include "../../tools/service/service.hpp"
+
+namespace md
+{
+    using namespace service;
+    namespace delivery
+    {
+        /**
+         * Delivery counters of all worker processes in one shared memory segment. The segment is mapped
+         * before fork_workers, so every child inherits the mapping; each worker owns one cache line
+         * aligned slot and copies its process's SmtpStatistic there, with a heartbeat and its recent
+         * throughput. The parent reads the slots directly, no round trip to the workers.
+         * The recipient domains of a worker go to an area of DOMAIN_AREA_SIZE bytes behind the slots,
+         * serialized under a sequence lock; domains that don't fit are counted under OTHER_DOMAIN.
+         * The shm name is unlinked as soon as it is mapped, nothing is left behind after a crash.
+         */
+        class StatsSegment
+        {
+        public:
+            struct WorkerStats
+            {
+                smtp::SmtpCounters m_counters;
+                uint64_t m_messages_per_second = 0;// sent, failed and deferred over the last publish interval
+                int64_t m_heartbeat_age_ms = -1;// -1 - the worker never published
+                uint64_t m_queue_depth = 0;// batches prefetched ahead of the sender
+                int m_pid = 0;
+            };
+
+            static const size_t DOMAIN_AREA_SIZE = 2 << 20;// pages are only backed once written
+
+            // worker_idx runs from 1 to worker_count, like the process_idx of the workers
+            explicit StatsSegment(int worker_count);
+
+            ~StatsSegment();
+
+            StatsSegment(const StatsSegment &) = delete;
+
+            StatsSegment &operator=(const StatsSegment &) = delete;
+
+            // copies this process's counters into the worker's slot and beats its heartbeat
+            void publish(int worker_idx, uint64_t queue_depth = 0);
+
+            WorkerStats worker(int worker_idx) const;
+
+            smtp::SmtpCounters totals() const;
+
+            // the recipient domains of all workers merged, as of their last publish
+            std::vector<std::pair<std::string, smtp::DomainStats>> domains() const;
+
+            int worker_count() const
+            {
+                return m_worker_count;
+            }
+
+        private:
+            struct alignas(64) Slot
+            {
+                std::atomic<uint64_t> m_values[static_cast<size_t>(smtp::SMTP_COUNTER::COUNT)];
+                std::atomic<uint64_t> m_messages_per_second;
+                std::atomic<int64_t> m_heartbeat_ms;// steady clock, CLOCK_MONOTONIC is the same in all processes
+                std::atomic<uint64_t> m_queue_depth;
+                std::atomic<int32_t> m_pid;
+            };
+
+            struct alignas(64) DomainArea
+            {
+                std::atomic<uint64_t> m_sequence;// odd while the worker writes
+                std::atomic<uint64_t> m_size;// DOMAIN_AREA_SIZE bytes of data follow
+            };
+
+            static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "shared memory counters need lock-free 64 bit atomics");
+
+            Slot &slot(int worker_idx) const;
+
+            DomainArea &domain_area(int worker_idx) const;
+
+            void publish_domains(int worker_idx);
+
+            // false when the worker kept writing during every attempt
+            bool read_domains(int worker_idx, std::string &data) const;
+
+            Slot *m_slots = nullptr;
+            size_t m_size = 0;
+            int m_worker_count;
+        };
+
+        using StatsSegmentPtr = std::shared_ptr<StatsSegment>;
+
+        /**
+         * publishes the worker's slot every interval_ms from a thread of its own and once more on
+         * destruction, queue_depth is sampled on every publish; does nothing without a segment
+         */
+        class StatsPublisher
+        {
+        public:
+            StatsPublisher(StatsSegmentPtr segment, int worker_idx, std::function<size_t()> queue_depth = nullptr
+                           , int interval_ms = 1000);
+
+            ~StatsPublisher();
+
+            StatsPublisher(const StatsPublisher &) = delete;
+
+            StatsPublisher &operator=(const StatsPublisher &) = delete;
+
+        private:
+            void run();
+
+            void publish();
+
+            StatsSegmentPtr m_segment;
+            int m_worker_idx;
+            std::function<size_t()> m_queue_depth;
+            int m_interval_ms;
+            std::mutex m_mutex;
+            std::condition_variable m_condition;
+            bool m_is_stopped = false;
+            std::thread m_thread;
+        };
+
+    }// namespace delivery
+}// namespace md
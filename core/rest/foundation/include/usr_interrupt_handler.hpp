@@ -4,6 +4,7 @@
 
 #ifndef USR_INTERRUPT_HANDLER_HPP
 #define USR_INTERRUPT_HANDLER_HPP
+#include <chrono>
 #include <condition_variable>
 #include <mutex>
 #include <iostream>
@@ -11,6 +12,7 @@
 
 static std::condition_variable _condition;
 static std::mutex _mutex;
+static volatile sig_atomic_t _is_interrupted = 0;
 
 namespace cfx {
     class InterruptHandler {
@@ -19,9 +21,14 @@ namespace cfx {
             signal(SIGINT, handleUserInterrupt);
         }
 
+        static void hookSIGTERM() {
+            signal(SIGTERM, handleUserInterrupt);
+        }
+
         static void handleUserInterrupt(int signal){
-            if (signal == SIGINT) {
-                std::cout << "SIGINT trapped ..." << '\n';
+            if (signal == SIGINT || signal == SIGTERM) {
+                std::cout << (signal == SIGINT ? "SIGINT" : "SIGTERM") << " trapped ..." << '\n';
+                _is_interrupted = 1;
                 _condition.notify_one();
             }
         }
@@ -32,6 +39,13 @@ namespace cfx {
             std::cout << "user has signaled to interrup program..." << '\n';
             lock.unlock();
         }
+
+        // true once a signal came, false when the timeout elapsed first; unlike the above it doesn't miss
+        // a signal that came before the call
+        static bool waitForUserInterrupt(std::chrono::milliseconds timeout) {
+            std::unique_lock<std::mutex> lock { _mutex };
+            return _condition.wait_for(lock, timeout, [] { return _is_interrupted != 0; });
+        }
     };
 }
 #endif //USR_INTERRUPT_HANDLER_HPP
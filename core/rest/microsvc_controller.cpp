@@ -2,6 +2,9 @@
 // Created by boa on 13.05.19.
 //
 
+#include <cstdlib>
+#include <limits>
+#include <sstream>
 #include "microsvc_controller.hpp"
 //#include "inc std_micro_service.hpp>
 
@@ -27,6 +30,89 @@ void MicroserviceController::handleGet(http_request message) {
             response["status"] = json::value::string("ready!");
             message.reply(status_codes::OK, response);
         }
+        else if (path.size() > 1 && path[0] == "emails" && path[1] == "count") {
+            if (!_query_executor) {
+                message.reply(status_codes::ServiceUnavailable);
+                return;
+            }
+            // the listener thread returns right away, the reply is sent when the count arrives
+            _query_executor->get_row_count("core.emails").then([message](pplx::task<int> count) {
+                try {
+                    auto response = json::value::object();
+                    response["count"] = json::value::number(count.get());
+                    message.reply(status_codes::OK, response);
+                }
+                catch (std::exception &e) {
+                    auto response = json::value::object();
+                    response["error"] = json::value::string(e.what());
+                    message.reply(status_codes::InternalError, response);
+                }
+            });
+        }
+        else if (path[0] == "metrics") {
+            message.reply(status_codes::OK, renderMetrics(), "text/plain; version=0.0.4");
+        }
+        else if (path[0] == "stats") {
+            if (!_stats_segment) {
+                message.reply(status_codes::ServiceUnavailable);
+                return;
+            }
+            auto response = json::value::object();
+            response["totals"] = countersToJson(_stats_segment->totals());
+            auto workers = json::value::array();
+            for (int idx = 1; idx <= _stats_segment->worker_count(); ++idx) {
+                auto stats = _stats_segment->worker(idx);
+                auto worker = countersToJson(stats.m_counters);
+                worker["worker"] = json::value::number(idx);
+                worker["pid"] = json::value::number(stats.m_pid);
+                worker["heartbeat_age_ms"] = json::value::number(static_cast<int64_t>(stats.m_heartbeat_age_ms));
+                worker["messages_per_second"] = json::value::number(stats.m_messages_per_second);
+                workers[idx - 1] = worker;
+            }
+            response["workers"] = workers;
+            message.reply(status_codes::OK, response);
+        }
+        else if (path[0] == "domains") {
+            // the workers publish their domains to the stats segment, forked ones included
+            auto domains = _stats_segment ? _stats_segment->domains()
+                                          : md::smtp::DomainStatistic::instance().snapshot();
+            auto response = json::value::object();
+            for (const auto &domain : domains) {
+                response[domain.first] = domainToJson(domain.second);
+            }
+            message.reply(status_codes::OK, response);
+        }
+        else if (path[0] == "campaigns") {
+            if (!_campaign_manager) {
+                message.reply(status_codes::ServiceUnavailable);
+                return;
+            }
+            if (path.size() == 1) {
+                auto response = json::value::array();
+                size_t idx = 0;
+                for (const auto &status : _campaign_manager->list()) {
+                    response[idx++] = campaignToJson(status);
+                }
+                message.reply(status_codes::OK, response);
+                return;
+            }
+            int id = 0;
+            if (path.size() == 3 && path[2] == "progress") {
+                // the reply stays open, the shared producer writes to it
+                if (!_progress_stream) {
+                    message.reply(status_codes::ServiceUnavailable);
+                } else if (!campaignId(path, id) || !_progress_stream->subscribe(id, message)) {
+                    message.reply(status_codes::NotFound);
+                }
+                return;
+            }
+            md::delivery::CampaignStatus status;
+            if (campaignId(path, id) && _campaign_manager->status(id, status)) {
+                message.reply(status_codes::OK, campaignToJson(status));
+            } else {
+                message.reply(status_codes::NotFound);
+            }
+        }
     }
     else {
         message.reply(status_codes::NotFound);
@@ -42,11 +128,70 @@ void MicroserviceController::handlePut(http_request message) {
 }
 
 void MicroserviceController::handlePost(http_request message) {
-    message.reply(status_codes::NotImplemented, responseNotImpl(methods::POST));
+    auto path = requestPath(message);
+    if (path.size() != 1 || path[0] != "campaigns") {
+        message.reply(status_codes::NotImplemented, responseNotImpl(methods::POST));
+        return;
+    }
+    if (!_campaign_manager) {
+        message.reply(status_codes::ServiceUnavailable);
+        return;
+    }
+    // {"first_id": 1, "last_id": 100000, "login": "..."}, every field optional: no last_id - up to max(id)
+    auto campaign_manager = _campaign_manager;
+    message.extract_json(true).then([message, campaign_manager](pplx::task<json::value> body) {
+        md::delivery::CampaignRequest request;
+        try {
+            auto fields = body.get();
+            if (!fields.is_null()) {
+                if (fields.has_field("first_id")) {
+                    request.m_range.first = fields.at("first_id").as_integer();
+                }
+                if (fields.has_field("last_id")) {
+                    request.m_range.second = fields.at("last_id").as_integer();
+                }
+                if (fields.has_field("login")) {
+                    request.m_login = fields.at("login").as_string();
+                }
+            }
+        }
+        catch (std::exception &e) {
+            auto response = json::value::object();
+            response["error"] = json::value::string(e.what());
+            message.reply(status_codes::BadRequest, response);
+            return;
+        }
+        auto id = campaign_manager->start(request);
+        if (id == 0) {
+            auto response = json::value::object();
+            response["error"] = json::value::string("the rows overlap those of a running campaign");
+            message.reply(status_codes::Conflict, response);
+            return;
+        }
+        md::delivery::CampaignStatus status;
+        campaign_manager->status(id, status);
+        message.reply(status_codes::Accepted, campaignToJson(status));
+    });
 }
 
 void MicroserviceController::handleDelete(http_request message) {
-    message.reply(status_codes::NotImplemented, responseNotImpl(methods::DEL));
+    auto path = requestPath(message);
+    if (path.empty() || path[0] != "campaigns") {
+        message.reply(status_codes::NotImplemented, responseNotImpl(methods::DEL));
+        return;
+    }
+    if (!_campaign_manager) {
+        message.reply(status_codes::ServiceUnavailable);
+        return;
+    }
+    // the workers stop after the batches they hold, GET campaigns/{id} tells when they did
+    int id = 0;
+    md::delivery::CampaignStatus status;
+    if (campaignId(path, id) && _campaign_manager->cancel(id) && _campaign_manager->status(id, status)) {
+        message.reply(status_codes::Accepted, campaignToJson(status));
+    } else {
+        message.reply(status_codes::NotFound);
+    }
 }
 
 void MicroserviceController::handleHead(http_request message) {
@@ -69,6 +214,170 @@ void MicroserviceController::handleMerge(http_request message) {
     message.reply(status_codes::NotImplemented, responseNotImpl(methods::MERGE));
 }
 
+json::value MicroserviceController::countersToJson(const md::smtp::SmtpCounters & counters) {
+    auto response = json::value::object();
+    for (size_t idx = 0; idx < counters.size(); ++idx) {
+        response[md::smtp::SmtpStatistic::name(static_cast<md::smtp::SMTP_COUNTER>(idx))] =
+                json::value::number(counters[idx]);
+    }
+    return response;
+}
+
+json::value MicroserviceController::domainToJson(const md::smtp::DomainStats & stats) {
+    auto response = json::value::object();
+    response["attempts"] = json::value::number(stats.m_attempts);
+    response["successes"] = json::value::number(stats.m_successes);
+    response["bytes"] = json::value::number(stats.m_bytes);
+    auto reply_codes = json::value::object();
+    for (const auto &reply_code : stats.m_reply_codes) {
+        reply_codes[std::to_string(reply_code.first)] = json::value::number(reply_code.second);
+    }
+    response["reply_codes"] = reply_codes;
+    auto count = stats.m_latency.count();
+    response["latency_avg_us"] = json::value::number(count ? stats.m_latency.m_sum_us / count : 0);
+    response["latency_p50_us"] = json::value::number(stats.m_latency.percentile(0.5));
+    response["latency_p99_us"] = json::value::number(stats.m_latency.percentile(0.99));
+    return response;
+}
+
+json::value MicroserviceController::campaignToJson(const md::delivery::CampaignStatus & status) {
+    auto response = json::value::object();
+    response["id"] = json::value::number(status.m_id);
+    response["state"] = json::value::string(md::delivery::campaign_state_name(status.m_state));
+    response["first_id"] = json::value::number(status.m_request.m_range.first);
+    response["last_id"] = json::value::number(status.m_request.m_range.second);
+    response["login"] = json::value::string(status.m_request.m_login);
+    response["scanned"] = json::value::number(status.m_scanned);
+    response["fetched"] = json::value::number(status.m_fetched);
+    response["sent"] = json::value::number(status.m_sent);
+    response["failed"] = json::value::number(status.m_failed);
+    response["deferred"] = json::value::number(status.m_deferred);
+    response["elapsed_ms"] = json::value::number(status.m_elapsed_ms);
+    if (!status.m_error.empty()) {
+        response["error"] = json::value::string(status.m_error);
+    }
+    return response;
+}
+
+bool MicroserviceController::campaignId(const std::vector<utility::string_t> & path, int & id) {
+    if (path.size() < 2 || path[1].empty()) {
+        return false;
+    }
+    char *end = nullptr;
+    auto value = std::strtol(path[1].c_str(), &end, 10);
+    if (*end != '\0' || value <= 0 || value > std::numeric_limits<int>::max()) {
+        return false;
+    }
+    id = static_cast<int>(value);
+    return true;
+}
+
+std::string MicroserviceController::renderMetrics() const {
+    using md::smtp::SMTP_COUNTER;
+    using md::smtp::SMTP_PHASE;
+    using md::smtp::SmtpStatistic;
+    using md::smtp::LatencyHistogram;
+
+    // everything below is read from atomics, a scrape never waits on a worker
+    std::ostringstream out;
+    // bucket bounds like 4.194304 must not be rounded below the values they count
+    out.precision(10);
+    std::vector<std::pair<std::string, md::smtp::SmtpCounters>> workers;
+    if (_stats_segment) {
+        for (int idx = 1; idx <= _stats_segment->worker_count(); ++idx) {
+            workers.emplace_back("worker=\"" + std::to_string(idx) + "\"", _stats_segment->worker(idx).m_counters);
+        }
+    } else {
+        workers.emplace_back("worker=\"1\"", SmtpStatistic::instance().snapshot());
+    }
+    auto counterValue = [](const md::smtp::SmtpCounters & counters, SMTP_COUNTER counter) {
+        return counters[static_cast<size_t>(counter)];
+    };
+
+    out << "# HELP md_messages_total Delivery outcomes per recipient.\n"
+        << "# TYPE md_messages_total counter\n";
+    for (const auto & worker : workers) {
+        for (auto counter : {SMTP_COUNTER::SENT, SMTP_COUNTER::FAILED, SMTP_COUNTER::DEFERRED}) {
+            out << "md_messages_total{" << worker.first << ",status=\"" << SmtpStatistic::name(counter) << "\"} "
+                << counterValue(worker.second, counter) << "\n";
+        }
+    }
+    const std::pair<SMTP_COUNTER, const char *> smtpCounters[] = {
+            {SMTP_COUNTER::BYTES,          "md_smtp_bytes_total Bytes written to SMTP servers."},
+            {SMTP_COUNTER::CONNECTIONS,    "md_smtp_connections_total TCP connections opened to SMTP servers."},
+            {SMTP_COUNTER::TLS_HANDSHAKES, "md_smtp_tls_handshakes_total Completed TLS handshakes."}};
+    for (const auto & smtpCounter : smtpCounters) {
+        std::string help = smtpCounter.second;
+        auto name = help.substr(0, help.find(' '));
+        out << "# HELP " << help << "\n# TYPE " << name << " counter\n";
+        for (const auto & worker : workers) {
+            out << name << "{" << worker.first << "} " << counterValue(worker.second, smtpCounter.first) << "\n";
+        }
+    }
+
+    if (_stats_segment) {
+        out << "# HELP md_worker_heartbeat_age_seconds Time since the worker last published, -1 if never.\n"
+            << "# TYPE md_worker_heartbeat_age_seconds gauge\n";
+        for (int idx = 1; idx <= _stats_segment->worker_count(); ++idx) {
+            auto age = _stats_segment->worker(idx).m_heartbeat_age_ms;
+            out << "md_worker_heartbeat_age_seconds{worker=\"" << idx << "\"} "
+                << (age < 0 ? -1.0 : age / 1000.0) << "\n";
+        }
+        out << "# HELP md_worker_messages_per_second Messages processed over the last publish interval.\n"
+            << "# TYPE md_worker_messages_per_second gauge\n";
+        for (int idx = 1; idx <= _stats_segment->worker_count(); ++idx) {
+            out << "md_worker_messages_per_second{worker=\"" << idx << "\"} "
+                << _stats_segment->worker(idx).m_messages_per_second << "\n";
+        }
+        out << "# HELP md_worker_prefetch_queue_depth Batches fetched ahead of the sender.\n"
+            << "# TYPE md_worker_prefetch_queue_depth gauge\n";
+        for (int idx = 1; idx <= _stats_segment->worker_count(); ++idx) {
+            out << "md_worker_prefetch_queue_depth{worker=\"" << idx << "\"} "
+                << _stats_segment->worker(idx).m_queue_depth << "\n";
+        }
+    }
+
+    // histograms live in process memory, they cover the worker running in this process
+    out << "# HELP md_smtp_phase_duration_seconds Latency of the SMTP protocol phases of this process.\n"
+        << "# TYPE md_smtp_phase_duration_seconds histogram\n";
+    for (int phase = 0; phase < static_cast<int>(SMTP_PHASE::COUNT); ++phase) {
+        auto phaseName = SmtpStatistic::name(static_cast<SMTP_PHASE>(phase));
+        auto latency = SmtpStatistic::instance().latency(static_cast<SMTP_PHASE>(phase));
+        // one bucket per power of two up to ~134 s, finer than that is noise for a scrape
+        uint64_t cumulative = 0;
+        for (size_t idx = 0; idx < LatencyHistogram::BUCKET_COUNT; ++idx) {
+            cumulative += latency.m_buckets[idx];
+            auto bound = LatencyHistogram::upper_bound(idx) + 1;
+            if (idx % LatencyHistogram::SUB_BUCKETS == LatencyHistogram::SUB_BUCKETS - 1 && bound <= (1ull << 27)) {
+                out << "md_smtp_phase_duration_seconds_bucket{phase=\"" << phaseName << "\",le=\""
+                    << bound / 1e6 << "\"} " << cumulative << "\n";
+            }
+        }
+        out << "md_smtp_phase_duration_seconds_bucket{phase=\"" << phaseName << "\",le=\"+Inf\"} "
+            << cumulative << "\n"
+            << "md_smtp_phase_duration_seconds_sum{phase=\"" << phaseName << "\"} "
+            << latency.m_sum_us / 1e6 << "\n"
+            << "md_smtp_phase_duration_seconds_count{phase=\"" << phaseName << "\"} " << cumulative << "\n";
+    }
+
+    if (_query_executor) {
+        auto backend = _query_executor->backend();
+        out << "# HELP md_db_pool_connections Database connections of this process by pool and state.\n"
+            << "# TYPE md_db_pool_connections gauge\n"
+            << "md_db_pool_connections{pool=\"primary\",state=\"idle\"} " << backend->idle_connections() << "\n"
+            << "md_db_pool_connections{pool=\"primary\",state=\"in_use\"} "
+            << backend->pool_size() - backend->idle_connections() << "\n"
+            << "md_db_pool_connections{pool=\"replica\",state=\"idle\"} "
+            << backend->replica_idle_connections() << "\n"
+            << "md_db_pool_connections{pool=\"replica\",state=\"in_use\"} "
+            << backend->replica_pool_size() - backend->replica_idle_connections() << "\n"
+            << "# HELP md_async_query_queue_depth REST queries waiting for a database connection.\n"
+            << "# TYPE md_async_query_queue_depth gauge\n"
+            << "md_async_query_queue_depth " << _query_executor->queued() << "\n";
+    }
+    return out.str();
+}
+
 json::value MicroserviceController::responseNotImpl(const http::method & method) {
     auto response = json::value::object();
     response["serviceName"] = json::value::string("C++ Mircroservice Sample");
@@ -8,6 +8,11 @@
 
 #include "foundation/include/basic_controller.hpp"
 #include "foundation/include/controller.hpp"
+#include "../database/async_query_executor.hpp"
+#include "../delivery/campaign_manager.hpp"
+#include "../delivery/stats_segment.hpp"
+#include "../smtp/domain_statistic.hpp"
+#include "progress_stream.hpp"
 
 using namespace cfx;
 
@@ -27,7 +32,44 @@ public:
     void handleMerge(http_request message) override;
     void initRestOpHandlers() override;
 
+    // database access of the handlers, they answer 503 without it
+    void setQueryExecutor(md::db::AsyncQueryExecutorPtr query_executor) {
+        _query_executor = std::move(query_executor);
+    }
+
+    // delivery counters of the worker processes for GET stats
+    void setStatsSegment(md::delivery::StatsSegmentPtr stats_segment) {
+        _stats_segment = std::move(stats_segment);
+    }
+
+    // campaigns sent by this process, POST/GET/DELETE campaigns answer 503 without it
+    void setCampaignManager(md::delivery::CampaignManagerPtr campaign_manager) {
+        _campaign_manager = std::move(campaign_manager);
+    }
+
+    // GET campaigns/{id}/progress, answers 503 without it
+    void setProgressStream(md::rest::ProgressStreamPtr progress_stream) {
+        _progress_stream = std::move(progress_stream);
+    }
+
 private:
+    md::db::AsyncQueryExecutorPtr _query_executor;
+    md::delivery::StatsSegmentPtr _stats_segment;
+    md::delivery::CampaignManagerPtr _campaign_manager;
+    md::rest::ProgressStreamPtr _progress_stream;
+
+    static json::value countersToJson(const md::smtp::SmtpCounters & counters);
+
+    static json::value domainToJson(const md::smtp::DomainStats & stats);
+
+    static json::value campaignToJson(const md::delivery::CampaignStatus & status);
+
+    // the campaign id of a campaigns/{id} path, false if there is none
+    static bool campaignId(const std::vector<utility::string_t> & path, int & id);
+
+    // Prometheus text exposition of the delivery counters, latencies, pool and queue gauges
+    std::string renderMetrics() const;
+
     static json::value responseNotImpl(const http::method & method);
 };
 
@@ -0,0 +1,179 @@
+#include <algorithm>
+#include <chrono>
+#include "progress_stream.hpp"
+
+namespace md
+{
+    namespace rest
+    {
+        using namespace web;
+        using namespace web::http;
+        using delivery::CAMPAIGN_STATE;
+        using delivery::CampaignStatus;
+
+        namespace
+        {
+            // lines a client has not read yet, a dashboard that stopped reading is dropped past this
+            const size_t MAX_BUFFERED_BYTES = 64 * 1024;
+
+            uint64_t processed(const CampaignStatus &status)
+            {
+                return status.m_sent + status.m_failed + status.m_deferred;
+            }
+        }
+
+        ProgressStream::ProgressStream(delivery::CampaignManagerPtr campaign_manager, int interval_ms)
+                : m_campaign_manager(std::move(campaign_manager))
+                  , m_interval_ms(interval_ms > 0 ? interval_ms : 1000)
+        {
+            m_thread = std::thread(&ProgressStream::run, this);
+        }
+
+        ProgressStream::~ProgressStream()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_is_stopped = true;
+            }
+            m_condition.notify_one();
+            m_thread.join();
+            for (auto &feed : m_feeds) {
+                for (auto &subscriber : feed.second.m_subscribers) {
+                    close(subscriber);
+                }
+            }
+        }
+
+        bool ProgressStream::subscribe(int campaign_id, const http_request &message)
+        {
+            CampaignStatus status;
+            if (!m_campaign_manager->status(campaign_id, status)) {
+                return false;
+            }
+            auto subscriber = std::make_shared<Subscriber>();
+            http_response response(status_codes::OK);
+            // no content length, cpprest sends the body in chunks as the buffer fills
+            response.set_body(subscriber->m_buffer.create_istream(), "application/x-ndjson");
+            message.reply(response).then([subscriber](pplx::task<void> reply) {
+                try {
+                    reply.get();
+                }
+                catch (std::exception &) {
+                    // the client went away, the producer drops the subscriber on its next line
+                }
+                subscriber->m_is_closed = true;
+            });
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto it = m_feeds.find(campaign_id);
+            if (it == m_feeds.end()) {
+                if (status.m_state != CAMPAIGN_STATE::RUNNING) {
+                    write(subscriber, std::make_shared<std::string>(progress_line(status, CampaignStatus())));
+                    close(subscriber);
+                    return true;
+                }
+                it = m_feeds.emplace(campaign_id, Feed()).first;
+                it->second.m_last = status;
+            }
+            // the totals as of the feed's last line, so the deltas of the following lines add up to the counters
+            write(subscriber, std::make_shared<std::string>(progress_line(it->second.m_last, CampaignStatus())));
+            it->second.m_subscribers.push_back(subscriber);
+            return true;
+        }
+
+        void ProgressStream::run()
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            while (!m_condition.wait_for(lock, std::chrono::milliseconds(m_interval_ms), [this] {
+                return m_is_stopped;
+            })) {
+                lock.unlock();
+                publish();
+                lock.lock();
+            }
+        }
+
+        void ProgressStream::publish()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (auto it = m_feeds.begin(); it != m_feeds.end();) {
+                auto &subscribers = it->second.m_subscribers;
+                subscribers.erase(std::remove_if(subscribers.begin(), subscribers.end()
+                                                 , [](const SubscriberPtr &subscriber) {
+                            return subscriber->m_is_closed.load();
+                        }), subscribers.end());
+                CampaignStatus status;
+                if (subscribers.empty() || !m_campaign_manager->status(it->first, status)) {
+                    for (auto &subscriber : subscribers) {
+                        close(subscriber);
+                    }
+                    it = m_feeds.erase(it);
+                    continue;
+                }
+
+                // serialized once for every client of the campaign
+                auto line = std::make_shared<std::string>(progress_line(status, it->second.m_last));
+                it->second.m_last = status;
+                for (auto &subscriber : subscribers) {
+                    if (subscriber->m_buffer.in_avail() > MAX_BUFFERED_BYTES) {
+                        close(subscriber);
+                    } else {
+                        write(subscriber, line);
+                    }
+                }
+                if (status.m_state != CAMPAIGN_STATE::RUNNING) {
+                    for (auto &subscriber : subscribers) {
+                        close(subscriber);
+                    }
+                    it = m_feeds.erase(it);
+                    continue;
+                }
+                ++it;
+            }
+        }
+
+        std::string ProgressStream::progress_line(const CampaignStatus &status, const CampaignStatus &previous)
+        {
+            auto line = json::value::object();
+            line["id"] = json::value::number(status.m_id);
+            line["state"] = json::value::string(delivery::campaign_state_name(status.m_state));
+            line["elapsed_ms"] = json::value::number(status.m_elapsed_ms);
+            line["sent"] = json::value::number(status.m_sent - previous.m_sent);
+            line["failed"] = json::value::number(status.m_failed - previous.m_failed);
+            line["deferred"] = json::value::number(status.m_deferred - previous.m_deferred);
+            auto interval_ms = status.m_elapsed_ms - previous.m_elapsed_ms;
+            auto rate = interval_ms > 0 ? (processed(status) - processed(previous)) * 1000.0 / interval_ms : 0.0;
+            line["rate"] = json::value::number(rate);
+            // the rows of the whole range are estimated from the share of its ids read so far
+            auto ids = static_cast<int64_t>(status.m_request.m_range.second) - status.m_request.m_range.first + 1;
+            if (status.m_state == CAMPAIGN_STATE::RUNNING && rate > 0 && status.m_scanned > 0 && ids > 0) {
+                auto rows = static_cast<double>(status.m_fetched) * ids / status.m_scanned;
+                line["eta_s"] = json::value::number(std::max(rows - processed(status), 0.0) / rate);
+            }
+            return line.serialize() + "\n";
+        }
+
+        void ProgressStream::write(const SubscriberPtr &subscriber, const std::shared_ptr<std::string> &line)
+        {
+            // the line has to outlive the write
+            subscriber->m_buffer.putn_nocopy(reinterpret_cast<const uint8_t *>(line->data()), line->size())
+                    .then([line](pplx::task<size_t> written) {
+                        try {
+                            written.get();
+                        }
+                        catch (std::exception &) {
+                        }
+                    });
+        }
+
+        void ProgressStream::close(const SubscriberPtr &subscriber)
+        {
+            subscriber->m_is_closed = true;
+            if (subscriber->m_buffer.can_write()) {
+                // ends the chunked body
+                subscriber->m_buffer.close(std::ios_base::out);
+            }
+        }
+
+    }// namespace rest
+}// namespace md
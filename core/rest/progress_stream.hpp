@@ -0,0 +1,79 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cpprest/http_msg.h>
+#include <cpprest/producerconsumerstream.h>
+#include "../delivery/campaign_manager.hpp"
+
+namespace md
+{
+    namespace rest
+    {
+        /**
+         * Live progress of the campaigns as chunked HTTP responses, one compact JSON object per line.
+         * A single thread reads the counters of the watched campaigns every interval_ms and serializes
+         * one line per campaign, which every subscriber of that campaign gets; the cost does not grow with
+         * the clients beyond the write. The first line of a subscriber carries the totals so far, the
+         * later ones what changed since the previous line, with the current rate and ETA. The stream ends
+         * after the line of a finished campaign; a client which stops reading is dropped.
+         */
+        class ProgressStream
+        {
+        public:
+            ProgressStream(delivery::CampaignManagerPtr campaign_manager, int interval_ms);
+
+            ~ProgressStream();
+
+            ProgressStream(const ProgressStream &) = delete;
+
+            ProgressStream &operator=(const ProgressStream &) = delete;
+
+            // replies to the request with the progress of the campaign, false - no such campaign
+            bool subscribe(int campaign_id, const web::http::http_request &message);
+
+        private:
+            struct Subscriber
+            {
+                Concurrency::streams::producer_consumer_buffer<uint8_t> m_buffer;
+                std::atomic<bool> m_is_closed{false};// the response is over or the client went away
+            };
+
+            using SubscriberPtr = std::shared_ptr<Subscriber>;
+
+            struct Feed
+            {
+                delivery::CampaignStatus m_last;// as of the previous line
+                std::vector<SubscriberPtr> m_subscribers;
+            };
+
+            void run();
+
+            void publish();
+
+            // status relative to previous, elapsed_ms is the time between the two
+            static std::string progress_line(const delivery::CampaignStatus &status
+                                             , const delivery::CampaignStatus &previous);
+
+            static void write(const SubscriberPtr &subscriber, const std::shared_ptr<std::string> &line);
+
+            static void close(const SubscriberPtr &subscriber);
+
+            delivery::CampaignManagerPtr m_campaign_manager;
+            int m_interval_ms;
+            std::mutex m_mutex;
+            std::condition_variable m_condition;
+            bool m_is_stopped = false;
+            std::map<int, Feed> m_feeds;// campaign id -> its subscribers
+            std::thread m_thread;
+        };
+
+        using ProgressStreamPtr = std::shared_ptr<ProgressStream>;
+
+    }// namespace rest
+}// namespace md
@@ -0,0 +1,87 @@
+#include "domain_statistic.hpp"
+
+namespace md
+{
+    namespace smtp
+    {
+        const char *const DomainStatistic::OTHER_DOMAIN = "*";
+
+        void DomainStats::merge(const DomainStats &other)
+        {
+            m_attempts += other.m_attempts;
+            m_successes += other.m_successes;
+            m_bytes += other.m_bytes;
+            for (const auto &reply_code : other.m_reply_codes) {
+                m_reply_codes[reply_code.first] += reply_code.second;
+            }
+            for (size_t idx = 0; idx < LatencyHistogram::BUCKET_COUNT; ++idx) {
+                m_latency.m_buckets[idx] += other.m_latency.m_buckets[idx];
+            }
+            m_latency.m_sum_us += other.m_latency.m_sum_us;
+        }
+
+        DomainStatistic &DomainStatistic::instance()
+        {
+            static DomainStatistic statistic;
+            return statistic;
+        }
+
+        void DomainStatistic::add_reply(const std::string &domain, int reply_code)
+        {
+            auto &stripe = m_stripes[std::hash<std::string>()(domain) % STRIPE_COUNT];
+            std::lock_guard<std::mutex> lock(stripe.m_mutex);
+            ++stats(stripe, domain).m_reply_codes[reply_code];
+        }
+
+        void DomainStatistic::add_attempt(const std::string &domain, bool is_sent, uint64_t bytes, uint64_t micros)
+        {
+            auto &stripe = m_stripes[std::hash<std::string>()(domain) % STRIPE_COUNT];
+            std::lock_guard<std::mutex> lock(stripe.m_mutex);
+            auto &domain_stats = stats(stripe, domain);
+            ++domain_stats.m_attempts;
+            if (is_sent) {
+                ++domain_stats.m_successes;
+            }
+            domain_stats.m_bytes += bytes;
+            ++domain_stats.m_latency.m_buckets[LatencyHistogram::bucket(micros)];
+            domain_stats.m_latency.m_sum_us += micros;
+        }
+
+        std::vector<std::pair<std::string, DomainStats>> DomainStatistic::snapshot() const
+        {
+            std::vector<std::pair<std::string, DomainStats>> domains;
+            DomainStats other;
+            bool has_other = false;
+            for (const auto &stripe : m_stripes) {
+                std::lock_guard<std::mutex> lock(stripe.m_mutex);
+                for (const auto &domain : stripe.m_domains) {
+                    if (domain.first != OTHER_DOMAIN) {
+                        domains.push_back(domain);
+                        continue;
+                    }
+                    has_other = true;
+                    other.merge(domain.second);
+                }
+            }
+            if (has_other) {
+                domains.emplace_back(OTHER_DOMAIN, std::move(other));
+            }
+            return domains;
+        }
+
+        DomainStats &DomainStatistic::stats(Stripe &stripe, const std::string &domain)
+        {
+            auto it = stripe.m_domains.find(domain);
+            if (it != stripe.m_domains.end()) {
+                return it->second;
+            }
+            if (m_domain_count.fetch_add(1, std::memory_order_relaxed) < MAX_DOMAINS) {
+                return stripe.m_domains[domain];
+            }
+            m_domain_count.fetch_sub(1, std::memory_order_relaxed);
+            // every stripe keeps OTHER_DOMAIN of its own, snapshot() merges them
+            return stripe.m_domains[OTHER_DOMAIN];
+        }
+
+    }// namespace smtp
+}// namespace md
@@ -0,0 +1,67 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "smtp_statistic.hpp"
+
+namespace md
+{
+    namespace smtp
+    {
+        struct DomainStats
+        {
+            uint64_t m_attempts = 0;// message transactions
+            uint64_t m_successes = 0;// transactions the server accepted
+            uint64_t m_bytes = 0;
+            std::map<int, uint64_t> m_reply_codes;// every reply of the server, greeting to QUIT
+            LatencyHistogram m_latency;// transaction duration, connecting included
+
+            // adds the counts of another domain or process
+            void merge(const DomainStats &other);
+        };
+
+        /**
+         * Delivery health per recipient domain of this process. The table is split into stripes with
+         * a lock each, a domain always lands in the same stripe, so threads sending to different
+         * domains rarely share a lock. Domains beyond MAX_DOMAINS are counted under OTHER_DOMAIN.
+         */
+        class DomainStatistic
+        {
+        public:
+            static const size_t MAX_DOMAINS = 4096;
+            static const char *const OTHER_DOMAIN;
+
+            static DomainStatistic &instance();
+
+            void add_reply(const std::string &domain, int reply_code);
+
+            void add_attempt(const std::string &domain, bool is_sent, uint64_t bytes, uint64_t micros);
+
+            // copies of all domains, every domain is consistent in itself
+            std::vector<std::pair<std::string, DomainStats>> snapshot() const;
+
+        private:
+            static const size_t STRIPE_COUNT = 64;
+
+            struct alignas(64) Stripe
+            {
+                mutable std::mutex m_mutex;
+                std::unordered_map<std::string, DomainStats> m_domains;
+            };
+
+            DomainStatistic() = default;
+
+            // called with the stripe locked
+            DomainStats &stats(Stripe &stripe, const std::string &domain);
+
+            std::array<Stripe, STRIPE_COUNT> m_stripes;
+            std::atomic<size_t> m_domain_count{0};
+        };
+
+    }// namespace smtp
+}// namespace md
@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <cctype>
 #include <cstring>
 #include "smtp_common.hpp"
 #include "smtp_server.hpp"
@@ -42,6 +43,23 @@ namespace md
         }
 
 
+        int parse_reply_code(const std::string &response)
+        {
+            size_t begin = 0;
+            while (true) {
+                auto end = response.find("\r\n", begin);
+                if (end == std::string::npos) {
+                    return -1;
+                }
+                // the last line must match the pattern: XYZ<SP>*<CRLF> or XYZ<CRLF> where XYZ is a string of 3 digits
+                if (end - begin >= 3 && isdigit(response[begin]) && isdigit(response[begin + 1])
+                    && isdigit(response[begin + 2]) && (end - begin == 3 || response[begin + 3] == ' ')) {
+                    return (response[begin] - '0') * 100 + (response[begin + 1] - '0') * 10 + response[begin + 2] - '0';
+                }
+                begin = end + 2;
+            }
+        }
+
         bool is_keyword_supported(const char *response, const char *keyword)
         {
             assert(response != nullptr && keyword != nullptr);
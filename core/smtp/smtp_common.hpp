@@ -99,6 +99,9 @@ namespace md
 // A simple string match
         bool is_keyword_supported(const char *response, const char *keyword);
 
+        // code of a complete (multiline) server reply, -1 while its last line hasn't arrived
+        int parse_reply_code(const std::string &response);
+
         unsigned char *char2uchar(const char *strIn);
 
 
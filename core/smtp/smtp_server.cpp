@@ -1,5 +1,7 @@
+#include <algorithm>
 #include <utility>
 #include <zconf.h>
+#include <netinet/tcp.h>
 #include <vector>
 #include "smtp_server.hpp"
 #include "base_64.hpp"
@@ -8,6 +10,7 @@
 #include <cassert>
 #include "base_64.hpp"
 #include "smtp_exception.hpp"
+#include "../../tools/probes/probes.hpp"
 
 using namespace md::smtp;
 namespace md
@@ -28,6 +31,9 @@ namespace md
                 , m_bHTML(false)
                 , m_is_read_receipt(true)
                 , m_charset("US-ASCII")
+                , m_last_reply_code(0)
+                , m_is_bulk(false)
+                , m_transaction_bytes(0)
         {
 
 
@@ -183,7 +189,38 @@ namespace md
 ////////////////////////////////////////////////////////////////////////////////
         bool SmtpServer::send_mail()
         {
-            m_statistic.m_total_send_count++;// increment total count of sending messages
+            m_domain.clear();
+            if (!m_recipients.empty()) {
+                const auto &mail = m_recipients.front().m_mail;
+                auto pos = mail.find_last_of('@');
+                m_domain = pos == std::string::npos ? std::string() : mail.substr(pos + 1);
+                std::transform(m_domain.begin(), m_domain.end(), m_domain.begin(), ::tolower);
+            }
+            m_transaction_bytes = 0;
+            auto start = std::chrono::steady_clock::now();
+            auto add_attempt = [&](bool is_sent) {
+                if (m_domain.empty()) {
+                    return;
+                }
+                DomainStatistic::instance().add_attempt(m_domain, is_sent, m_transaction_bytes, static_cast<uint64_t>(
+                        std::chrono::duration_cast<std::chrono::microseconds>(
+                                std::chrono::steady_clock::now() - start).count()));
+            };
+            try {
+                auto is_sent = send_transaction();
+                add_attempt(is_sent);
+                return is_sent;
+            }
+            catch (...) {
+                add_attempt(false);
+                throw;
+            }
+        }
+
+        bool SmtpServer::send_transaction()
+        {
+            m_recipient_reply_codes.clear();
+            m_last_reply_code = 0;
             unsigned int res;
             char *file_buffer = nullptr;
             FILE *hFile = nullptr;
@@ -240,6 +277,7 @@ namespace md
                 // MAIL <SP> FROM:<reverse-path> <CRLF>
                 if (m_mail_from.empty())
                     throw SmtpException(SmtpException::UNDEF_MAIL_FROM);
+                auto phase_start = std::chrono::steady_clock::now();
                 Command_Entry *pEntry = find_command_entry(command_MAILFROM);
                 snprintf(m_send_buffer, BUFFER_SIZE, "MAIL FROM:<%s>\r\n", m_mail_from.c_str());
                 send_data(pEntry);
@@ -249,11 +287,25 @@ namespace md
                 if (!(m_recipients.size()))
                     throw SmtpException(SmtpException::UNDEF_RECIPIENTS);
                 pEntry = find_command_entry(command_RCPTTO);
-                for (auto &recipient : m_recipients) {
-                    snprintf(m_send_buffer, BUFFER_SIZE, "RCPT TO:<%s>\r\n", (recipient.m_mail).c_str());
+                m_recipient_reply_codes.assign(m_recipients.size(), 0);
+                size_t accepted_count = 0;
+                for (size_t i = 0; i < m_recipients.size(); i++) {
+                    snprintf(m_send_buffer, BUFFER_SIZE, "RCPT TO:<%s>\r\n", (m_recipients[i].m_mail).c_str());
                     send_data(pEntry);
-                    receive_response(pEntry);
+                    m_last_reply_code = 0;
+                    try {
+                        receive_response(pEntry);
+                        ++accepted_count;
+                    }
+                    catch (const SmtpException &) {
+                        // the server answered and rejected this recipient, the others may still get the message
+                        if (!m_is_bulk || m_last_reply_code == 0)
+                            throw;
+                    }
+                    m_recipient_reply_codes[i] = m_last_reply_code;
                 }
+                if (accepted_count == 0)
+                    throw SmtpException(SmtpException::COMMAND_RCPT_TO);
 
                 for (auto &cc_recipient : m_cc_recipients) {
                     snprintf(m_send_buffer, BUFFER_SIZE, "RCPT TO:<%s>\r\n", (cc_recipient.m_mail).c_str());
@@ -267,6 +319,9 @@ namespace md
                     receive_response(pEntry);
                 }
 
+                record_latency(SMTP_PHASE::ENVELOPE, phase_start);
+
+                phase_start = std::chrono::steady_clock::now();
                 pEntry = find_command_entry(command_DATA);
                 // DATA <CRLF>
                 snprintf(m_send_buffer, BUFFER_SIZE, "DATA\r\n");
@@ -356,7 +411,12 @@ namespace md
                 // <CRLF> . <CRLF>
                 snprintf(m_send_buffer, BUFFER_SIZE, "\r\n.\r\n");
                 send_data(pEntry);
+                record_latency(SMTP_PHASE::DATA, phase_start);
+
+                // the time the server takes to accept the message
+                phase_start = std::chrono::steady_clock::now();
                 receive_response(pEntry);
+                record_latency(SMTP_PHASE::FINAL_REPLY, phase_start);
                 return true;
             }
             catch (const SmtpException &) {
@@ -394,6 +454,11 @@ namespace md
                 if ((m_socket = socket(PF_INET, SOCK_STREAM, 0)) == INVALID_SOCKET)
                     throw SmtpException(SmtpException::WSA_INVALID_SOCKET);
 
+                // a command is written in pieces (DATA in header, lines and terminator), Nagle would hold
+                // the last piece until the server's delayed ACK
+                int no_delay = 1;
+                setsockopt(m_socket, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+
                 if (port != 0)
                     port_number = htons(port);
                 else {
@@ -406,7 +471,9 @@ namespace md
                 if ((sockAddr.sin_addr.s_addr = inet_addr(szServer)) == INADDR_NONE) {
                     LPHOSTENT host;
 
+                    auto dns_start = std::chrono::steady_clock::now();
                     host = gethostbyname(szServer);
+                    record_latency(SMTP_PHASE::DNS, dns_start);
                     if (host)
                         memcpy(&sockAddr.sin_addr, host->h_addr_list[0], host->h_length);
                     else {
@@ -422,14 +489,18 @@ namespace md
                     throw SmtpException(SmtpException::WSA_IOCTLSOCKET);
                 }
 
+                auto phase_start = std::chrono::steady_clock::now();
                 if (connect(m_socket, (LPSOCKADDR) &sockAddr, sizeof(sockAddr)) == SOCKET_ERROR) {
                     if (errno != EINPROGRESS)
                     {
                         close(m_socket);
                         throw SmtpException(SmtpException::WSA_CONNECT);
                     }
-                } else
+                } else {
+                    record_latency(SMTP_PHASE::CONNECT, phase_start);
+                    count(SMTP_COUNTER::CONNECTIONS);
                     return true;
+                }
 
                 while (true) {
                     FD_ZERO(&fdwrite);
@@ -457,17 +528,23 @@ namespace md
 
                 FD_CLR(m_socket, &fdwrite);
                 FD_CLR(m_socket, &fdexcept);
+                record_latency(SMTP_PHASE::CONNECT, phase_start);
+                count(SMTP_COUNTER::CONNECTIONS);
 
                 if (securityType != DO_NOT_SET) set_security_type(securityType);
                 if (get_security_type() == USE_TLS || get_security_type() == USE_SSL) {
                     init_open_ssl();
                     if (get_security_type() == USE_SSL) {
+                        phase_start = std::chrono::steady_clock::now();
                         open_ssl_connect();
+                        record_latency(SMTP_PHASE::TLS_HANDSHAKE, phase_start);
                     }
                 }
 
                 Command_Entry *pEntry = find_command_entry(command_INIT);
+                phase_start = std::chrono::steady_clock::now();
                 receive_response(pEntry);
+                record_latency(SMTP_PHASE::GREETING, phase_start);
 
                 say_hello();
 
@@ -478,6 +555,7 @@ namespace md
 
                 if (is_keyword_supported(m_receive_buffer, "AUTH")) {
                     if (authenticate) {
+                        phase_start = std::chrono::steady_clock::now();
                         if (login) {
                             set_login(login);
                         }
@@ -786,6 +864,7 @@ namespace md
                             receive_response(pEntry);
                         } else
                             throw SmtpException(SmtpException::LOGIN_NOT_SUPPORTED);
+                        record_latency(SMTP_PHASE::AUTH, phase_start);
                     }
                 }
             }
@@ -804,7 +883,15 @@ namespace md
         void SmtpServer::disconnect_remote_server()
         {
             if (m_bConnected) {
-                say_quit();
+                // the reply to QUIT must not hide the one the transaction failed on
+                auto reply_code = m_last_reply_code;
+                try {
+                    say_quit();
+                }
+                catch (const SmtpException &) {
+                    // the socket is closed anyway, the error that got us here is the one to report
+                }
+                m_last_reply_code = reply_code;
             }
 
             if (m_socket) {
@@ -839,7 +926,9 @@ namespace md
                 throw SmtpException(SmtpException::TIME_ERROR);
 
             // check for at least one recipient
-            if (!m_recipients.empty()) {
+            if (m_is_bulk && m_recipients.size() > 1) {
+                to = "undisclosed-recipients:;";
+            } else if (!m_recipients.empty()) {
                 for (auto i = 0; i < m_recipients.size(); i++) {
                     if (i > 0)
                         to.append(",");
@@ -952,23 +1041,23 @@ namespace md
                 strcat(header, m_charset.c_str());
                 strcat(header, "\"\r\n");
                 strcat(header, "Content-Transfer-Encoding: 7bit\r\n");
-                strcat(m_send_buffer, "\r\n");
+                strcat(header, "\r\n");
             } else { // there is one or more attachments
                 strcat(header, "Content-Type: multipart/mixed; boundary=\"");
                 strcat(header, BOUNDARY_TEXT);
                 strcat(header, "\"\r\n");
                 strcat(header, "\r\n");
                 // first goes text message
-                strcat(m_send_buffer, "--");
-                strcat(m_send_buffer, BOUNDARY_TEXT);
-                strcat(m_send_buffer, "\r\n");
-                strcat(m_send_buffer,
+                strcat(header, "--");
+                strcat(header, BOUNDARY_TEXT);
+                strcat(header, "\r\n");
+                strcat(header,
                        m_bHTML ? "Content-type: text/html; charset=" : "Content-type: text/plain; charset=");
 
                 strcat(header, m_charset.c_str());
                 strcat(header, "\r\n");
-                strcat(m_send_buffer, "Content-Transfer-Encoding: 7bit\r\n");
-                strcat(m_send_buffer, "\r\n");
+                strcat(header, "Content-Transfer-Encoding: 7bit\r\n");
+                strcat(header, "\r\n");
             }
 
             // done
@@ -1026,6 +1115,7 @@ namespace md
 ////////////////////////////////////////////////////////////////////////////////
         void SmtpServer::send_data(Command_Entry *pEntry)
         {
+            MD_PROBE1(smtp_command, m_send_buffer);
             if (m_ssl != nullptr) {
                 send_data_ssl(m_ssl, pEntry);
                 return;
@@ -1068,6 +1158,8 @@ namespace md
                     }
                     nLeft -= res;
                     idx += res;
+                    count(SMTP_COUNTER::BYTES, res);
+                    m_transaction_bytes += res;
                 }
             }
 
@@ -1164,10 +1256,12 @@ namespace md
 
         void SmtpServer::say_hello()
         {
+            auto start = std::chrono::steady_clock::now();
             Command_Entry *pEntry = find_command_entry(command_EHLO);
             snprintf(m_send_buffer, BUFFER_SIZE, "EHLO %s\r\n", get_local_hostname() != nullptr ? m_local_hostname.c_str() : "domain");
             send_data(pEntry);
             receive_response(pEntry);
+            record_latency(SMTP_PHASE::EHLO, start);
             m_bConnected = true;
         }
 
@@ -1188,12 +1282,14 @@ namespace md
             if (!is_keyword_supported(m_receive_buffer, "STARTTLS")) {
                 throw SmtpException(SmtpException::STARTTLS_NOT_SUPPORTED);
             }
+            auto start = std::chrono::steady_clock::now();
             Command_Entry *pEntry = find_command_entry(command_STARTTLS);
             snprintf(m_send_buffer, BUFFER_SIZE, "STARTTLS\r\n");
             send_data(pEntry);
             receive_response(pEntry);
 
             open_ssl_connect();
+            record_latency(SMTP_PHASE::TLS_HANDSHAKE, start);
         }
 
         void SmtpServer::receive_data_SSL(SSL *ssl, Command_Entry *pEntry)
@@ -1298,46 +1394,18 @@ namespace md
         void SmtpServer::receive_response(Command_Entry *pEntry)
         {
             std::string line;
-            int reply_code = 0;
-            bool bFinish = false;
-            while (!bFinish) {
+            int reply_code = -1;
+            while (reply_code < 0) {
                 receive_data(pEntry);
                 line.append(m_receive_buffer);
-                size_t len = line.length();// todo: здесь будет учет отправленных писем и открытых
-                size_t begin = 0;
-                size_t offset = 0;
-
-                while (true) // loop for all lines
-                {
-                    while (offset + 1 < len) {
-                        if (line[offset] == '\r' && line[offset + 1] == '\n')
-                            break;
-                        ++offset;
-                    }
-                    if (offset + 1 < len) // we found a line
-                    {
-                        // see if this is the last line
-                        // the last line must match the pattern: XYZ<SP>*<CRLF> or XYZ<CRLF> where XYZ is a string of 3 digits
-                        offset += 2; // skip <CRLF>
-                        if (offset - begin >= 5) {
-                            if (isdigit(line[begin]) && isdigit(line[begin + 1]) && isdigit(line[begin + 2])) {
-                                // this is the last line
-                                if (offset - begin == 5 || line[begin + 3] == ' ') {
-                                    reply_code =
-                                            (line[begin] - '0') * 100 + (line[begin + 1] - '0') * 10 + line[begin + 2] - '0';
-                                    bFinish = true;
-                                    break;
-                                }
-                            }
-                        }
-                        begin = offset;    // try to find next line
-                    } else // we haven't received the last line, so we need to receive more data
-                    {
-                        break;
-                    }
-                }
+                reply_code = parse_reply_code(line);
             }
             snprintf(m_receive_buffer, BUFFER_SIZE, "%s", line.c_str());
+            m_last_reply_code = reply_code;
+            MD_PROBE1(smtp_reply, reply_code);
+            if (!m_domain.empty()) {
+                DomainStatistic::instance().add_reply(m_domain, reply_code);
+            }
             if (reply_code != pEntry->valid_reply_code) {
                 throw SmtpException(pEntry->error);
             }
@@ -1396,6 +1464,8 @@ namespace md
                         case SSL_ERROR_NONE:
                             nLeft -= res;
                             offset += res;
+                            count(SMTP_COUNTER::BYTES, res);
+                            m_transaction_bytes += res;
                             break;
 
                             /* We would have blocked */
@@ -1455,6 +1525,7 @@ namespace md
             time.tv_sec = TIME_IN_SEC;
             time.tv_usec = 0;
 
+            MD_PROBE(tls_handshake_start);
             while (true) {
                 FD_ZERO(&fdwrite);
                 FD_ZERO(&fdread);
@@ -1470,18 +1541,22 @@ namespace md
                     if ((res = select(m_socket + 1, &fdread, &fdwrite, nullptr, &time)) == SOCKET_ERROR) {
                         FD_ZERO(&fdwrite);
                         FD_ZERO(&fdread);
+                        MD_PROBE1(tls_handshake_end, 0);
                         throw SmtpException(SmtpException::WSA_SELECT);
                     }
                     if (!res) {
                         //timeout
                         FD_ZERO(&fdwrite);
                         FD_ZERO(&fdread);
+                        MD_PROBE1(tls_handshake_end, 0);
                         throw SmtpException(SmtpException::SERVER_NOT_RESPONDING);
                     }
                 }
                 res = SSL_connect(m_ssl);
                 switch (SSL_get_error(m_ssl, res)) {
                     case SSL_ERROR_NONE:
+                        count(SMTP_COUNTER::TLS_HANDSHAKES);
+                        MD_PROBE1(tls_handshake_end, 1);
                         FD_ZERO(&fdwrite);
                         FD_ZERO(&fdread);
                         return;
@@ -1498,6 +1573,7 @@ namespace md
                     default:
                         FD_ZERO(&fdwrite);
                         FD_ZERO(&fdread);
+                        MD_PROBE1(tls_handshake_end, 0);
                         throw SmtpException(SmtpException::SSL_PROBLEM);
                 }
             }
@@ -1535,15 +1611,5 @@ namespace md
             set_xmailer(list[9].c_str());
             add_message_line(list[10].c_str());
         }
-
-        void SmtpServer::inc_send_failed_count()
-        {
-            m_statistic.m_failed_send_count++;
-        }
-
-        void SmtpServer::inc_send_success_count()
-        {
-            m_statistic.m_success_send_count++;
-        }
     }//namespace smtp
 }//namespace md
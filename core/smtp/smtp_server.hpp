@@ -4,6 +4,7 @@
 #include "smtp_exception.hpp"
 #include "smtp_common.hpp"
 #include "smtp_statistic.hpp"
+#include "domain_statistic.hpp"
 
 
 #include <vector>
@@ -56,9 +57,13 @@ namespace md
             SSL_CTX *m_ctx;
             SSL *m_ssl;
 
-            // statistics
+            int m_last_reply_code;
 
-            SmtpStatistic m_statistic;
+            bool m_is_bulk;
+            std::vector<int> m_recipient_reply_codes;
+
+            std::string m_domain;// recipient domain of the transaction, the key of DomainStatistic
+            uint64_t m_transaction_bytes;
 
         public:
             SmtpServer();
@@ -144,9 +149,30 @@ namespace md
 
             void init(const StringList &list, const std::string &smtp_hostname, unsigned int smtp_port);
 
-            void inc_send_failed_count();
+            // writes the message headers into header, BUFFER_SIZE bytes
+            void format_header(char *header);
+
+            // reply code of the last complete server response of the transaction, 0 if nothing was received yet;
+            // the QUIT of a disconnect does not count
+            int last_reply_code() const
+            {
+                return m_last_reply_code;
+            }
 
-            void inc_send_success_count();
+            /**
+             * one envelope for all recipients of an identical message: the To header doesn't list them,
+             * and a rejected RCPT TO only fails the transaction when no recipient was accepted
+             */
+            void set_bulk_mode(bool is_bulk)
+            {
+                m_is_bulk = is_bulk;
+            }
+
+            // RCPT TO reply code for every m_recipients entry of the last transaction, 0 - not sent
+            const std::vector<int> &recipient_reply_codes() const
+            {
+                return m_recipient_reply_codes;
+            }
 
         private:
 
@@ -154,8 +180,6 @@ namespace md
 
             void send_data(Command_Entry *pEntry);
 
-            void format_header(char *);
-
             int SmtpXYZdigits();
 
             void say_hello();
@@ -165,6 +189,9 @@ namespace md
 
             void receive_response(Command_Entry *pEntry);
 
+            // the transaction behind send_mail()
+            bool send_transaction();
+
             void init_open_ssl();
 
             void open_ssl_connect();
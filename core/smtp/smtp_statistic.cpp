@@ -3,3 +3,169 @@
 //
 
 #include "smtp_statistic.hpp"
+
+namespace md
+{
+    namespace smtp
+    {
+        size_t LatencyHistogram::bucket(uint64_t micros)
+        {
+            if (micros < SUB_BUCKETS) {
+                return static_cast<size_t>(micros);
+            }
+            // 2^exponent <= micros < 2^(exponent + 1), exponent >= 3
+            size_t exponent = 63 - __builtin_clzll(micros);
+            auto bucket = SUB_BUCKETS + (exponent - 3) * SUB_BUCKETS
+                          + ((micros >> (exponent - 3)) & (SUB_BUCKETS - 1));
+            return bucket < BUCKET_COUNT ? bucket : BUCKET_COUNT - 1;
+        }
+
+        uint64_t LatencyHistogram::upper_bound(size_t bucket)
+        {
+            if (bucket < SUB_BUCKETS) {
+                return bucket;
+            }
+            auto shift = (bucket - SUB_BUCKETS) / SUB_BUCKETS;
+            auto lower = (SUB_BUCKETS + (bucket - SUB_BUCKETS) % SUB_BUCKETS) << shift;
+            return lower + (uint64_t(1) << shift) - 1;
+        }
+
+        uint64_t LatencyHistogram::count() const
+        {
+            uint64_t total = 0;
+            for (auto value : m_buckets) {
+                total += value;
+            }
+            return total;
+        }
+
+        uint64_t LatencyHistogram::percentile(double quantile) const
+        {
+            auto total = count();
+            if (total == 0) {
+                return 0;
+            }
+            auto rank = static_cast<uint64_t>(quantile * total + 0.5);
+            uint64_t seen = 0;
+            for (size_t idx = 0; idx < BUCKET_COUNT; ++idx) {
+                seen += m_buckets[idx];
+                if (seen >= rank && seen > 0) {
+                    return upper_bound(idx);
+                }
+            }
+            return upper_bound(BUCKET_COUNT - 1);
+        }
+
+        SmtpStatistic &SmtpStatistic::instance()
+        {
+            static SmtpStatistic statistic;
+            return statistic;
+        }
+
+        SmtpStatistic::SmtpStatistic()
+                : m_next_shard(0)
+        {
+            for (auto &shard : m_shards) {
+                for (auto &value : shard.m_values) {
+                    value.store(0, std::memory_order_relaxed);
+                }
+                for (auto &latency : shard.m_latency) {
+                    for (auto &bucket : latency.m_buckets) {
+                        bucket.store(0, std::memory_order_relaxed);
+                    }
+                    latency.m_sum_us.store(0, std::memory_order_relaxed);
+                }
+            }
+        }
+
+        SmtpStatistic::Shard &SmtpStatistic::shard()
+        {
+            // threads take the shards round robin on their first increment
+            static thread_local size_t shard_idx = SHARD_COUNT;
+            if (shard_idx == SHARD_COUNT) {
+                shard_idx = m_next_shard.fetch_add(1, std::memory_order_relaxed) % SHARD_COUNT;
+            }
+            return m_shards[shard_idx];
+        }
+
+        uint64_t SmtpStatistic::get(SMTP_COUNTER counter) const
+        {
+            uint64_t total = 0;
+            for (const auto &shard : m_shards) {
+                total += shard.m_values[static_cast<size_t>(counter)].load(std::memory_order_relaxed);
+            }
+            return total;
+        }
+
+        SmtpCounters SmtpStatistic::snapshot() const
+        {
+            SmtpCounters totals{};
+            for (const auto &shard : m_shards) {
+                for (size_t idx = 0; idx < totals.size(); ++idx) {
+                    totals[idx] += shard.m_values[idx].load(std::memory_order_relaxed);
+                }
+            }
+            return totals;
+        }
+
+        LatencyHistogram SmtpStatistic::latency(SMTP_PHASE phase) const
+        {
+            LatencyHistogram histogram;
+            for (const auto &shard : m_shards) {
+                const auto &latency = shard.m_latency[static_cast<size_t>(phase)];
+                for (size_t idx = 0; idx < LatencyHistogram::BUCKET_COUNT; ++idx) {
+                    histogram.m_buckets[idx] += latency.m_buckets[idx].load(std::memory_order_relaxed);
+                }
+                histogram.m_sum_us += latency.m_sum_us.load(std::memory_order_relaxed);
+            }
+            return histogram;
+        }
+
+        const char *SmtpStatistic::name(SMTP_COUNTER counter)
+        {
+            switch (counter) {
+                case SMTP_COUNTER::SENT:
+                    return "sent";
+                case SMTP_COUNTER::FAILED:
+                    return "failed";
+                case SMTP_COUNTER::DEFERRED:
+                    return "deferred";
+                case SMTP_COUNTER::BYTES:
+                    return "bytes";
+                case SMTP_COUNTER::CONNECTIONS:
+                    return "connections";
+                case SMTP_COUNTER::TLS_HANDSHAKES:
+                    return "tls_handshakes";
+                default:
+                    return "unknown";
+            }
+        }
+
+        const char *SmtpStatistic::name(SMTP_PHASE phase)
+        {
+            switch (phase) {
+                case SMTP_PHASE::DNS:
+                    return "dns";
+                case SMTP_PHASE::CONNECT:
+                    return "connect";
+                case SMTP_PHASE::GREETING:
+                    return "greeting";
+                case SMTP_PHASE::TLS_HANDSHAKE:
+                    return "tls_handshake";
+                case SMTP_PHASE::EHLO:
+                    return "ehlo";
+                case SMTP_PHASE::AUTH:
+                    return "auth";
+                case SMTP_PHASE::ENVELOPE:
+                    return "envelope";
+                case SMTP_PHASE::DATA:
+                    return "data";
+                case SMTP_PHASE::FINAL_REPLY:
+                    return "final_reply";
+                default:
+                    return "unknown";
+            }
+        }
+
+    }// namespace smtp
+}// namespace md
@@ -5,15 +5,145 @@
 #ifndef MAIL_DISTRIBUTIONS_SMTP_STATISTIC_HPP
 #define MAIL_DISTRIBUTIONS_SMTP_STATISTIC_HPP
 
-struct SmtpStatistic
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include "../../tools/tracer/tracer.hpp"
+
+namespace md
 {
-    int m_success_send_count = 0;
-    int m_failed_send_count = 0;
-    int m_total_send_count = 0;
-    int m_number_read_messages = 0;
-    int number_delivered_messages = 0;
-    int number_open_links = 0;
-};
+    namespace smtp
+    {
+        enum class SMTP_COUNTER : int
+        {
+            SENT = 0,// messages accepted by the server, one per recipient
+            FAILED,
+            DEFERRED,// 4xx replies, retried later
+            BYTES,// bytes written to the server sockets
+            CONNECTIONS,
+            TLS_HANDSHAKES,
+            COUNT
+        };
+
+        using SmtpCounters = std::array<uint64_t, static_cast<size_t>(SMTP_COUNTER::COUNT)>;
+
+        // protocol phases of a delivery, their latencies are recorded separately
+        enum class SMTP_PHASE : int
+        {
+            DNS = 0,
+            CONNECT,// TCP connect
+            GREETING,// 220 of the server after connect
+            TLS_HANDSHAKE,// STARTTLS and the handshake
+            EHLO,
+            AUTH,
+            ENVELOPE,// MAIL FROM and the RCPT TOs
+            DATA,// DATA command and the message transfer
+            FINAL_REPLY,// the server's answer to the terminating dot
+            COUNT
+        };
+
+        /**
+         * Latency histogram in microseconds, HDR style: values below 8 have exact buckets, every power of
+         * two above is split into 8 linear sub-buckets, so a bucket bound is within 12.5% of its values.
+         * The last bucket takes everything above 2^40 us.
+         */
+        struct LatencyHistogram
+        {
+            static const size_t SUB_BUCKETS = 8;
+            static const size_t BUCKET_COUNT = SUB_BUCKETS + SUB_BUCKETS * 37;
+
+            std::array<uint64_t, BUCKET_COUNT> m_buckets{};
+            uint64_t m_sum_us = 0;
+
+            static size_t bucket(uint64_t micros);
+
+            // largest value counted in the bucket
+            static uint64_t upper_bound(size_t bucket);
+
+            uint64_t count() const;
+
+            // upper bound of the bucket holding the quantile, 0 for an empty histogram
+            uint64_t percentile(double quantile) const;
+        };
+
+        /**
+         * Process-wide delivery counters. Every thread increments the counters of its own shard, a shard
+         * fills a cache line of its own so threads never write to a shared line; readers sum the shards
+         * without stopping the writers. Threads beyond SHARD_COUNT share shards, which stays correct
+         * because increments are atomic.
+         */
+        class SmtpStatistic
+        {
+        public:
+            static SmtpStatistic &instance();
+
+            void add(SMTP_COUNTER counter, uint64_t value = 1)
+            {
+                shard().m_values[static_cast<size_t>(counter)].fetch_add(value, std::memory_order_relaxed);
+            }
+
+            uint64_t get(SMTP_COUNTER counter) const;
+
+            // all counters summed in one pass, each is exact, they are not a consistent cut of each other
+            SmtpCounters snapshot() const;
+
+            static const char *name(SMTP_COUNTER counter);
+
+            void record(SMTP_PHASE phase, uint64_t micros)
+            {
+                auto &latency = shard().m_latency[static_cast<size_t>(phase)];
+                latency.m_buckets[LatencyHistogram::bucket(micros)].fetch_add(1, std::memory_order_relaxed);
+                latency.m_sum_us.fetch_add(micros, std::memory_order_relaxed);
+            }
+
+            // the phase's histogram merged over all shards
+            LatencyHistogram latency(SMTP_PHASE phase) const;
+
+            static const char *name(SMTP_PHASE phase);
+
+        private:
+            static const size_t SHARD_COUNT = 64;
+
+            struct Latency
+            {
+                std::atomic<uint64_t> m_buckets[LatencyHistogram::BUCKET_COUNT];
+                std::atomic<uint64_t> m_sum_us;
+            };
+
+            struct alignas(64) Shard
+            {
+                std::atomic<uint64_t> m_values[static_cast<size_t>(SMTP_COUNTER::COUNT)];
+                Latency m_latency[static_cast<size_t>(SMTP_PHASE::COUNT)];
+            };
+
+            SmtpStatistic();
+
+            Shard &shard();
+
+            Shard m_shards[SHARD_COUNT];
+
+            std::atomic<size_t> m_next_shard;
+        };
+
+        inline void count(SMTP_COUNTER counter, uint64_t value = 1)
+        {
+            SmtpStatistic::instance().add(counter, value);
+        }
+
+        // records the time since start as a latency of the phase, and as a span of a traced message
+        inline void record_latency(SMTP_PHASE phase, std::chrono::steady_clock::time_point start)
+        {
+            auto end = std::chrono::steady_clock::now();
+            SmtpStatistic::instance().record(phase, static_cast<uint64_t>(
+                    std::chrono::duration_cast<std::chrono::microseconds>(end - start).count()));
+            if (tracer::Tracer::is_sampled()) {
+                tracer::Tracer::instance().record(SmtpStatistic::name(phase), start, end);
+            }
+        }
 
+    }// namespace smtp
+}// namespace md
 
 #endif //MAIL_DISTRIBUTIONS_SMTP_STATISTIC_HPP
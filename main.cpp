@@ -1,10 +1,11 @@
+#include <atomic>
 #include <thread>
 #include <iostream>
-#include <syslog.h>
 #include <chrono>
 #include <ctime>
 #include <boost/format.hpp>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <cpprest/json.h>
 #include <cpprest/http_listener.h>
 #include <cpprest/uri.h>
@@ -16,6 +17,12 @@
 #include "tools/args_parser/argument_parser.hpp"
 #include "core/database/db_tools.hpp"
 #include "core/database/db_query_executor.hpp"
+#include "core/database/delivery_log_writer.hpp"
+#include "core/database/async_query_executor.hpp"
+#include "core/delivery/campaign_manager.hpp"
+#include "core/delivery/job_source.hpp"
+#include "core/delivery/delivery_worker.hpp"
+#include "core/delivery/stats_segment.hpp"
 #include "core/rest/microsvc_controller.hpp"
 #include "core/rest/foundation/include/usr_interrupt_handler.hpp"
 #include "core/rest/foundation/include/runtime_utils.hpp"
@@ -23,35 +30,238 @@ using namespace utility;
 using namespace web;
 using namespace md::db;
 using namespace md::smtp;
+using namespace md::delivery;
 using namespace md::argument_parser;
 std::shared_ptr<DbQueryExecutor> global_query_executor;
-void send_mail(const StringList &mail_data, const std::string &smtp_host, unsigned smtp_port)
+// mapped before forking, one slot per worker process
+StatsSegmentPtr global_stats_segment;
+// every worker process spools to a directory of its own, empty spool_dir disables the spool
+JobSpoolPtr open_spool(const ServerConfig &server_conf, int process_idx)
 {
-    SmtpServer smtp_server;
-    try {
+    if (server_conf.get_spool_dir().empty()) {
+        return nullptr;
+    }
+    auto directory = (fs::path(server_conf.get_spool_dir()) / ("worker_" + std::to_string(process_idx))).string();
+    return std::make_shared<JobSpool>(directory, static_cast<size_t>(server_conf.get_spool_segment_size()) << 20);
+}
+RetryPolicy retry_policy(const ServerConfig &server_conf)
+{
+    RetryPolicy policy;
+    policy.m_max_attempts = server_conf.get_retry_max_attempts();
+    policy.m_initial_delay = server_conf.get_retry_delay();
+    policy.m_backoff = server_conf.get_retry_backoff();
+    policy.m_max_delay = server_conf.get_retry_max_delay();
+    if (server_conf.get_job_source() == "claim") {
+        // a claim is not renewed: later retries are left to the lease, the other half is for the queue and the send;
+        // the window is measured from the claim, see schedule
+        policy.m_max_window = std::max(server_conf.get_claim_lease() / 2, 1);
+    }
+    return policy;
+}
+// fetched jobs are spooled, deferred ones retried, all grouped by sender account, and the next
+// prefetch_depth batches are fetched while the current one is being sent
+JobSourcePtr schedule(JobSourcePtr job_source, const JobSpoolPtr &spool, const std::string &smtp_host
+                      , const ServerConfig &server_conf
+                      , RetryJobSource::WaitUntil wait_until = RetryJobSource::sleep_until)
+{
+    if (spool) {
+        job_source = std::make_shared<SpoolJobSource>(job_source, spool, server_conf.get_batch_size());
+    }
+    if (server_conf.get_retry_max_attempts() > 0) {
+        RetryJobSource::WindowStart window_start;
+        if (server_conf.get_job_source() == "claim") {
+            // the last column is the claim time on the wall clock, a spooled row keeps the one of its claim
+            window_start = [](const StringList &row, int64_t now_ms) {
+                auto system_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        std::chrono::system_clock::now().time_since_epoch()).count();
+                return now_ms - std::max<int64_t>(system_ms - std::stoll(row.back()), 0);
+            };
+        }
+        job_source = std::make_shared<RetryJobSource>(job_source, retry_policy(server_conf), steady_clock_ms
+                                                      , std::move(wait_until), std::move(window_start));
+    }
+    job_source = std::make_shared<GroupingJobSource>(job_source, smtp_host);
+    auto prefetch_depth = server_conf.get_prefetch_depth();
+    if (server_conf.get_job_source() == "claim") {
+        // a claim is not renewed, a batch waiting in the queue uses up its lease: at most one waits
+        prefetch_depth = std::min(prefetch_depth, 1);
+    }
+    if (prefetch_depth <= 0) {
+        return job_source;
+    }
+    return std::make_shared<PrefetchJobSource>(job_source, prefetch_depth);
+}
+void do_child(DataRange range, int process_idx, std::string &smtp_host, unsigned smtp_port, ConfigPtr &db_conf
+              , const ServerConfig &server_conf)
+{
+    // every worker process needs connections of its own, libpq sockets can't be shared across fork
+    auto query_executor = std::make_shared<DbQueryExecutor>(db_conf);
+    auto delivery_log = std::make_shared<DeliveryLogWriter>(query_executor->backend(), db_conf);
+    auto db_config = dynamic_cast<DbConfig *>(db_conf.get());
+    auto spool = open_spool(server_conf, process_idx);
+    if (spool) {
+        range = spool->load_range(range);
+    }
+    // the slices follow from count(*), which moves between runs: a restart keeps the range its key started with
+    auto worker_key = (boost::format("server:%d/%d:process:%d/%d") % server_conf.get_order_number()
+                       % server_conf.get_server_count() % process_idx % server_conf.get_process_count()).str();
+    int high_water_mark = range.first - 1;
+    std::vector<int> completed_ids;
+    bool is_checkpointed = !db_config->m_checkpoint_table.empty()
+                           && query_executor->prepare_checkpoint_table(db_config->m_checkpoint_table);
+    if (is_checkpointed) {
+        if (query_executor->load_checkpoint(db_config->m_checkpoint_table, worker_key, range, high_water_mark
+                                            , completed_ids)) {
+            MD_LOG_INFO((boost::format("%s: ids %d-%d, resuming above %d") % worker_key % range.first
+                         % range.second % high_water_mark).str());
+        } else {
+            query_executor->start_checkpoint(db_config->m_checkpoint_table, worker_key, range);
+        }
+    }
 
-        smtp_server.set_security_type(USE_TLS);
-        smtp_server.init(mail_data, smtp_host, smtp_port);
-        if(smtp_server.send_mail())
-            smtp_server.inc_send_success_count();
+    if (spool) {
+        // everything up to the spool's high-water mark was fetched by an earlier run
+        high_water_mark = std::max(high_water_mark, spool->last_job_id());
+    }
 
+    JobSourcePtr job_source = std::make_shared<RangeJobSource>(
+            query_executor, DataRange(std::max(range.first, high_water_mark + 1), range.second)
+            , server_conf.get_batch_size());
+    if (is_checkpointed) {
+        job_source = std::make_shared<CheckpointJobSource>(job_source, query_executor
+                                                           , db_config->m_checkpoint_table, worker_key
+                                                           , high_water_mark, completed_ids
+                                                           , db_config->m_checkpoint_interval);
     }
-    catch (SmtpException &e) {
-        write_sys_log(e.get_error_message());
-        std::cout << "Error: " << e.get_error_message().c_str() << ".\n";
-        smtp_server.inc_send_failed_count();
+    job_source = schedule(job_source, spool, smtp_host, server_conf);
+    DeliveryWorker worker(smtp_host, smtp_port, delivery_log, server_conf.get_session_max_messages()
+                          , server_conf.get_max_recipients());
+    StatsPublisher stats_publisher(global_stats_segment, process_idx, [job_source] {
+        return job_source->queue_depth();
+    });
+    worker.run(*job_source);
+}
+void do_listen(const DbQueryExecutorPtr &query_executor, std::string &smtp_host, unsigned smtp_port
+               , ConfigPtr &db_conf, const ServerConfig &server_conf)
+{
+    auto delivery_log = std::make_shared<DeliveryLogWriter>(query_executor->backend(), db_conf);
+    // sent rows are marked in completed_at, older ones never were: the reads start a lookback below
+    // the last logged message, which still finds the rows committed after it
+    query_executor->prepare_claim_columns();
+    auto db_config = dynamic_cast<DbConfig *>(db_conf.get());
+    auto high_water_mark = query_executor->get_max_id(db_config->m_delivery_log_table, "email_id");
+    auto spool = open_spool(server_conf, 1);
+    if (spool) {
+        high_water_mark = std::max(high_water_mark, spool->last_job_id());
+    }
+    auto notify_source = std::make_shared<NotifyJobSource>(query_executor, server_conf.get_notify_channel()
+                                                           , high_water_mark - server_conf.get_notify_lookback() + 1
+                                                           , server_conf.get_batch_size()
+                                                           , server_conf.get_poll_interval());
+    // SIGINT or SIGTERM ends the pickup and the retry waits, the chain drains and run returns
+    std::mutex stop_mutex;
+    std::condition_variable stop_condition;
+    bool is_stopped = false;
+    auto job_source = schedule(notify_source, spool, smtp_host, server_conf, [&](int64_t time_ms) {
+        auto delay_ms = std::max<int64_t>(time_ms - steady_clock_ms(), 0);
+        std::unique_lock<std::mutex> lock(stop_mutex);
+        return !stop_condition.wait_for(lock, std::chrono::milliseconds(delay_ms), [&is_stopped] {
+            return is_stopped;
+        });
+    });
+    DeliveryWorker worker(smtp_host, smtp_port, delivery_log, server_conf.get_session_max_messages()
+                          , server_conf.get_max_recipients());
+    StatsPublisher stats_publisher(global_stats_segment, 1, [job_source] {
+        return job_source->queue_depth();
+    });
+    std::atomic<bool> is_done(false);
+    std::thread stopper([&] {
+        while (!is_done) {
+            if (InterruptHandler::waitForUserInterrupt(std::chrono::milliseconds(500))) {
+                MD_LOG_INFO("stopping, the fetched jobs are sent first");
+                notify_source->stop();
+                {
+                    std::lock_guard<std::mutex> lock(stop_mutex);
+                    is_stopped = true;
+                }
+                stop_condition.notify_all();
+                return;
+            }
+        }
+    });
+    try {
+        worker.run(*job_source);
     }
     catch (...) {
-        std::cout << "Error: unknown error" << ".\n";
-        smtp_server.inc_send_failed_count();
+        is_done = true;
+        stopper.join();
+        throw;
     }
+    is_done = true;
+    stopper.join();
 }
-void do_child(DataRange range, std::string &smtp_host, unsigned smtp_port)
+void do_claim(int process_idx, std::string &smtp_host, unsigned smtp_port, ConfigPtr &db_conf
+              , const ServerConfig &server_conf)
 {
-    auto mail_data = global_query_executor->get_data4send_mail(range);
-    std::cout << mail_data;
-    for (const auto &data : mail_data) {
-        send_mail(data, smtp_host, smtp_port);
+    auto query_executor = std::make_shared<DbQueryExecutor>(db_conf);
+    auto delivery_log = std::make_shared<DeliveryLogWriter>(query_executor->backend(), db_conf);
+    auto spool = open_spool(server_conf, process_idx);
+    // with a spool the worker keeps its id across restarts, so it can complete the claims it spooled
+    auto worker_id = spool ? spool->load_worker_id(make_worker_id()) : make_worker_id();
+    auto job_source = schedule(
+            std::make_shared<ClaimJobSource>(query_executor, worker_id, server_conf.get_batch_size()
+                                             , server_conf.get_claim_lease()), spool, smtp_host, server_conf);
+    DeliveryWorker worker(smtp_host, smtp_port, delivery_log, server_conf.get_session_max_messages()
+                          , server_conf.get_max_recipients());
+    StatsPublisher stats_publisher(global_stats_segment, process_idx, [job_source] {
+        return job_source->queue_depth();
+    });
+    worker.run(*job_source);
+}
+// the send pipeline over a snapshot file, without database and delivery log
+void do_replay(const std::string &path, int repeat, std::string &smtp_host, unsigned smtp_port
+               , const ServerConfig &server_conf)
+{
+    auto snapshot = std::make_shared<SnapshotJobSource>(path, server_conf.get_batch_size(), repeat);
+    auto job_source = schedule(snapshot, nullptr, smtp_host, server_conf);
+    DeliveryWorker worker(smtp_host, smtp_port, nullptr, server_conf.get_session_max_messages()
+                          , server_conf.get_max_recipients());
+    auto start = std::chrono::steady_clock::now();
+    worker.run(*job_source);
+    auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    MD_LOG_INFO((boost::format("replayed %d rows in %.3f s, %.1f rows/s") % snapshot->rows_replayed() % seconds
+                 % (seconds > 0 ? snapshot->rows_replayed() / seconds : 0.0)).str());
+}
+// runs worker(1) in this process and worker(2..process_count) in forked children, then waits for them
+void fork_workers(int process_count, const std::function<void(int)> &worker)
+{
+    std::vector<pid_t> children;
+    for (int process_idx = 2; process_idx <= process_count; ++process_idx) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            MD_LOG_ERROR("can't to fork");
+            continue;
+        }
+        if (pid == 0) {
+            try {
+                worker(process_idx);
+            }
+            catch (std::exception &e) {
+                MD_LOG_ERROR(e.what());
+                md::tracer::Tracer::instance().stop();
+                md::logger::Logger::instance().stop();
+                _exit(1);
+            }
+            // _exit skips the static destructors which would write the traces and the last log messages
+            md::tracer::Tracer::instance().stop();
+            md::logger::Logger::instance().stop();
+            _exit(0);
+        }
+        children.push_back(pid);
+    }
+    worker(1);
+    for (auto pid : children) {
+        waitpid(pid, nullptr, 0);
     }
 }
 using namespace web;
@@ -61,6 +271,8 @@ int main(int argc, char const *argv[])
 {
 
     InterruptHandler::hookSIGINT();
+    // stderr until the server config names the destination
+    md::logger::Logger::instance().start("-", md::logger::LOG_LEVEL::INFO);
 
     MicroserviceController server;
     server.setEndpoint("http://host_auto_ip4:6502/v1/ivmero/api");
@@ -73,15 +285,7 @@ int main(int argc, char const *argv[])
         std::string path_to_server_conf = parser->path_to_server_conf();
         std::string path_to_db_conf = parser->path_to_db_conf();
         SysErrorCode error_code;
-        write_sys_log("start read config", LOG_DEBUG);
-        auto db_conf = read_config(path_to_db_conf, CONFIG_TYPE::DATABASE, error_code);
-        write_sys_log("db config read success", LOG_DEBUG);
-
-
-        global_query_executor = std::make_shared<DbQueryExecutor>(db_conf);
-        std::cerr << "db_query executor created" << std::endl;
-
-
+        MD_LOG_DEBUG("start read config");
         auto p_server_conf = read_config(path_to_server_conf, CONFIG_TYPE::SERVER, error_code);
         if (!p_server_conf) {
             return -1;
@@ -90,7 +294,11 @@ int main(int argc, char const *argv[])
         if (!server_conf) {
             return -1;
         }
-        std::cerr << "server config will be read" << std::endl;
+        md::logger::Logger::instance().start(server_conf->get_log_file()
+                                             , md::logger::level_from_string(server_conf->get_log_level())
+                                             , server_conf->get_log_sample_limit());
+        md::tracer::Tracer::instance().start(server_conf->get_trace_file(), server_conf->get_trace_sample_rate());
+        MD_LOG_DEBUG("server config read success");
 //        server_conf->print();
 
         std::string smtp_host = /*"smtp.yandex.ru"*/server_conf->get_domain();
@@ -99,45 +307,137 @@ int main(int argc, char const *argv[])
         int server_count = /*1*/server_conf->get_server_count();
         int order_number = /*1*/server_conf->get_order_number();
         auto process_count = /*1*/server_conf->get_process_count();
-        auto row_count = global_query_executor->get_row_count("core.emails");
+
+        if (!parser->snapshot_replay_path().empty()) {
+            do_replay(parser->snapshot_replay_path(), parser->snapshot_repeat(), smtp_host, smtp_port, *server_conf);
+            return 0;
+        }
+
+        auto db_conf = read_config(path_to_db_conf, CONFIG_TYPE::DATABASE, error_code);
+        MD_LOG_DEBUG("db config read success");
+
+
+        global_query_executor = std::make_shared<DbQueryExecutor>(db_conf);
+        MD_LOG_DEBUG("db query executor created");
+
+        if (!parser->snapshot_export_path().empty()) {
+            auto row_count = export_snapshot(global_query_executor, parser->snapshot_export_path()
+                                             , server_conf->get_batch_size());
+            MD_LOG_INFO((boost::format("%d rows written to %s") % row_count % parser->snapshot_export_path()).str());
+            return 0;
+        }
+
+        if (server_conf->get_job_source() == "listen") {
+            // long-running delivery daemon, a single worker fed by LISTEN/NOTIFY;
+            // the REST handlers query through the same pool without blocking the listener threads
+            auto async_query_executor = std::make_shared<AsyncQueryExecutor>(
+                    global_query_executor->backend(), dynamic_cast<DbConfig *>(db_conf.get())->m_async_io_threads);
+            server.setQueryExecutor(async_query_executor);
+            global_stats_segment = std::make_shared<StatsSegment>(1);
+            server.setStatsSegment(global_stats_segment);
+            InterruptHandler::hookSIGTERM();
+            server.accept().wait();
+            do_listen(global_query_executor, smtp_host, smtp_port, db_conf, *server_conf);
+            server.shutdown().wait();
+            return 0;
+        }
+
+        if (server_conf->get_job_source() == "campaigns") {
+            // long-running daemon which sends what is started over REST: POST/GET/DELETE campaigns and
+            // GET campaigns/{id}/progress; every campaign runs process_count worker threads in this process, no fork
+            auto async_query_executor = std::make_shared<AsyncQueryExecutor>(
+                    global_query_executor->backend(), dynamic_cast<DbConfig *>(db_conf.get())->m_async_io_threads);
+            server.setQueryExecutor(async_query_executor);
+            global_stats_segment = std::make_shared<StatsSegment>(1);
+            server.setStatsSegment(global_stats_segment);
+            StatsPublisher stats_publisher(global_stats_segment, 1);
+            auto delivery_log = std::make_shared<DeliveryLogWriter>(global_query_executor->backend(), db_conf);
+            auto campaign_manager = std::make_shared<CampaignManager>(
+                    global_query_executor, server_conf->get_batch_size(), process_count
+                    , [&](JobSourcePtr job_source, RetryJobSource::WaitUntil wait_until) {
+                        return schedule(job_source, nullptr, smtp_host, *server_conf, std::move(wait_until));
+                    }
+                    , [&]() {
+                        return std::unique_ptr<DeliveryWorker>(new DeliveryWorker(
+                                smtp_host, smtp_port, delivery_log, server_conf->get_session_max_messages()
+                                , server_conf->get_max_recipients()));
+                    });
+            server.setCampaignManager(campaign_manager);
+            server.setProgressStream(std::make_shared<md::rest::ProgressStream>(
+                    campaign_manager, server_conf->get_progress_interval()));
+            server.accept().wait();
+            MD_LOG_INFO("campaigns are accepted at: " + server.endpoint() + "/campaigns");
+
+            InterruptHandler::waitForUserInterrupt();
+
+            server.shutdown().wait();
+            // cancels the running campaigns and waits for their workers
+            server.setProgressStream(nullptr);
+            server.setCampaignManager(nullptr);
+            campaign_manager.reset();
+            return 0;
+        }
+
+        if (server_conf->get_job_source() == "claim") {
+            // no static slices: every worker of every server claims batches from the shared table
+            global_query_executor->prepare_claim_columns();
+            global_query_executor.reset();
+            global_stats_segment = std::make_shared<StatsSegment>(process_count);
+            server.setStatsSegment(global_stats_segment);
+            fork_workers(process_count, [&](int process_idx) {
+                if (process_idx == 1) {
+                    // every child is forked, the parent may run the listener threads now
+                    server.accept().wait();
+                }
+                do_claim(process_idx, smtp_host, smtp_port, db_conf, *server_conf);
+            });
+            server.shutdown().wait();
+            return 0;
+        }
+
+        // the spool keeps the slices of the first run, later runs only need them for new spool directories,
+        // and max(id) is an index lookup where count(*) reads the whole table
+        auto row_count = server_conf->get_spool_dir().empty() ? global_query_executor->get_row_count("core.emails")
+                                                              : global_query_executor->get_max_id("core.emails", "id");
 
         auto server_data_range = get_data_range(row_count, server_count, order_number);
-        auto mail_data = global_query_executor->get_data4send_mail(server_data_range);
-        std::cout << "get data for send mail \n";
         auto process_row_count = abs(server_data_range.second - server_data_range.first);
 
+        auto async_query_executor = std::make_shared<AsyncQueryExecutor>(
+                global_query_executor->backend(), dynamic_cast<DbConfig *>(db_conf.get())->m_async_io_threads);
+        server.setQueryExecutor(async_query_executor);
         server.accept().wait();
-        std::cout << "Modern C++ Microservice now listening for requests at: " << server.endpoint() << '\n';
+        MD_LOG_INFO("Modern C++ Microservice now listening for requests at: " + server.endpoint());
 
         InterruptHandler::waitForUserInterrupt();
 
         server.shutdown().wait();
+        // no threads but the logger writer, which the children restart, may run across fork
+        server.setQueryExecutor(nullptr);
+        async_query_executor.reset();
 
-        for (int process_idx = 1; process_idx <= process_count; ++process_idx) {
-            auto process_data_range = get_data_range(process_row_count + 1, process_count, process_idx);
-            pid_t pid = fork();
-            if (pid < 0) {
-                write_sys_log("can't to fork", LOG_DEBUG);
-                continue;
-            }
-            if (pid == 0) {
-                do_child(process_data_range, smtp_host, smtp_port);
-            } else if (process_idx == 1) {
-                do_child(process_data_range, smtp_host, smtp_port);
-            }
-//            sleep(5);
+        // close the parent connections before forking, each worker opens its own pool
+        global_query_executor.reset();
 
-        }
+        global_stats_segment = std::make_shared<StatsSegment>(process_count);
+        server.setStatsSegment(global_stats_segment);
+        fork_workers(process_count, [&](int process_idx) {
+            if (process_idx == 1) {
+                // every child is forked, the parent serves GET stats while it sends its own slice
+                server.accept().wait();
+            }
+            auto process_data_range = get_data_range(process_row_count + 1, process_count, process_idx);
+            do_child(process_data_range, process_idx, smtp_host, smtp_port, db_conf, *server_conf);
+        });
+        server.shutdown().wait();
         return 0;
     }
     catch (SmtpException &e) {
-        write_sys_log(e.get_error_message());
+        MD_LOG_ERROR(e.get_error_message());
     }
 
     catch (std::exception &e) {
-        write_sys_log(e.what());
-        std::cerr << e.what() << std::endl;
+        MD_LOG_ERROR(e.what());
     }
 
-
 }
@@ -0,0 +1,365 @@
+#include <algorithm>
+#include <cmath>
+#include <queue>
+#include <utility>
+#include "delivery_simulator.hpp"
+
+namespace md
+{
+    using namespace service;
+    namespace simulator
+    {
+        namespace
+        {
+            const size_t RECIPIENT_FIELD = 7;// core.emails column with the recipient address
+            const char OTHER_DOMAIN[] = "other.invalid";// recipients of the "*" host
+
+            std::lognormal_distribution<double> make_distribution(const LatencyModel &model)
+            {
+                auto median = std::max(model.m_median_ms, 0.001);
+                // 2.326 standard deviations above the mean of the normal is its 99th percentile
+                auto sigma = std::max(std::log(std::max(model.m_p99_ms, median) / median) / 2.326, 0.0);
+                return std::lognormal_distribution<double>(std::log(median), sigma);
+            }
+
+            // a limit for the simulated share of the campaign, 0 stays no limit
+            int scaled(int limit, double scale)
+            {
+                return limit > 0 ? std::max(static_cast<int>(std::lround(limit * scale)), 1) : limit;
+            }
+        }
+
+        /**
+         * The messages of the campaign as core.emails rows, recipient domains spread by the host shares
+         */
+        class DeliverySimulator::CampaignJobSource : public delivery::JobSource
+        {
+        public:
+            CampaignJobSource(uint64_t messages, int batch_size, int senders
+                              , std::vector<std::pair<double, std::string>> domains)
+                    : m_messages(messages)
+                      , m_batch_size(static_cast<uint64_t>(std::max(batch_size, 1)))
+                      , m_senders(static_cast<uint64_t>(std::max(senders, 1)))
+                      , m_domains(std::move(domains))
+            {
+            }
+
+            bool next_batch(StringListArray &batch) override
+            {
+                if (m_handed_out >= m_messages) {
+                    return false;
+                }
+                auto last = std::min(m_handed_out + m_batch_size, m_messages);
+                batch.clear();
+                batch.reserve(last - m_handed_out);
+                for (auto id = m_handed_out + 1; id <= last; ++id) {
+                    StringList row;
+                    row.resize(11);
+                    row[0] = std::to_string(id);
+                    row[1] = "sender" + std::to_string(id % m_senders);
+                    row[2] = "password";
+                    row[3] = "Sender";
+                    row[4] = "sender@example.com";
+                    row[5] = "reply@example.com";
+                    row[6] = "Campaign";
+                    row[7] = std::to_string(id) + "@" + domain(id);
+                    row[8] = "3";
+                    row[9] = "mail_distributions";
+                    row[10] = "body";
+                    batch.push_back(std::move(row));
+                }
+                m_handed_out = last;
+                return true;
+            }
+
+            void complete(int job_id, db::DELIVERY_STATUS status) override
+            {
+                ++m_outcomes[static_cast<int>(status)];
+            }
+
+            uint64_t handed_out() const
+            {
+                return m_handed_out;
+            }
+
+            uint64_t count(db::DELIVERY_STATUS status) const
+            {
+                return m_outcomes[static_cast<int>(status)];
+            }
+
+        private:
+            // the same domain for an id in every run
+            const std::string &domain(uint64_t id) const
+            {
+                auto point = static_cast<double>((id * 0x9E3779B97F4A7C15ULL) >> 11) / 9007199254740992.0;
+                for (const auto &domain : m_domains) {
+                    if (point < domain.first) {
+                        return domain.second;
+                    }
+                }
+                return m_domains.back().second;
+            }
+
+            uint64_t m_messages;
+            uint64_t m_batch_size;
+            uint64_t m_senders;
+            std::vector<std::pair<double, std::string>> m_domains;// cumulative share, domain
+            uint64_t m_handed_out = 0;
+            uint64_t m_outcomes[3] = {0, 0, 0};
+        };
+
+        DeliverySimulator::DeliverySimulator(SimulationConfig config)
+                : m_config(std::move(config))
+                  , m_random(m_config.m_seed)
+                  , m_merger(std::string(), 0, nullptr, m_config.m_session_max_messages, m_config.m_max_recipients)
+        {
+            if (m_config.m_mx.empty()) {
+                m_config.m_mx.push_back(MxModel());
+            }
+            if (m_config.m_scale <= 0.0 || m_config.m_scale > 1.0) {
+                m_config.m_scale = 1.0;
+            }
+
+            double total_share = 0.0;
+            for (const auto &model : m_config.m_mx) {
+                total_share += std::max(model.m_share, 0.0);
+            }
+            std::vector<std::pair<double, std::string>> domains;
+            double cumulative_share = 0.0;
+            for (const auto &model : m_config.m_mx) {
+                Host host;
+                host.m_model = model;
+                host.m_model.m_max_connections = scaled(model.m_max_connections, m_config.m_scale);
+                host.m_model.m_max_rate = scaled(model.m_max_rate, m_config.m_scale);
+                host.m_connect = make_distribution(model.m_connect);
+                host.m_transaction = make_distribution(model.m_transaction);
+                host.m_tokens = std::max(host.m_model.m_max_rate / 60.0, 1.0);
+                if (model.m_domain == "*") {
+                    m_default_host = m_hosts.size();
+                } else {
+                    m_domain_hosts[model.m_domain] = m_hosts.size();
+                }
+                m_hosts.push_back(host);
+
+                cumulative_share += total_share > 0.0 ? std::max(model.m_share, 0.0) / total_share : 0.0;
+                domains.emplace_back(cumulative_share, model.m_domain == "*" ? OTHER_DOMAIN : model.m_domain);
+            }
+
+            auto messages = static_cast<uint64_t>(std::llround(m_config.m_messages * m_config.m_scale));
+            m_campaign = std::make_shared<CampaignJobSource>(messages, m_config.m_batch_size, m_config.m_senders
+                                                             , std::move(domains));
+            m_workers.resize(static_cast<size_t>(std::max(scaled(m_config.m_workers, m_config.m_scale), 1)));
+            for (auto &worker : m_workers) {
+                // the chain schedule() builds in main, without the spool and on the virtual clock
+                worker.m_job_source = m_campaign;
+                if (m_config.m_retry_policy.m_max_attempts > 0) {
+                    worker.m_retry_source = std::make_shared<delivery::RetryJobSource>(
+                            worker.m_job_source, m_config.m_retry_policy, [this]() {
+                                return m_now_us / 1000;
+                            }, nullptr);
+                    worker.m_job_source = worker.m_retry_source;
+                }
+                worker.m_job_source = std::make_shared<delivery::GroupingJobSource>(worker.m_job_source
+                                                                                    , "simulator");
+            }
+        }
+
+        DeliverySimulator::~DeliverySimulator() = default;
+
+        SimulationSnapshot DeliverySimulator::run(const std::function<void(const SimulationSnapshot &)> &report)
+        {
+            using Event = std::pair<int64_t, size_t>;// virtual time, worker
+            std::priority_queue<Event, std::vector<Event>, std::greater<Event>> events;
+            for (size_t idx = 0; idx < m_workers.size(); ++idx) {
+                events.push(Event(0, idx));
+            }
+
+            const auto end_us = static_cast<int64_t>(m_config.m_hours * 3600e6);
+            const auto interval_us = static_cast<int64_t>(std::max(m_config.m_report_interval, 1)) * 1000000;
+            auto next_report_us = interval_us;
+            uint64_t reported_sent = 0;
+            while (!events.empty()) {
+                auto event = events.top();
+                if (event.first >= next_report_us && next_report_us <= end_us) {
+                    m_now_us = next_report_us;
+                    auto state = snapshot(reported_sent, interval_us / 1e6);
+                    reported_sent = state.m_sent;
+                    report(state);
+                    next_report_us += interval_us;
+                    continue;
+                }
+                if (event.first >= end_us) {
+                    m_now_us = end_us;
+                    break;
+                }
+                events.pop();
+                m_now_us = event.first;
+                auto busy_us = step(m_workers[event.second]);
+                if (busy_us >= 0) {
+                    events.push(Event(m_now_us + std::max<int64_t>(busy_us, 1), event.second));
+                }
+            }
+            return snapshot(0, m_now_us / 1e6);
+        }
+
+        int64_t DeliverySimulator::step(Worker &worker)
+        {
+            if (worker.m_next < worker.m_transactions.size()) {
+                return send(worker, worker.m_transactions[worker.m_next++]);
+            }
+
+            worker.m_transactions.clear();
+            worker.m_next = 0;
+            if (!worker.m_job_source->next_batch(worker.m_batch)) {
+                close_session(worker);
+                return -1;
+            }
+            if (worker.m_batch.empty()) {
+                // only retries are left and none is due yet, the idle session would time out anyway
+                close_session(worker);
+                auto due_us = worker.m_retry_source ? worker.m_retry_source->next_retry_ms() * 1000 : m_now_us;
+                return std::max<int64_t>(due_us - m_now_us, 1000);
+            }
+            worker.m_transactions = m_merger.merge_identical(worker.m_batch);
+            return static_cast<int64_t>(m_config.m_fetch_ms * 1000);
+        }
+
+        int64_t DeliverySimulator::send(Worker &worker, const std::vector<const StringList *> &jobs)
+        {
+            const auto &first_job = *jobs.front();
+            auto host_idx = host_of(first_job[RECIPIENT_FIELD]);
+            auto &host = m_hosts[host_idx];
+
+            // the session rules of DeliveryWorker, plus a session belongs to one host
+            if (worker.m_session_host >= 0
+                && (static_cast<size_t>(worker.m_session_host) != host_idx || worker.m_session_login != first_job[1])) {
+                close_session(worker);
+            }
+
+            int64_t busy_us = 0;
+            bool is_sent = false;
+            int transaction_reply_code = 0;
+            std::vector<int> recipient_reply_codes(jobs.size(), 0);
+            if (worker.m_session_host < 0) {
+                busy_us += static_cast<int64_t>(host.m_connect(m_random) * 1000);
+                if (host.m_model.m_max_connections > 0 && host.m_sessions >= host.m_model.m_max_connections) {
+                    transaction_reply_code = 421;
+                    ++m_throttled;
+                } else {
+                    worker.m_session_host = static_cast<int>(host_idx);
+                    worker.m_session_login = first_job[1];
+                    worker.m_session_messages = 0;
+                    ++host.m_sessions;
+                    ++m_sessions;
+                }
+            }
+
+            if (worker.m_session_host >= 0) {
+                busy_us += static_cast<int64_t>(host.m_transaction(m_random) * 1000);
+                if (!take_token(host)) {
+                    transaction_reply_code = 451;
+                    ++m_throttled;
+                } else {
+                    size_t accepted_count = 0;
+                    for (auto &reply_code : recipient_reply_codes) {
+                        auto point = m_unit(m_random);
+                        reply_code = point < host.m_model.m_rejection_rate ? 550
+                                     : point < host.m_model.m_rejection_rate + host.m_model.m_deferral_rate ? 451 : 250;
+                        transaction_reply_code = reply_code;
+                        accepted_count += reply_code == 250 ? 1 : 0;
+                    }
+                    is_sent = accepted_count > 0;
+                    if (is_sent) {
+                        transaction_reply_code = 250;
+                    }
+                    // outside bulk mode SmtpServer gives up at the rejected RCPT TO, the code is the transaction's
+                    if (jobs.size() == 1) {
+                        recipient_reply_codes[0] = 0;
+                    }
+                }
+            }
+
+            for (size_t idx = 0; idx < jobs.size(); ++idx) {
+                auto status = delivery::delivery_status(is_sent, transaction_reply_code, recipient_reply_codes[idx]);
+                if (status == db::DELIVERY_STATUS::DEFERRED) {
+                    ++m_deferred_attempts;
+                }
+                worker.m_job_source->complete(std::stoi((*jobs[idx])[0]), status);
+            }
+
+            // a failed transaction drops the connection, like a thrown SmtpException does
+            if (!is_sent || (m_config.m_session_max_messages > 0
+                             && ++worker.m_session_messages >= m_config.m_session_max_messages)) {
+                close_session(worker);
+            }
+            return busy_us;
+        }
+
+        void DeliverySimulator::close_session(Worker &worker)
+        {
+            if (worker.m_session_host < 0) {
+                return;
+            }
+            --m_hosts[worker.m_session_host].m_sessions;
+            --m_sessions;
+            worker.m_session_host = -1;
+            worker.m_session_messages = 0;
+        }
+
+        size_t DeliverySimulator::host_of(const std::string &recipient) const
+        {
+            auto pos = recipient.find_last_of('@');
+            if (pos == std::string::npos) {
+                return m_default_host;
+            }
+            auto it = m_domain_hosts.find(recipient.substr(pos + 1));
+            return it != m_domain_hosts.end() ? it->second : m_default_host;
+        }
+
+        bool DeliverySimulator::take_token(Host &host)
+        {
+            if (host.m_model.m_max_rate <= 0) {
+                return true;
+            }
+            // a bucket of one second of the rate, refilled continuously
+            auto rate_per_us = host.m_model.m_max_rate / 60e6;
+            auto capacity = std::max(host.m_model.m_max_rate / 60.0, 1.0);
+            host.m_tokens = std::min(host.m_tokens + (m_now_us - host.m_refill_us) * rate_per_us, capacity);
+            host.m_refill_us = m_now_us;
+            if (host.m_tokens < 1.0) {
+                return false;
+            }
+            host.m_tokens -= 1.0;
+            return true;
+        }
+
+        SimulationSnapshot DeliverySimulator::snapshot(uint64_t previous_sent, double interval_seconds) const
+        {
+            SimulationSnapshot state;
+            state.m_hours = m_now_us / 3600e6;
+            state.m_sent = unscaled(m_campaign->count(db::DELIVERY_STATUS::SENT));
+            state.m_failed = unscaled(m_campaign->count(db::DELIVERY_STATUS::FAILED));
+            state.m_deferred = unscaled(m_campaign->count(db::DELIVERY_STATUS::DEFERRED));
+            state.m_deferred_attempts = unscaled(m_deferred_attempts);
+            state.m_throttled = unscaled(m_throttled);
+            auto handed_out = unscaled(m_campaign->handed_out());
+            state.m_backlog = m_config.m_messages > handed_out ? m_config.m_messages - handed_out : 0;
+            uint64_t retries = 0;
+            for (const auto &worker : m_workers) {
+                retries += worker.m_retry_source ? worker.m_retry_source->retry_count() : 0;
+            }
+            state.m_retries = unscaled(retries);
+            state.m_sessions = unscaled(m_sessions);
+            if (interval_seconds > 0) {
+                state.m_messages_per_second = (state.m_sent - previous_sent) / interval_seconds;
+            }
+            return state;
+        }
+
+        uint64_t DeliverySimulator::unscaled(uint64_t count) const
+        {
+            return static_cast<uint64_t>(std::llround(count / m_config.m_scale));
+        }
+
+    }// namespace simulator
+}// namespace md
@@ -0,0 +1,159 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "../core/delivery/delivery_worker.hpp"
+#include "../core/delivery/job_source.hpp"
+#include "../core/delivery/retry_policy.hpp"
+
+namespace md
+{
+    namespace simulator
+    {
+        // log-normal, given by its median and 99th percentile in milliseconds
+        struct LatencyModel
+        {
+            LatencyModel(double median_ms = 50.0, double p99_ms = 300.0)
+                    : m_median_ms(median_ms)
+                      , m_p99_ms(p99_ms)
+            {
+            }
+
+            double m_median_ms;
+            double m_p99_ms;
+        };
+
+        /**
+         * A receiving host of the model and the recipient domain it takes, "*" takes every domain
+         * not named by another host
+         */
+        struct MxModel
+        {
+            std::string m_domain = "*";
+            double m_share = 1.0;// share of the campaign's recipients in the domain
+            LatencyModel m_connect{50.0, 300.0};// TCP, greeting, EHLO, STARTTLS and AUTH
+            LatencyModel m_transaction{100.0, 800.0};// MAIL FROM to the reply to the end of DATA
+            int m_max_connections = 0;// sessions at once, more are answered 421 at the greeting; 0 - no limit
+            int m_max_rate = 0;// messages per minute, more are answered 451 at MAIL FROM; 0 - no limit
+            double m_deferral_rate = 0.0;// share of recipients answered 451
+            double m_rejection_rate = 0.0;// share of recipients answered 550
+        };
+
+        struct SimulationConfig
+        {
+            uint64_t m_messages = 1000000;
+            double m_hours = 24.0;// virtual time after which the simulation stops
+            int m_workers = 100;// delivery workers of all processes and servers
+            int m_senders = 1;// sender logins the messages are spread over
+            int m_batch_size = 500;
+            int m_session_max_messages = 100;
+            int m_max_recipients = 1;
+            double m_fetch_ms = 5.0;// database round trip of a batch, 0 with prefetching
+            delivery::RetryPolicy m_retry_policy;
+            int m_report_interval = 3600;// seconds of virtual time between reports
+            uint64_t m_seed = 1;
+            double m_scale = 1.0;// share of the campaign simulated, workers and host limits shrink with it
+            std::vector<MxModel> m_mx;
+        };
+
+        // state of the campaign at a point of virtual time, message counts are final outcomes
+        struct SimulationSnapshot
+        {
+            double m_hours = 0.0;
+            uint64_t m_sent = 0;
+            uint64_t m_failed = 0;
+            uint64_t m_deferred = 0;// deferred and not retried, retries disabled
+            uint64_t m_deferred_attempts = 0;// attempts answered 4xx
+            uint64_t m_throttled = 0;// attempts answered 421 or 451 by a connection or rate limit
+            uint64_t m_backlog = 0;// messages no worker has taken yet
+            uint64_t m_retries = 0;// deferred messages waiting for their next attempt
+            uint64_t m_sessions = 0;// SMTP sessions open
+            double m_messages_per_second = 0.0;// sent since the previous snapshot
+        };
+
+        /**
+         * Discrete-event simulation of a campaign on a virtual clock. The workers take their batches
+         * through the production RetryJobSource and GroupingJobSource, merge transactions with
+         * DeliveryWorker::merge_identical, follow its session rules and classify the outcomes with
+         * delivery_status; only the SMTP conversation is replaced by the host models. As in the claim
+         * mode the workers draw from one shared campaign, each through a retry and grouping chain of
+         * its own. Everything runs in one thread, so a run is reproducible for a seed.
+         */
+        class DeliverySimulator
+        {
+        public:
+            explicit DeliverySimulator(SimulationConfig config);
+
+            ~DeliverySimulator();
+
+            DeliverySimulator(const DeliverySimulator &) = delete;
+
+            DeliverySimulator &operator=(const DeliverySimulator &) = delete;
+
+            // runs until every message is done or the time is up, report gets a snapshot every interval
+            SimulationSnapshot run(const std::function<void(const SimulationSnapshot &)> &report);
+
+        private:
+            class CampaignJobSource;
+
+            struct Host
+            {
+                MxModel m_model;
+                std::lognormal_distribution<double> m_connect;
+                std::lognormal_distribution<double> m_transaction;
+                int m_sessions = 0;
+                double m_tokens = 0.0;// messages the rate limit still lets through
+                int64_t m_refill_us = 0;
+            };
+
+            struct Worker
+            {
+                std::shared_ptr<delivery::RetryJobSource> m_retry_source;// null without retries
+                delivery::JobSourcePtr m_job_source;
+                StringListArray m_batch;
+                std::vector<std::vector<const StringList *>> m_transactions;
+                size_t m_next = 0;
+                int m_session_host = -1;// -1 - no session
+                std::string m_session_login;
+                int m_session_messages = 0;
+            };
+
+            // advances the worker by one step, returns the virtual time it is busy for, -1 - it is done
+            int64_t step(Worker &worker);
+
+            int64_t send(Worker &worker, const std::vector<const StringList *> &jobs);
+
+            void close_session(Worker &worker);
+
+            size_t host_of(const std::string &recipient) const;
+
+            bool take_token(Host &host);
+
+            SimulationSnapshot snapshot(uint64_t previous_sent, double interval_seconds) const;
+
+            // a count of the simulated share as a count of the whole campaign
+            uint64_t unscaled(uint64_t count) const;
+
+            SimulationConfig m_config;
+            std::vector<Host> m_hosts;
+            std::unordered_map<std::string, size_t> m_domain_hosts;
+            size_t m_default_host = 0;
+            std::mt19937_64 m_random;
+            std::uniform_real_distribution<double> m_unit{0.0, 1.0};
+            int64_t m_now_us = 0;
+
+            std::shared_ptr<CampaignJobSource> m_campaign;
+            delivery::DeliveryWorker m_merger;// only merge_identical is used, it never connects
+            std::vector<Worker> m_workers;
+
+            uint64_t m_deferred_attempts = 0;
+            uint64_t m_throttled = 0;
+            uint64_t m_sessions = 0;
+        };
+
+    }// namespace simulator
+}// namespace md
@@ -0,0 +1,179 @@
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <boost/program_options.hpp>
+#include <boost/property_tree/ini_parser.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include "delivery_simulator.hpp"
+
+/**
+ * Predicts a campaign before it is sent: the delivery settings come from the server config the
+ * workers would run with, the receiving hosts from a model file (see campaign_model.ini).
+ *
+ *     ./md_simulate --server-config server.conf --model simulator/campaign_model.ini --messages 50000000
+ *
+ * A campaign of tens of millions simulates in seconds with --scale 0.02 or so: a share of the
+ * messages goes to the same share of the workers and of the host limits, the counts are reported
+ * for the whole campaign.
+ */
+
+using namespace md;
+using namespace md::service;
+namespace po = boost::program_options;
+namespace pt = boost::property_tree;
+
+namespace
+{
+    simulator::LatencyModel read_latency(const pt::ptree &section, const std::string &key
+                                         , const simulator::LatencyModel &fallback)
+    {
+        // "median,p99" in milliseconds
+        auto value = section.get<std::string>(key, "");
+        auto comma = value.find(',');
+        if (value.empty() || comma == std::string::npos) {
+            return fallback;
+        }
+        simulator::LatencyModel model;
+        model.m_median_ms = std::stod(value.substr(0, comma));
+        model.m_p99_ms = std::stod(value.substr(comma + 1));
+        return model;
+    }
+
+    void read_model(const std::string &path, simulator::SimulationConfig &config)
+    {
+        pt::ptree model;
+        pt::read_ini(path, model);
+        for (const auto &section : model) {
+            const auto &values = section.second;
+            if (section.first == "campaign") {
+                config.m_messages = values.get<uint64_t>("messages", config.m_messages);
+                config.m_hours = values.get<double>("hours", config.m_hours);
+                config.m_workers = values.get<int>("workers", config.m_workers);
+                config.m_senders = values.get<int>("senders", config.m_senders);
+                config.m_fetch_ms = values.get<double>("fetch_ms", config.m_fetch_ms);
+                config.m_scale = values.get<double>("scale", config.m_scale);
+                continue;
+            }
+            simulator::MxModel host;
+            host.m_domain = section.first;
+            host.m_share = values.get<double>("share", host.m_share);
+            host.m_connect = read_latency(values, "connect_ms", host.m_connect);
+            host.m_transaction = read_latency(values, "transaction_ms", host.m_transaction);
+            host.m_max_connections = values.get<int>("max_connections", host.m_max_connections);
+            host.m_max_rate = values.get<int>("max_rate", host.m_max_rate);
+            host.m_deferral_rate = values.get<double>("deferral_rate", host.m_deferral_rate);
+            host.m_rejection_rate = values.get<double>("rejection_rate", host.m_rejection_rate);
+            config.m_mx.push_back(host);
+        }
+    }
+
+    void print_snapshot(const simulator::SimulationSnapshot &state)
+    {
+        printf("%7.1f %12llu %10llu %10llu %12llu %10llu %9llu %10llu %10.0f\n", state.m_hours
+               , (unsigned long long) state.m_sent, (unsigned long long) state.m_failed
+               , (unsigned long long) state.m_deferred_attempts, (unsigned long long) state.m_backlog
+               , (unsigned long long) state.m_retries, (unsigned long long) state.m_sessions
+               , (unsigned long long) state.m_throttled, state.m_messages_per_second);
+        fflush(stdout);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    std::string server_config_path;
+    std::string model_path;
+    simulator::SimulationConfig config;
+
+    po::options_description description("md_simulate: campaign delivery on a virtual clock");
+    description.add_options()
+            ("help", "this text")
+            ("server-config", po::value<std::string>(&server_config_path)
+             , "server config with batch_size, session_max_messages, max_recipients and retry_*")
+            ("model", po::value<std::string>(&model_path), "receiving hosts and campaign, INI")
+            ("messages", po::value<uint64_t>(), "messages of the campaign")
+            ("hours", po::value<double>(), "virtual hours to simulate")
+            ("workers", po::value<int>(), "delivery workers of all servers")
+            ("report-interval", po::value<int>(&config.m_report_interval)->default_value(3600)
+             , "virtual seconds between report lines")
+            ("seed", po::value<uint64_t>(&config.m_seed)->default_value(1), "random seed")
+            ("scale", po::value<double>()
+             , "share of the campaign to simulate, workers and host limits are scaled alike");
+    po::variables_map options;
+    try {
+        po::store(po::parse_command_line(argc, argv, description), options);
+        po::notify(options);
+    }
+    catch (std::exception &e) {
+        std::cerr << e.what() << std::endl << description << std::endl;
+        return 1;
+    }
+    if (options.count("help")) {
+        std::cout << description << std::endl;
+        return 0;
+    }
+
+    try {
+        if (!server_config_path.empty()) {
+            SysErrorCode error_code;
+            auto server_config = std::dynamic_pointer_cast<ServerConfig>(
+                    read_config(server_config_path, CONFIG_TYPE::SERVER, error_code));
+            if (!server_config) {
+                std::cerr << "can't read " << server_config_path << std::endl;
+                return 1;
+            }
+            config.m_workers = std::max(server_config->get_process_count(), 1)
+                               * std::max(server_config->get_server_count(), 1);
+            config.m_batch_size = server_config->get_batch_size();
+            config.m_session_max_messages = server_config->get_session_max_messages();
+            config.m_max_recipients = server_config->get_max_recipients();
+            config.m_retry_policy.m_max_attempts = server_config->get_retry_max_attempts();
+            config.m_retry_policy.m_initial_delay = server_config->get_retry_delay();
+            config.m_retry_policy.m_backoff = server_config->get_retry_backoff();
+            config.m_retry_policy.m_max_delay = server_config->get_retry_max_delay();
+            if (server_config->get_prefetch_depth() > 0) {
+                config.m_fetch_ms = 0.0;
+            }
+        }
+        if (!model_path.empty()) {
+            read_model(model_path, config);
+        }
+    }
+    catch (std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    if (options.count("messages")) {
+        config.m_messages = options["messages"].as<uint64_t>();
+    }
+    if (options.count("hours")) {
+        config.m_hours = options["hours"].as<double>();
+    }
+    if (options.count("workers")) {
+        config.m_workers = options["workers"].as<int>();
+    }
+    if (options.count("scale")) {
+        config.m_scale = options["scale"].as<double>();
+    }
+
+    printf("%llu messages, %d workers, scale %g, batch %d, session %d, recipients %d"
+           ", retries %d (%ds x%.1f up to %ds)\n"
+           , (unsigned long long) config.m_messages, config.m_workers, config.m_scale, config.m_batch_size
+           , config.m_session_max_messages, config.m_max_recipients, config.m_retry_policy.m_max_attempts
+           , config.m_retry_policy.m_initial_delay, config.m_retry_policy.m_backoff
+           , config.m_retry_policy.m_max_delay);
+    printf("%7s %12s %10s %10s %12s %10s %9s %10s %10s\n", "hours", "sent", "failed", "4xx", "backlog", "retries"
+           , "sessions", "throttled", "msgs/s");
+
+    auto start = std::chrono::steady_clock::now();
+    simulator::DeliverySimulator simulator(config);
+    auto result = simulator.run(print_snapshot);
+    auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    print_snapshot(result);
+    printf("simulated %.1f h in %.1f s: %llu sent, %llu failed, %llu deferred, %llu not done\n"
+           , result.m_hours, seconds, (unsigned long long) result.m_sent, (unsigned long long) result.m_failed
+           , (unsigned long long) result.m_deferred
+           , (unsigned long long) (config.m_messages - result.m_sent - result.m_failed - result.m_deferred));
+    return 0;
+}
@@ -23,10 +23,16 @@ namespace md
                      "path  to server config \n"
                      "e.g ./mail_distribution -d db.conf -s server.conf\n"
                      "start SMTP server ")
-                    ("db,d", po::value<std::string>(&m_path_to_db_conf)->required(),
-                     "path to file with database options")
+                    ("db,d", po::value<std::string>(&m_path_to_db_conf),
+                     "path to file with database options, not needed with --replay")
                     ("srv,s", po::value<std::string>(&m_path_to_server_conf)->required(),
-                     "path to file with server options");
+                     "path to file with server options")
+                    ("export,e", po::value<std::string>(&m_snapshot_export_path),
+                     "write core.emails to a snapshot file and exit")
+                    ("replay,r", po::value<std::string>(&m_snapshot_replay_path),
+                     "send the rows of a snapshot file, without database")
+                    ("repeat", po::value<int>(&m_snapshot_repeat)->default_value(1),
+                     "replay the snapshot this many times, 0 - endlessly");
 
         }//init_program_options
 
@@ -56,6 +62,9 @@ namespace md
                 std::cout << m_general_options_description;//show help
                 return;
             }
+            if (m_path_to_db_conf.empty() && m_snapshot_replay_path.empty()) {
+                error("the option '--db' is required but missing");
+            }
             if (!m_path_to_server_conf.empty() && !m_path_to_db_conf.empty()) {
                 set_config_path(m_path_to_server_conf, m_path_to_db_conf);
             }
@@ -71,6 +80,21 @@ namespace md
         {
             return m_path_to_server_conf;
         }
+
+        const std::string &ArgumentParser::snapshot_export_path() const
+        {
+            return m_snapshot_export_path;
+        }
+
+        const std::string &ArgumentParser::snapshot_replay_path() const
+        {
+            return m_snapshot_replay_path;
+        }
+
+        int ArgumentParser::snapshot_repeat() const
+        {
+            return m_snapshot_repeat;
+        }
 // start_parsing
 
     }// argument_parser
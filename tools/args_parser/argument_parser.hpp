@@ -30,6 +30,14 @@ namespace md
 
             const std::string &path_to_server_conf() const;
 
+            // --export: write core.emails to this snapshot file and exit
+            const std::string &snapshot_export_path() const;
+
+            // --replay: send the rows of this snapshot file instead of reading core.emails
+            const std::string &snapshot_replay_path() const;
+
+            int snapshot_repeat() const;
+
         private:
             po::options_description m_general_options_description;
 
@@ -37,6 +45,12 @@ namespace md
 
             std::string m_path_to_server_conf;
 
+            std::string m_snapshot_export_path;
+
+            std::string m_snapshot_replay_path;
+
+            int m_snapshot_repeat = 1;
+
             void init_program_options();
 
             void error(const std::string &errorMessage);
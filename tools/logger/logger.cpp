@@ -0,0 +1,322 @@
+#include <cstring>
+#include <ctime>
+#include <unordered_map>
+#include <fcntl.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "logger.hpp"
+
+namespace md
+{
+    namespace logger
+    {
+        namespace
+        {
+            const int FLUSH_INTERVAL_MS = 20;
+
+            const char *level_name(LOG_LEVEL level)
+            {
+                switch (level) {
+                    case LOG_LEVEL::DEBUG:
+                        return "DEBUG";
+                    case LOG_LEVEL::INFO:
+                        return "INFO";
+                    case LOG_LEVEL::WARNING:
+                        return "WARNING";
+                    default:
+                        return "ERROR";
+                }
+            }
+
+            int syslog_priority(LOG_LEVEL level)
+            {
+                switch (level) {
+                    case LOG_LEVEL::DEBUG:
+                        return LOG_DEBUG;
+                    case LOG_LEVEL::INFO:
+                        return LOG_INFO;
+                    case LOG_LEVEL::WARNING:
+                        return LOG_WARNING;
+                    default:
+                        return LOG_ERR;
+                }
+            }
+
+            // rate limit state of one call site
+            struct Site
+            {
+                int64_t m_second = 0;
+                int m_count = 0;
+                int m_suppressed = 0;
+            };
+        }
+
+        LOG_LEVEL level_from_string(const std::string &name)
+        {
+            if (name == "debug") {
+                return LOG_LEVEL::DEBUG;
+            }
+            if (name == "warning") {
+                return LOG_LEVEL::WARNING;
+            }
+            if (name == "error") {
+                return LOG_LEVEL::ERROR;
+            }
+            if (name == "off") {
+                return LOG_LEVEL::OFF;
+            }
+            return LOG_LEVEL::INFO;
+        }
+
+        struct Logger::ThreadState
+        {
+            std::shared_ptr<Ring> m_ring;
+            std::unordered_map<uint64_t, Site> m_sites;
+
+            ~ThreadState()
+            {
+                if (m_ring) {
+                    m_ring->m_is_orphaned.store(true, std::memory_order_release);
+                }
+            }
+        };
+
+        Logger &Logger::instance()
+        {
+            static Logger logger;
+            return logger;
+        }
+
+        Logger::Logger()
+                : m_level(static_cast<int>(LOG_LEVEL::INFO))
+                  , m_dropped(0)
+                  , m_sample_limit(10)
+                  , m_is_stopped(false)
+                  , m_is_restart_needed(false)
+        {
+            pthread_atfork(&Logger::prepare_fork, &Logger::parent_after_fork, &Logger::child_after_fork);
+        }
+
+        Logger::~Logger()
+        {
+            stop();
+        }
+
+        void Logger::start(const std::string &path, LOG_LEVEL level, int sample_limit)
+        {
+            set_level(level);
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_sample_limit.store(sample_limit, std::memory_order_relaxed);
+            if (m_fd > STDERR_FILENO) {
+                close(m_fd);
+            }
+            m_fd = -1;
+            if (path == "-") {
+                m_fd = STDERR_FILENO;
+            } else if (!path.empty()) {
+                m_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            }
+            if (m_fd < 0 && !m_is_syslog_open) {
+                // also the fallback when the file can't be opened
+                openlog("mail_distribution", LOG_PID, LOG_USER);
+                m_is_syslog_open = true;
+            }
+            if (!m_writer) {
+                m_is_stopped = false;
+                m_writer.reset(new std::thread(&Logger::run, this));
+            }
+        }
+
+        void Logger::stop()
+        {
+            std::unique_ptr<std::thread> writer;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                writer = std::move(m_writer);
+                m_is_stopped = true;
+            }
+            if (writer && writer->joinable()) {
+                writer->join();
+            }
+            std::lock_guard<std::mutex> lock(m_mutex);
+            drain();
+        }
+
+        void Logger::write(LOG_LEVEL level, const char *file, int line, std::string message)
+        {
+            auto &state = thread_state();
+            if (m_is_restart_needed.load(std::memory_order_relaxed)) {
+                restart_after_fork();
+            }
+            if (!state.m_ring) {
+                state.m_ring = register_thread();
+            }
+
+            auto now = std::chrono::system_clock::now();
+            auto sample_limit = m_sample_limit.load(std::memory_order_relaxed);
+            if (sample_limit > 0) {
+                auto &site = state.m_sites[(reinterpret_cast<uintptr_t>(file) << 20) ^ static_cast<uint64_t>(line)];
+                auto second = std::chrono::duration_cast<std::chrono::seconds>(now.time_since_epoch()).count();
+                if (site.m_second != second) {
+                    site.m_second = second;
+                    site.m_count = 0;
+                }
+                if (++site.m_count > sample_limit) {
+                    ++site.m_suppressed;
+                    return;
+                }
+                if (site.m_suppressed > 0) {
+                    message += " (" + std::to_string(site.m_suppressed) + " more like this suppressed)";
+                    site.m_suppressed = 0;
+                }
+            }
+
+            auto &ring = *state.m_ring;
+            auto head = ring.m_head.load(std::memory_order_relaxed);
+            if (head - ring.m_tail.load(std::memory_order_acquire) >= RING_CAPACITY) {
+                m_dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            auto &entry = ring.m_entries[head % RING_CAPACITY];
+            entry.m_level = level;
+            entry.m_file = file;
+            entry.m_line = line;
+            entry.m_time = now;
+            entry.m_message = std::move(message);
+            ring.m_head.store(head + 1, std::memory_order_release);
+        }
+
+        Logger::ThreadState &Logger::thread_state()
+        {
+            static thread_local ThreadState state;
+            return state;
+        }
+
+        std::shared_ptr<Logger::Ring> Logger::register_thread()
+        {
+            std::shared_ptr<Ring> ring(new Ring());
+            ring->m_head.store(0, std::memory_order_relaxed);
+            ring->m_tail.store(0, std::memory_order_relaxed);
+            ring->m_is_orphaned.store(false, std::memory_order_relaxed);
+            ring->m_thread_id = syscall(SYS_gettid);
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_rings.push_back(ring);
+            return ring;
+        }
+
+        void Logger::run()
+        {
+            while (!m_is_stopped.load(std::memory_order_relaxed)) {
+                // polling instead of a condition variable keeps the producers free of system calls
+                std::this_thread::sleep_for(std::chrono::milliseconds(FLUSH_INTERVAL_MS));
+                std::lock_guard<std::mutex> lock(m_mutex);
+                drain();
+            }
+        }
+
+        void Logger::drain()
+        {
+            auto pid = getpid();
+            m_buffer.clear();
+            char prefix[128];
+            for (size_t idx = 0; idx < m_rings.size();) {
+                auto &ring = *m_rings[idx];
+                auto tail = ring.m_tail.load(std::memory_order_relaxed);
+                auto head = ring.m_head.load(std::memory_order_acquire);
+                for (; tail != head; ++tail) {
+                    auto &entry = ring.m_entries[tail % RING_CAPACITY];
+                    auto file = strrchr(entry.m_file, '/');
+                    file = file ? file + 1 : entry.m_file;
+                    if (m_fd < 0) {
+                        syslog(syslog_priority(entry.m_level), "%s:%d %s", file, entry.m_line
+                               , entry.m_message.c_str());
+                    } else {
+                        auto micros = std::chrono::duration_cast<std::chrono::microseconds>(
+                                entry.m_time.time_since_epoch()).count();
+                        time_t seconds = micros / 1000000;
+                        tm utc{};
+                        gmtime_r(&seconds, &utc);
+                        auto length = strftime(prefix, sizeof(prefix), "%Y-%m-%dT%H:%M:%S", &utc);
+                        snprintf(prefix + length, sizeof(prefix) - length, ".%06dZ [%d:%ld] %s %s:%d "
+                                 , static_cast<int>(micros % 1000000), pid, ring.m_thread_id
+                                 , level_name(entry.m_level), file, entry.m_line);
+                        m_buffer += prefix;
+                        m_buffer += entry.m_message;
+                        m_buffer += '\n';
+                    }
+                    std::string().swap(entry.m_message);
+                }
+                ring.m_tail.store(tail, std::memory_order_release);
+
+                if (ring.m_is_orphaned.load(std::memory_order_acquire)
+                    && ring.m_head.load(std::memory_order_acquire) == tail) {
+                    m_rings.erase(m_rings.begin() + idx);
+                } else {
+                    ++idx;
+                }
+            }
+
+            auto dropped = m_dropped.load(std::memory_order_relaxed);
+            if (dropped != m_reported_dropped) {
+                auto message = std::to_string(dropped - m_reported_dropped) + " log messages dropped, rings full";
+                m_reported_dropped = dropped;
+                if (m_fd < 0) {
+                    syslog(LOG_WARNING, "%s", message.c_str());
+                } else {
+                    m_buffer += message + '\n';
+                }
+            }
+
+            // one write for the whole batch; O_APPEND keeps lines of concurrent processes apart
+            for (size_t offset = 0; m_fd >= 0 && offset < m_buffer.size();) {
+                auto written = ::write(m_fd, m_buffer.data() + offset, m_buffer.size() - offset);
+                if (written <= 0) {
+                    break;
+                }
+                offset += static_cast<size_t>(written);
+            }
+        }
+
+        void Logger::restart_after_fork()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_is_restart_needed.exchange(false)) {
+                m_is_stopped = false;
+                m_writer.reset(new std::thread(&Logger::run, this));
+            }
+        }
+
+        void Logger::prepare_fork()
+        {
+            // the child must not inherit the lock in the middle of a drain
+            instance().m_mutex.lock();
+        }
+
+        void Logger::parent_after_fork()
+        {
+            instance().m_mutex.unlock();
+        }
+
+        void Logger::child_after_fork()
+        {
+            auto &logger = instance();
+            // the rings' contents are written by the parent; only the forking thread lives on here
+            logger.m_rings.clear();
+            auto &state = thread_state();
+            if (state.m_ring) {
+                state.m_ring->m_tail.store(state.m_ring->m_head.load());
+                state.m_ring->m_thread_id = syscall(SYS_gettid);
+                logger.m_rings.push_back(state.m_ring);
+            }
+            if (logger.m_writer) {
+                // the writer thread doesn't exist in the child, its handle can neither be joined nor detached
+                logger.m_writer.release();
+                logger.m_is_restart_needed = true;
+            }
+            logger.m_mutex.unlock();
+        }
+
+    }// namespace logger
+}// namespace md
@@ -0,0 +1,147 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// levels below it are compiled out, -DMD_LOG_MIN_LEVEL=1 removes every MD_LOG_DEBUG from the binary
+#ifndef MD_LOG_MIN_LEVEL
+#define MD_LOG_MIN_LEVEL 0
+#endif
+
+// the message expression is evaluated only when the level is enabled
+#define MD_LOG(level, message)                                                                     \
+    do {                                                                                           \
+        if (static_cast<int>(level) >= MD_LOG_MIN_LEVEL                                            \
+            && ::md::logger::Logger::instance().is_enabled(level)) {                               \
+            ::md::logger::Logger::instance().write(level, __FILE__, __LINE__, message);            \
+        }                                                                                          \
+    } while (false)
+
+#define MD_LOG_DEBUG(message) MD_LOG(::md::logger::LOG_LEVEL::DEBUG, message)
+#define MD_LOG_INFO(message) MD_LOG(::md::logger::LOG_LEVEL::INFO, message)
+#define MD_LOG_WARNING(message) MD_LOG(::md::logger::LOG_LEVEL::WARNING, message)
+#define MD_LOG_ERROR(message) MD_LOG(::md::logger::LOG_LEVEL::ERROR, message)
+
+namespace md
+{
+    namespace logger
+    {
+        enum class LOG_LEVEL : int
+        {
+            DEBUG = 0,
+            INFO = 1,
+            WARNING = 2,
+            ERROR = 3,
+            OFF = 4
+        };
+
+        // "debug", "info", "warning", "error" or "off", anything else is INFO
+        LOG_LEVEL level_from_string(const std::string &name);
+
+        /**
+         * Asynchronous logger. A thread appends its messages to a ring buffer of its own, a single
+         * producer/single consumer queue that costs no lock and no system call; a full ring drops the
+         * message and counts it instead of blocking. A background thread drains all rings every
+         * 20 ms and writes them in one batch to the log file, to stderr ("-") or to
+         * syslog (empty path).
+         * Every call site may log sample_limit messages per second per thread, the rest is counted
+         * and reported with the next message that gets through.
+         * Forked children start a writer of their own on their first message.
+         */
+        class Logger
+        {
+        public:
+            static Logger &instance();
+
+            ~Logger();
+
+            // (re)opens the destination; messages logged before that wait in the rings
+            void start(const std::string &path, LOG_LEVEL level, int sample_limit = 10);
+
+            // writes what is left and stops the writer thread
+            void stop();
+
+            bool is_enabled(LOG_LEVEL level) const
+            {
+                return static_cast<int>(level) >= m_level.load(std::memory_order_relaxed);
+            }
+
+            void set_level(LOG_LEVEL level)
+            {
+                m_level.store(static_cast<int>(level), std::memory_order_relaxed);
+            }
+
+            void write(LOG_LEVEL level, const char *file, int line, std::string message);
+
+            // messages lost to full rings since the start
+            uint64_t dropped() const
+            {
+                return m_dropped.load(std::memory_order_relaxed);
+            }
+
+        private:
+            static const size_t RING_CAPACITY = 1024;
+
+            struct Entry
+            {
+                LOG_LEVEL m_level;
+                const char *m_file;
+                int m_line;
+                std::chrono::system_clock::time_point m_time;
+                std::string m_message;
+            };
+
+            struct Ring
+            {
+                Entry m_entries[RING_CAPACITY];
+                std::atomic<size_t> m_head;// next entry the owner writes
+                char m_padding[64];// keeps head and tail on different cache lines
+                std::atomic<size_t> m_tail;// next entry the writer reads
+                std::atomic<bool> m_is_orphaned;// the owning thread exited
+                long m_thread_id;
+            };
+
+            struct ThreadState;
+
+            Logger();
+
+            static ThreadState &thread_state();
+
+            std::shared_ptr<Ring> register_thread();
+
+            void run();
+
+            // called with m_mutex held
+            void drain();
+
+            void restart_after_fork();
+
+            static void prepare_fork();
+
+            static void parent_after_fork();
+
+            static void child_after_fork();
+
+            std::atomic<int> m_level;
+            std::atomic<uint64_t> m_dropped;
+            uint64_t m_reported_dropped = 0;
+            std::atomic<int> m_sample_limit;
+
+            std::mutex m_mutex;// guards the ring list and the destination
+            std::vector<std::shared_ptr<Ring>> m_rings;
+            int m_fd = -1;// -1 - syslog
+            bool m_is_syslog_open = false;
+            std::string m_buffer;
+
+            std::unique_ptr<std::thread> m_writer;
+            std::atomic<bool> m_is_stopped;
+            std::atomic<bool> m_is_restart_needed;
+        };
+
+    }// namespace logger
+}// namespace md
@@ -0,0 +1,24 @@
+#pragma once
+
+/**
+ * USDT probes of the "md" provider. With sys/sdt.h (systemtap-sdt-dev) every probe is a single nop
+ * plus a note in the ELF file until bpftrace or perf attaches to it, e.g.
+ *   bpftrace -e 'usdt:./mail_distributions:md:smtp_reply { @codes[arg0] = count(); }'
+ * Without the header the probes compile to nothing.
+ *
+ * message_start(job id, recipients)        message_end(job id, is sent)
+ * smtp_command(send buffer)                smtp_reply(reply code)
+ * tls_handshake_start()                    tls_handshake_end(is established)
+ * db_query_start(query)                    db_query_end()
+ * pool_acquire(replica, idle connections)  pool_release(replica)     replica -1 is the primary
+ */
+#ifdef MD_HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define MD_PROBE(name) DTRACE_PROBE(md, name)
+#define MD_PROBE1(name, arg1) DTRACE_PROBE1(md, name, arg1)
+#define MD_PROBE2(name, arg1, arg2) DTRACE_PROBE2(md, name, arg1, arg2)
+#else
+#define MD_PROBE(name) do {} while (false)
+#define MD_PROBE1(name, arg1) do {} while (false)
+#define MD_PROBE2(name, arg1, arg2) do {} while (false)
+#endif
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+namespace md
+{
+    namespace service
+    {
+        /**
+         * Blocking multi-producer/multi-consumer queue with a fixed capacity.
+         * push waits while the queue is full, pop waits while it is empty;
+         * after close() both return false once nothing is left to pop.
+         */
+        template<typename T>
+        class BoundedQueue
+        {
+        public:
+            explicit BoundedQueue(size_t capacity) : m_capacity(capacity > 0 ? capacity : 1), m_size(0)
+            {}
+
+            BoundedQueue(const BoundedQueue &) = delete;
+
+            BoundedQueue &operator=(const BoundedQueue &) = delete;
+
+            bool push(T item)
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_not_full.wait(lock, [this]() { return m_is_closed || m_items.size() < m_capacity; });
+                if (m_is_closed) {
+                    return false;
+                }
+                m_items.push_back(std::move(item));
+                m_size.store(m_items.size(), std::memory_order_relaxed);
+                lock.unlock();
+                m_not_empty.notify_one();
+                return true;
+            }
+
+            bool pop(T &item)
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_not_empty.wait(lock, [this]() { return m_is_closed || !m_items.empty(); });
+                if (m_items.empty()) {
+                    return false;
+                }
+                item = std::move(m_items.front());
+                m_items.pop_front();
+                m_size.store(m_items.size(), std::memory_order_relaxed);
+                lock.unlock();
+                m_not_full.notify_one();
+                return true;
+            }
+
+            void close()
+            {
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    m_is_closed = true;
+                }
+                m_not_full.notify_all();
+                m_not_empty.notify_all();
+            }
+
+            // without the lock, monitoring must not stall producers and consumers
+            size_t size() const
+            {
+                return m_size.load(std::memory_order_relaxed);
+            }
+
+            size_t capacity() const
+            {
+                return m_capacity;
+            }
+
+        private:
+            const size_t m_capacity;
+            mutable std::mutex m_mutex;
+            std::condition_variable m_not_full;
+            std::condition_variable m_not_empty;
+            std::deque<T> m_items;
+            std::atomic<size_t> m_size;
+            bool m_is_closed = false;
+        };
+    }
+}
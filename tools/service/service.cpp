@@ -3,7 +3,6 @@
 #include <iostream>
 #include <fstream>
 #include "service.hpp"
-#include <syslog.h>
 #include <boost/asio/ip/address.hpp>
 
 namespace md
@@ -65,13 +64,6 @@ namespace md
             }
         }
 
-        void write_sys_log(const std::string &error_message, int log_level)
-        {
-            openlog("mail_distribution", log_level | LOG_PID, LOG_USER);
-            syslog(LOG_NOTICE, "error %s", error_message.c_str());
-            closelog();
-        }
-
         unsigned char *char2uchar(const char *in)
         {
             unsigned long length = strlen(in);
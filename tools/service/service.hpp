@@ -6,10 +6,10 @@
 #include <vector>
 #include <string>
 #include <boost/filesystem.hpp>
-#include <syslog.h>
 #include <boost/signals2.hpp>
 #include <boost/program_options.hpp>
 #include <iostream>
+#include "../logger/logger.hpp"
 
 
 namespace md
@@ -101,6 +101,53 @@ namespace md
                 if (port != keyMap.end()) {
                     m_port = std::stoi(port->second);
                 }
+                auto pipeline_depth = keyMap.find("pipeline_depth");
+                if (pipeline_depth != keyMap.end()) {
+                    m_pipeline_depth = std::stoi(pipeline_depth->second);
+                }
+                auto delivery_log_table = keyMap.find("delivery_log_table");
+                if (delivery_log_table != keyMap.end()) {
+                    m_delivery_log_table = delivery_log_table->second;
+                }
+                auto delivery_log_batch = keyMap.find("delivery_log_batch");
+                if (delivery_log_batch != keyMap.end()) {
+                    m_delivery_log_batch = std::stoi(delivery_log_batch->second);
+                }
+                auto delivery_log_interval = keyMap.find("delivery_log_interval");
+                if (delivery_log_interval != keyMap.end()) {
+                    m_delivery_log_interval = std::stoi(delivery_log_interval->second);
+                }
+                auto checkpoint_table = keyMap.find("checkpoint_table");
+                if (checkpoint_table != keyMap.end()) {
+                    m_checkpoint_table = checkpoint_table->second;
+                }
+                auto checkpoint_interval = keyMap.find("checkpoint_interval");
+                if (checkpoint_interval != keyMap.end()) {
+                    m_checkpoint_interval = std::stoi(checkpoint_interval->second);
+                }
+                auto async_io_threads = keyMap.find("async_io_threads");
+                if (async_io_threads != keyMap.end()) {
+                    m_async_io_threads = std::stoi(async_io_threads->second);
+                }
+                auto replicas = keyMap.find("replicas");
+                if (replicas != keyMap.end()) {
+                    std::string list = replicas->second;
+                    for (size_t begin = 0, end; begin < list.size(); begin = end + 1) {
+                        end = list.find(',', begin);
+                        if (end == std::string::npos) {
+                            end = list.size();
+                        }
+                        auto first = list.find_first_not_of(' ', begin);
+                        auto last = list.find_last_not_of(' ', end - 1);
+                        if (first < end && last != std::string::npos && last >= first) {
+                            m_replicas.push_back(list.substr(first, last - first + 1));
+                        }
+                    }
+                }
+                auto max_replica_lag = keyMap.find("max_replica_lag");
+                if (max_replica_lag != keyMap.end()) {
+                    m_max_replica_lag = std::stoi(max_replica_lag->second);
+                }
             }
 
             bool is_valid() override
@@ -121,6 +168,15 @@ namespace md
             std::string m_database_name;
             std::string m_hostname;
             int m_port = 5432;
+            int m_pipeline_depth = 256;// statements queued in libpq pipeline mode before a sync point
+            std::string m_delivery_log_table = "core.delivery_log";
+            int m_delivery_log_batch = 2000;// outcomes buffered before a COPY is forced
+            int m_delivery_log_interval = 1000;// ms between COPY flushes of a partial batch
+            std::string m_checkpoint_table = "core.delivery_checkpoint";// empty - range workers keep no progress
+            int m_checkpoint_interval = 5000;// ms between checkpoint writes of a range worker
+            int m_async_io_threads = 1;// threads driving the sockets of the asynchronous executor
+            StringList m_replicas;// host[:port] of the read replicas, m_hostname is the primary
+            int m_max_replica_lag = 5000;// ms of replay lag after which a replica gets no reads
 
         };
 
@@ -132,6 +188,27 @@ namespace md
             int m_server_count;
             int m_order_number;
             int m_process_count;
+            std::string m_job_source;
+            std::string m_notify_channel;
+            int m_poll_interval;
+            int m_notify_lookback;
+            int m_batch_size;
+            int m_claim_lease;
+            int m_prefetch_depth;
+            int m_session_max_messages;
+            int m_max_recipients;
+            std::string m_spool_dir;
+            int m_spool_segment_size;
+            std::string m_log_file;
+            std::string m_log_level;
+            int m_log_sample_limit;
+            std::string m_trace_file;
+            double m_trace_sample_rate;
+            int m_retry_max_attempts;
+            int m_retry_delay;
+            double m_retry_backoff;
+            int m_retry_max_delay;
+            int m_progress_interval;
         public:
             ServerConfig()
             : Config()
@@ -139,6 +216,24 @@ namespace md
             , m_server_count(0)
             , m_order_number(0)
             , m_process_count(0)
+            , m_job_source("range")
+            , m_notify_channel("core_emails_insert")
+            , m_poll_interval(5000)
+            , m_notify_lookback(1000)
+            , m_batch_size(500)
+            , m_claim_lease(600)
+            , m_prefetch_depth(2)
+            , m_session_max_messages(100)
+            , m_max_recipients(1)
+            , m_spool_segment_size(64)
+            , m_log_level("info")
+            , m_log_sample_limit(10)
+            , m_trace_sample_rate(0.01)
+            , m_retry_max_attempts(0)
+            , m_retry_delay(300)
+            , m_retry_backoff(2.0)
+            , m_retry_max_delay(14400)
+            , m_progress_interval(1000)
             {
                 m_type = CONFIG_TYPE::SERVER;
             }
@@ -149,6 +244,24 @@ namespace md
                       , m_server_count(0)
                       , m_order_number(0)
                       , m_process_count(0)
+                      , m_job_source("range")
+                      , m_notify_channel("core_emails_insert")
+                      , m_poll_interval(5000)
+                      , m_notify_lookback(1000)
+                      , m_batch_size(500)
+                      , m_claim_lease(600)
+                      , m_prefetch_depth(2)
+                      , m_session_max_messages(100)
+                      , m_max_recipients(1)
+                      , m_spool_segment_size(64)
+                      , m_log_level("info")
+                      , m_log_sample_limit(10)
+                      , m_trace_sample_rate(0.01)
+                      , m_retry_max_attempts(0)
+                      , m_retry_delay(300)
+                      , m_retry_backoff(2.0)
+                      , m_retry_max_delay(14400)
+                      , m_progress_interval(1000)
             {
                 m_type = CONFIG_TYPE::SERVER;
                 auto it_domain = keyMap.find("domain");
@@ -165,6 +278,105 @@ namespace md
 
                 auto it_process_count = keyMap.find("process_count");
                 m_process_count = it_process_count != keyMap.end() ? std::stoi(it_process_count->second) : -1;
+
+                // job pickup: "range" sends the configured slice once, "listen" keeps picking up new rows,
+                // "claim" pulls batches from the shared table with SKIP LOCKED
+                // (server_count/order_number are ignored)
+                auto it_job_source = keyMap.find("job_source");
+                if (it_job_source != keyMap.end()) {
+                    m_job_source = it_job_source->second;
+                }
+
+                auto it_notify_channel = keyMap.find("notify_channel");
+                if (it_notify_channel != keyMap.end()) {
+                    m_notify_channel = it_notify_channel->second;
+                }
+
+                auto it_poll_interval = keyMap.find("poll_interval");
+                if (it_poll_interval != keyMap.end()) {
+                    m_poll_interval = std::stoi(it_poll_interval->second);
+                }
+
+                auto it_notify_lookback = keyMap.find("notify_lookback");
+                if (it_notify_lookback != keyMap.end()) {
+                    m_notify_lookback = std::stoi(it_notify_lookback->second);
+                }
+
+                auto it_batch_size = keyMap.find("batch_size");
+                if (it_batch_size != keyMap.end()) {
+                    m_batch_size = std::stoi(it_batch_size->second);
+                }
+
+                auto it_claim_lease = keyMap.find("claim_lease");
+                if (it_claim_lease != keyMap.end()) {
+                    m_claim_lease = std::stoi(it_claim_lease->second);
+                }
+
+                auto it_prefetch_depth = keyMap.find("prefetch_depth");
+                if (it_prefetch_depth != keyMap.end()) {
+                    m_prefetch_depth = std::stoi(it_prefetch_depth->second);
+                }
+
+                auto it_session_max_messages = keyMap.find("session_max_messages");
+                if (it_session_max_messages != keyMap.end()) {
+                    m_session_max_messages = std::stoi(it_session_max_messages->second);
+                }
+
+                auto it_max_recipients = keyMap.find("max_recipients");
+                if (it_max_recipients != keyMap.end()) {
+                    m_max_recipients = std::stoi(it_max_recipients->second);
+                }
+
+                auto it_spool_dir = keyMap.find("spool_dir");
+                if (it_spool_dir != keyMap.end()) {
+                    m_spool_dir = it_spool_dir->second;
+                }
+
+                auto it_spool_segment_size = keyMap.find("spool_segment_size");
+                if (it_spool_segment_size != keyMap.end()) {
+                    m_spool_segment_size = std::stoi(it_spool_segment_size->second);
+                }
+                auto it_log_file = keyMap.find("log_file");
+                if (it_log_file != keyMap.end()) {
+                    m_log_file = it_log_file->second;
+                }
+                auto it_log_level = keyMap.find("log_level");
+                if (it_log_level != keyMap.end()) {
+                    m_log_level = it_log_level->second;
+                }
+                auto it_log_sample_limit = keyMap.find("log_sample_limit");
+                if (it_log_sample_limit != keyMap.end()) {
+                    m_log_sample_limit = std::stoi(it_log_sample_limit->second);
+                }
+                auto it_trace_file = keyMap.find("trace_file");
+                if (it_trace_file != keyMap.end()) {
+                    m_trace_file = it_trace_file->second;
+                }
+                auto it_trace_sample_rate = keyMap.find("trace_sample_rate");
+                if (it_trace_sample_rate != keyMap.end()) {
+                    m_trace_sample_rate = std::stod(it_trace_sample_rate->second);
+                }
+                // deferred messages get up to retry_max_attempts attempts in all, 0 - no retries in the worker
+                auto it_retry_max_attempts = keyMap.find("retry_max_attempts");
+                if (it_retry_max_attempts != keyMap.end()) {
+                    m_retry_max_attempts = std::stoi(it_retry_max_attempts->second);
+                }
+                auto it_retry_delay = keyMap.find("retry_delay");
+                if (it_retry_delay != keyMap.end()) {
+                    m_retry_delay = std::stoi(it_retry_delay->second);
+                }
+                auto it_retry_backoff = keyMap.find("retry_backoff");
+                if (it_retry_backoff != keyMap.end()) {
+                    m_retry_backoff = std::stod(it_retry_backoff->second);
+                }
+                auto it_retry_max_delay = keyMap.find("retry_max_delay");
+                if (it_retry_max_delay != keyMap.end()) {
+                    m_retry_max_delay = std::stoi(it_retry_max_delay->second);
+                }
+                auto it_progress_interval = keyMap.find("progress_interval");
+                if (it_progress_interval != keyMap.end()) {
+                    m_progress_interval = std::stoi(it_progress_interval->second);
+                }
             }
 
             bool is_valid() override
@@ -207,6 +419,131 @@ namespace md
             {
                 return m_process_count;
             }
+
+            // range (default), listen, claim, or campaigns started over REST
+            const std::string &get_job_source() const
+            {
+                return m_job_source;
+            }
+
+            const std::string &get_notify_channel() const
+            {
+                return m_notify_channel;
+            }
+
+            int get_poll_interval() const
+            {
+                return m_poll_interval;
+            }
+
+            // ids below the resume point the pickup looks back at for rows committed late
+            int get_notify_lookback() const
+            {
+                return m_notify_lookback;
+            }
+
+            int get_batch_size() const
+            {
+                return m_batch_size;
+            }
+
+            // seconds until an unfinished claim may be taken by another worker
+            int get_claim_lease() const
+            {
+                return m_claim_lease;
+            }
+
+            // batches fetched ahead of the sender, 0 fetches only when the sender asks; at most 1 with claims
+            int get_prefetch_depth() const
+            {
+                return m_prefetch_depth;
+            }
+
+            // messages sent through one authenticated SMTP session before it is reopened, 0 - no limit
+            int get_session_max_messages() const
+            {
+                return m_session_max_messages;
+            }
+
+            // RCPT TO per transaction when identical messages go to one domain, 1 (the default) - a transaction
+            // per message; bulk transactions are opt-in
+            int get_max_recipients() const
+            {
+                return m_max_recipients;
+            }
+
+            // local job spool of the workers, empty - no spool
+            const std::string &get_spool_dir() const
+            {
+                return m_spool_dir;
+            }
+
+            // spool segment file size in MB
+            int get_spool_segment_size() const
+            {
+                return m_spool_segment_size;
+            }
+
+            // log destination, empty - syslog, "-" - stderr
+            const std::string &get_log_file() const
+            {
+                return m_log_file;
+            }
+
+            // debug, info, warning, error or off
+            const std::string &get_log_level() const
+            {
+                return m_log_level;
+            }
+
+            // messages per second a log call site may write, 0 - no limit
+            int get_log_sample_limit() const
+            {
+                return m_log_sample_limit;
+            }
+
+            // Chrome trace file of the sampled messages, empty - no tracing
+            const std::string &get_trace_file() const
+            {
+                return m_trace_file;
+            }
+
+            // share of the messages traced, 0..1
+            double get_trace_sample_rate() const
+            {
+                return m_trace_sample_rate;
+            }
+
+            // attempts of a deferred message, the first one included, 0 - deferred messages are left
+            // to the job source (claim lease, spool or the next run)
+            int get_retry_max_attempts() const
+            {
+                return m_retry_max_attempts;
+            }
+
+            // seconds from the first attempt to the second one
+            int get_retry_delay() const
+            {
+                return m_retry_delay;
+            }
+
+            // factor the delay grows by with every further attempt
+            double get_retry_backoff() const
+            {
+                return m_retry_backoff;
+            }
+
+            // upper bound of the delay in seconds
+            int get_retry_max_delay() const
+            {
+                return m_retry_max_delay;
+            }
+
+            // ms between the updates of GET campaigns/{id}/progress
+            int get_progress_interval() const
+            {
+                return m_progress_interval;
+            }
         };
 
 
@@ -216,8 +553,6 @@ namespace md
 
         ConfigPtr read_config(const std::string &filename, CONFIG_TYPE config_type, SysErrorCode &error_code);
 
-        void write_sys_log(const std::string &error_message, int log_level  = LOG_PERROR);
-
         unsigned char *char2uchar(const char *in);
 
         using DataRange = std::pair<int, int>;
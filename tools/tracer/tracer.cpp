@@ -0,0 +1,261 @@
+#include <fstream>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "tracer.hpp"
+
+namespace md
+{
+    namespace tracer
+    {
+        namespace
+        {
+            std::string escape(const std::string &text)
+            {
+                std::string escaped;
+                escaped.reserve(text.size());
+                for (auto symbol : text) {
+                    if (symbol == '"' || symbol == '\\') {
+                        escaped += '\\';
+                        escaped += symbol;
+                    } else if (static_cast<unsigned char>(symbol) >= 0x20) {
+                        escaped += symbol;
+                    }
+                }
+                return escaped;
+            }
+
+            int64_t to_us(Clock::time_point time)
+            {
+                return std::chrono::duration_cast<std::chrono::microseconds>(time.time_since_epoch()).count();
+            }
+
+            // every write ends the file with it, the next one writes over it
+            const char TRAILER[] = "\n]}\n";
+        }
+
+        struct Tracer::ThreadState
+        {
+            std::shared_ptr<Buffer> m_buffer;
+            bool m_is_sampled = false;
+            uint64_t m_random = 0;
+        };
+
+        Tracer &Tracer::instance()
+        {
+            static Tracer tracer;
+            return tracer;
+        }
+
+        Tracer::Tracer()
+                : m_sample_rate(0)
+                  , m_next_flush_us(0)
+        {
+            pthread_atfork(&Tracer::prepare_fork, &Tracer::parent_after_fork, &Tracer::child_after_fork);
+        }
+
+        Tracer::~Tracer()
+        {
+            stop();
+        }
+
+        void Tracer::start(const std::string &path, double sample_rate)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_path = path;
+            m_pid = getpid();
+            m_written_path.clear();
+            m_next_flush_us = to_us(Clock::now()) + FLUSH_INTERVAL_MS * 1000;
+            m_sample_rate = path.empty() ? 0 : std::min(sample_rate, 1.0);
+        }
+
+        void Tracer::stop()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            write_events();
+            m_path.clear();
+            m_sample_rate = 0;
+        }
+
+        void Tracer::flush()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            write_events();
+        }
+
+        void Tracer::write_events()
+        {
+            if (m_path.empty()) {
+                return;
+            }
+            auto path = getpid() == m_pid ? m_path : m_path + "." + std::to_string(getpid());
+            std::fstream file;
+            if (path == m_written_path) {
+                file.open(path, std::ios::in | std::ios::out);
+                file.seekp(-static_cast<std::streamoff>(sizeof(TRAILER) - 1), std::ios::end);
+            }
+            if (!file.is_open()) {
+                file.open(path, std::ios::out | std::ios::trunc);
+                file << "{\"traceEvents\":[";
+                m_written_path = path;
+                m_has_events = false;
+            }
+            for (auto &buffer : m_buffers) {
+                std::lock_guard<std::mutex> buffer_lock(buffer->m_mutex);
+                for (const auto &event : buffer->m_events) {
+                    file << (m_has_events ? ",\n" : "\n") << "{\"name\":\"" << event.m_name
+                         << "\",\"cat\":\"md\",\"ph\":\"X\",\"ts\":" << event.m_start_us
+                         << ",\"dur\":" << event.m_duration_us << ",\"pid\":" << getpid()
+                         << ",\"tid\":" << buffer->m_thread_id;
+                    if (!event.m_args.empty()) {
+                        file << ",\"args\":{" << event.m_args << "}";
+                    }
+                    file << "}";
+                    m_has_events = true;
+                }
+                buffer->m_events.clear();
+            }
+            file << TRAILER;
+        }
+
+        void Tracer::flush_if_due(Clock::time_point now)
+        {
+            auto now_us = to_us(now);
+            if (now_us < m_next_flush_us.load(std::memory_order_relaxed)) {
+                return;
+            }
+            std::unique_lock<std::mutex> lock(m_mutex, std::try_to_lock);
+            if (!lock.owns_lock() || now_us < m_next_flush_us) {
+                return;
+            }
+            m_next_flush_us = now_us + FLUSH_INTERVAL_MS * 1000;
+            write_events();
+        }
+
+        bool Tracer::is_sampled()
+        {
+            return thread_state().m_is_sampled;
+        }
+
+        void Tracer::record(const char *name, Clock::time_point start, Clock::time_point end
+                            , const std::string &args)
+        {
+            if (!is_sampled()) {
+                return;
+            }
+            auto &buffer = this->buffer();
+            std::lock_guard<std::mutex> lock(buffer.m_mutex);
+            if (buffer.m_events.size() < MAX_THREAD_EVENTS) {
+                buffer.m_events.push_back({name, to_us(start), to_us(end) - to_us(start), args});
+            }
+        }
+
+        Tracer::ThreadState &Tracer::thread_state()
+        {
+            static thread_local ThreadState state;
+            return state;
+        }
+
+        Tracer::Buffer &Tracer::buffer()
+        {
+            auto &state = thread_state();
+            if (!state.m_buffer) {
+                state.m_buffer = std::make_shared<Buffer>();
+                state.m_buffer->m_thread_id = syscall(SYS_gettid);
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_buffers.push_back(state.m_buffer);
+            }
+            return *state.m_buffer;
+        }
+
+        bool Tracer::sample()
+        {
+            auto rate = m_sample_rate.load(std::memory_order_relaxed);
+            if (rate <= 0) {
+                return false;
+            }
+            if (rate >= 1) {
+                return true;
+            }
+            // xorshift64, seeded per thread
+            auto &random = thread_state().m_random;
+            if (random == 0) {
+                random = (static_cast<uint64_t>(syscall(SYS_gettid)) * 0x9E3779B97F4A7C15ull
+                          ^ static_cast<uint64_t>(Clock::now().time_since_epoch().count())) | 1;
+            }
+            random ^= random << 13;
+            random ^= random >> 7;
+            random ^= random << 17;
+            return static_cast<double>(random >> 11) / static_cast<double>(1ull << 53) < rate;
+        }
+
+        void Tracer::prepare_fork()
+        {
+            instance().m_mutex.lock();
+        }
+
+        void Tracer::parent_after_fork()
+        {
+            instance().m_mutex.unlock();
+        }
+
+        void Tracer::child_after_fork()
+        {
+            auto &tracer = instance();
+            // the parent writes what it recorded, only the forking thread lives on here
+            tracer.m_buffers.clear();
+            auto &state = thread_state();
+            if (state.m_buffer) {
+                state.m_buffer->m_events.clear();
+                state.m_buffer->m_thread_id = syscall(SYS_gettid);
+                tracer.m_buffers.push_back(state.m_buffer);
+            }
+            state.m_random = 0;
+            tracer.m_mutex.unlock();
+        }
+
+        Span::Span(const char *name, bool is_root)
+                : m_name(name)
+                  , m_is_root(is_root)
+                  , m_is_recorded(false)
+        {
+            auto &tracer = Tracer::instance();
+            if (is_root) {
+                if (tracer.is_enabled() && !Tracer::is_sampled() && tracer.sample()) {
+                    Tracer::thread_state().m_is_sampled = true;
+                    m_is_recorded = true;
+                }
+            } else {
+                m_is_recorded = Tracer::is_sampled();
+            }
+            if (m_is_recorded) {
+                m_start = Clock::now();
+            }
+        }
+
+        Span::~Span()
+        {
+            if (!m_is_recorded) {
+                return;
+            }
+            auto end = Clock::now();
+            Tracer::instance().record(m_name, m_start, end, m_args);
+            if (m_is_root) {
+                Tracer::thread_state().m_is_sampled = false;
+                Tracer::instance().flush_if_due(end);
+            }
+        }
+
+        void Span::set_arg(const std::string &key, const std::string &value)
+        {
+            if (!m_is_recorded) {
+                return;
+            }
+            if (!m_args.empty()) {
+                m_args += ',';
+            }
+            m_args += "\"" + escape(key) + "\":\"" + escape(value) + "\"";
+        }
+
+    }// namespace tracer
+}// namespace md
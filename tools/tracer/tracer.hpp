@@ -0,0 +1,133 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace md
+{
+    namespace tracer
+    {
+        using Clock = std::chrono::steady_clock;
+
+        /**
+         * Sampled per-message tracing. A root span decides whether its message is traced; spans
+         * opened on the same thread while it lives are recorded as its children. Spans go to a
+         * buffer of the recording thread and are appended to the file as Chrome trace events
+         * ({"traceEvents": [...]}), which chrome://tracing and Perfetto open directly. The thread ending
+         * a sampled message writes them every FLUSH_INTERVAL_MS, so a daemon's trace is readable while
+         * it runs; stop() writes the rest. A forked worker writes to <path>.<pid>.
+         */
+        class Tracer
+        {
+        public:
+            static Tracer &instance();
+
+            ~Tracer();
+
+            // an empty path or a zero rate disables tracing; rate is the traced share of messages
+            void start(const std::string &path, double sample_rate);
+
+            // writes the recorded spans and stops tracing, call it before _exit
+            void stop();
+
+            // writes the spans recorded so far, the file stays a complete trace
+            void flush();
+
+            bool is_enabled() const
+            {
+                return m_sample_rate > 0;
+            }
+
+            // true while a sampled root span is open on this thread
+            static bool is_sampled();
+
+            // records a finished child span of the current message
+            void record(const char *name, Clock::time_point start, Clock::time_point end
+                        , const std::string &args = std::string());
+
+        private:
+            static const size_t MAX_THREAD_EVENTS = 100000;// per thread between two writes
+
+            static const int64_t FLUSH_INTERVAL_MS = 10000;
+
+            struct Event
+            {
+                const char *m_name;
+                int64_t m_start_us;
+                int64_t m_duration_us;
+                std::string m_args;// JSON object members, may be empty
+            };
+
+            struct Buffer
+            {
+                std::mutex m_mutex;// taken by the owner for every event, uncontended but for stop()
+                std::vector<Event> m_events;
+                long m_thread_id;
+            };
+
+            struct ThreadState;
+
+            friend class Span;
+
+            Tracer();
+
+            static ThreadState &thread_state();
+
+            Buffer &buffer();
+
+            bool sample();
+
+            // under m_mutex
+            void write_events();
+
+            // flush() if the interval is over and no other thread is writing
+            void flush_if_due(Clock::time_point now);
+
+            static void prepare_fork();
+
+            static void parent_after_fork();
+
+            static void child_after_fork();
+
+            std::atomic<double> m_sample_rate;
+            std::string m_path;
+            int m_pid = 0;// the process start() was called in
+            std::string m_written_path;// the file the events go to, a forked worker starts its own
+            bool m_has_events = false;// in m_written_path
+            std::atomic<int64_t> m_next_flush_us;
+            std::mutex m_mutex;// guards the buffer list and the file
+            std::vector<std::shared_ptr<Buffer>> m_buffers;
+        };
+
+        /**
+         * Times a scope. A root span starts the trace of one message if the sampler picks it,
+         * any other span is recorded only inside a sampled root.
+         */
+        class Span
+        {
+        public:
+            explicit Span(const char *name, bool is_root = false);
+
+            ~Span();
+
+            Span(const Span &) = delete;
+
+            Span &operator=(const Span &) = delete;
+
+            // shown in the viewer's details of the span
+            void set_arg(const std::string &key, const std::string &value);
+
+        private:
+            const char *m_name;
+            bool m_is_root;
+            bool m_is_recorded;
+            Clock::time_point m_start;
+            std::string m_args;
+        };
+
+    }// namespace tracer
+}// namespace md